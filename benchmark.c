@@ -0,0 +1,348 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+// benchmark: microbenchmarks of the hot paths, 'make bench' builds and runs it. The functions measured are static,
+// so tox-defragmenter.c is compiled into this file, and its allocations are counted. Inputs are fixed and every
+// benchmark is run BENCH_ROUNDS times, the fastest round is reported.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t benchAllocs = 0;
+static void* benchMalloc(size_t size) __attribute__((unused));
+static void* benchCalloc(size_t num, size_t size);
+static void* benchRealloc(void *ptr, size_t size);
+
+#define malloc(size) benchMalloc(size)
+#define calloc(num, size) benchCalloc(num, size)
+#define realloc(ptr, size) benchRealloc(ptr, size)
+#include "tox-defragmenter.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define BENCH_ROUNDS 3
+#define BENCH_FRIEND 0
+
+static uint64_t benchStartNs, benchEndNs;
+static uint64_t benchStartAllocs, benchEndAllocs;
+static volatile uint64_t benchSink; // results go here so that the loops aren't optimized out
+static uint64_t benchRandState;
+static uint32_t benchReceiptNext = 0;   // receipts of the toxcore stub
+static msg_outbound benchMsg;       // receipts of the table benchmarks point to it
+
+// allocations
+
+static void* benchMalloc(size_t size) {
+  benchAllocs++;
+  return malloc(size);
+}
+
+static void* benchCalloc(size_t num, size_t size) {
+  benchAllocs++;
+  return calloc(num, size);
+}
+
+static void* benchRealloc(void *ptr, size_t size) {
+  benchAllocs++;
+  return realloc(ptr, size);
+}
+
+// timing
+
+static uint64_t benchNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void benchBegin() {
+  benchStartAllocs = benchAllocs;
+  benchStartNs = benchNs();
+}
+
+static void benchEnd() {
+  benchEndNs = benchNs();
+  benchEndAllocs = benchAllocs;
+}
+
+static uint64_t benchRand() {
+  // xorshift64, seeded for every round
+  benchRandState ^= benchRandState << 13;
+  benchRandState ^= benchRandState >> 7;
+  benchRandState ^= benchRandState << 17;
+  return benchRandState;
+}
+
+static void benchRun(const char *name, unsigned arg, uint64_t (*fn)(unsigned arg)) {
+  // fn sets up, times its loop with benchBegin/benchEnd, cleans up, and returns the number of operations
+  uint64_t ops = 0, ns = UINT64_MAX, allocs = 0;
+  for (unsigned r = 0; r < BENCH_ROUNDS; r++) {
+    benchRandState = 0x9e3779b97f4a7c15;
+    ops = fn(arg);
+    if (benchEndNs - benchStartNs < ns) {
+      ns = benchEndNs - benchStartNs;
+      allocs = benchEndAllocs - benchStartAllocs;
+    }
+  }
+  char label[64];
+  snprintf(label, sizeof(label), arg ? "%s/%u" : "%s", name, arg);
+  printf("%-36s %10"PRIu64" ops %12.1f ns/op %8.3f allocs/op\n", label, ops, (double)ns/ops, (double)allocs/ops);
+}
+
+// markers
+
+#define MARKER_OPS 1000000
+
+static uint64_t benchMarkerPrint(unsigned arg) {
+  uint8_t marker[64];
+  uint64_t sum = 0;
+  benchBegin();
+  for (unsigned i = 0; i < MARKER_OPS; i++)
+    sum += markerPrint(0x123456789a + i, i%1000 + 1, 1000, (i%1000)*1300, 1300000, marker);
+  benchEnd();
+  benchSink = sum;
+  return MARKER_OPS;
+}
+
+static uint64_t benchMarkerParse(unsigned arg) {
+  uint8_t message[TOX_MAX_MESSAGE_LENGTH];
+  memset(message, 'x', sizeof(message));
+  uint8_t markerSize = markerPrint(0x123456789a, 777, 1000, 776*1300, 1300000, message);
+  uint64_t id, sum = 0;
+  unsigned partNo, numParts, off, sz;
+  benchBegin();
+  for (unsigned i = 0; i < MARKER_OPS; i++)
+    sum += markerParse(message, markerSize + 1300, &id, &partNo, &numParts, &off, &sz) + partNo;
+  benchEnd();
+  benchSink = sum;
+  return MARKER_OPS;
+}
+
+static uint64_t benchMarkerExists(int fragment) {
+  uint8_t message[TOX_MAX_MESSAGE_LENGTH];
+  memset(message, 'x', sizeof(message));
+  size_t length = 1300;
+  if (fragment)
+    length += markerPrint(0x123456789a, 777, 1000, 776*1300, 1300000, message);
+  else
+    memcpy(message, "Plain message that the client sends", 35);
+  uint64_t sum = 0;
+  benchBegin();
+  for (unsigned i = 0; i < MARKER_OPS; i++)
+    sum += markerExists(message, length);
+  benchEnd();
+  benchSink = sum;
+  return MARKER_OPS;
+}
+
+static uint64_t benchMarkerExistsFragment(unsigned arg) {
+  return benchMarkerExists(1);
+}
+
+static uint64_t benchMarkerExistsPlain(unsigned arg) {
+  return benchMarkerExists(0);
+}
+
+// split
+
+static uint64_t benchSplitMessage(unsigned size) {
+  // 64MB are split in every round, messages are freed outside of the timed loop
+  unsigned num = (64u << 20)/size;
+  uint8_t *message = malloc(size);
+  for (unsigned i = 0; i < size; i++)
+    message[i] = 'a' + i%26;
+  msg_outbound **msgs = malloc(num*sizeof(msg_outbound*));
+  benchBegin();
+  for (unsigned i = 0; i < num; i++)
+    msgs[i] = splitMessage(message, size, params.maxMessageLength, i+1);
+  benchEnd();
+  for (unsigned i = 0; i < num; i++)
+    msgOutboundDelete(msgs[i]);
+  free(msgs);
+  free(message);
+  return num;
+}
+
+static uint64_t benchMessageLifetime(unsigned size) {
+  // 64MB go through split, confirmation of every part and deletion, one message at a time, so the pools
+  // give the same blocks back to every next message
+  unsigned num = (64u << 20)/size;
+  uint8_t *message = malloc(size);
+  for (unsigned i = 0; i < size; i++)
+    message[i] = 'a' + i%26;
+  benchBegin();
+  for (unsigned i = 0; i < num; i++) {
+    msg_outbound *msg = splitMessage(message, size, params.maxMessageLength, i+1);
+    for (unsigned p = 0; p < msg->numParts; p++) {
+      poolPut(msg->fragments[p].data, msg->fragments[p].length);
+      msg->fragments[p].data = NULL;
+    }
+    msgOutboundDelete(msg);
+  }
+  benchEnd();
+  free(message);
+  return num;
+}
+
+// receipts
+
+static void benchReceiptsFill(unsigned num, msg_outbound *msg) {
+  // receipts 1..num of the parts 1..num in flight, as toxcore numbers them
+  uint64_t now = getCurrTimeMs();
+  for (unsigned r = 1; r <= num; r++)
+    addReceipt(r, msg, r, NULL, now);
+}
+
+static void benchReceiptsReset() {
+  receiptsUninitialize();
+  receiptsInitialize();
+}
+
+static uint64_t benchAddReceipt(unsigned num) {
+  benchReceiptsReset();
+  benchBegin();
+  benchReceiptsFill(num, &benchMsg);
+  benchEnd();
+  benchReceiptsReset();
+  return num;
+}
+
+static uint64_t benchFindReceipt(unsigned num) {
+  benchReceiptsReset();
+  benchReceiptsFill(num, &benchMsg);
+  uint64_t sum = 0;
+  benchBegin();
+  for (unsigned i = 0; i < num; i++)
+    sum += findReceipt(1 + benchRand()%num);
+  benchEnd();
+  benchSink = sum;
+  benchReceiptsReset();
+  return num;
+}
+
+static void benchNoReceipt(Tox *tox, uint32_t friend_number, uint32_t message_id, void *user_data) {
+}
+
+static uint64_t benchTryProcessReceipt(unsigned num, int shuffled) {
+  // the message of num parts, all in flight: every receipt confirms its part, the last one completes the message
+  benchReceiptsReset();
+  uint64_t *bits = PNEWA(uint64_t, 2*BITS_WORDS(num));
+  memset(bits, 0, 2*BITS_WORDS(num)*sizeof(uint64_t));
+  msg_outbound *msg = PNEW(msg_outbound);
+  *msg = (msg_outbound){.friend_number = BENCH_FRIEND, .id = 1, .length = num, .numParts = num,
+                        .fragments = PNEWA(fragment, num), .confirmed = bits, .idle = bits + BITS_WORDS(num),
+                        .idleFrom = num, .numTransit = num, .sendTm = getCurrTimeMs()};
+  for (unsigned i = 0; i < num; i++)
+    msg->fragments[i] = (fragment){.length = 1, .receipt = i+1, .timesSent = 1, .sentTm = msg->sendTm};
+  msgsOutboundLink(msg);
+  benchReceiptsFill(num, msg);
+  uint32_t *order = malloc(num*sizeof(uint32_t));
+  for (unsigned i = 0; i < num; i++)
+    order[i] = i+1;
+  if (shuffled)
+    for (unsigned i = num-1; i > 0; i--) {
+      unsigned j = benchRand()%(i+1);
+      uint32_t o = order[i];
+      order[i] = order[j];
+      order[j] = o;
+    }
+  uint64_t sum = 0;
+  benchBegin();
+  for (unsigned i = 0; i < num; i++)
+    sum += tryProcessReceipt(NULL, order[i], NULL);
+  benchEnd();
+  if (sum != num || msgsOutbound)
+    ERROR("%u receipts of %u were processed", (unsigned)sum, num)
+  free(order);
+  benchReceiptsReset();
+  return num;
+}
+
+static uint64_t benchTryProcessReceiptInOrder(unsigned num) {
+  return benchTryProcessReceipt(num, 0);
+}
+
+static uint64_t benchTryProcessReceiptShuffled(unsigned num) {
+  return benchTryProcessReceipt(num, 1);
+}
+
+static uint64_t benchSendMessage(unsigned numParts) {
+  // the message of numParts small parts is sent through the window, its receipts come in order
+  unsigned maxLength = 128;
+  size_t size = (size_t)numParts*(maxLength - markerMaxSizeBytes(numParts, numParts*maxLength));
+  uint8_t *message = malloc(size);
+  memset(message, 'x', size);
+  msg_outbound *msg = splitMessage(message, size, maxLength, 1);
+  msg->friend_number = BENCH_FRIEND;
+  msgsOutboundLink(msg);
+  benchReceiptsReset();
+  uint32_t receipt = benchReceiptNext + 1;
+  unsigned num = msg->numParts;
+  benchBegin();
+  msgSendNextParts(NULL, msg);
+  while (msgsOutbound)
+    tryProcessReceipt(NULL, receipt++, NULL);
+  benchEnd();
+  benchReceiptsReset();
+  free(message);
+  return num;
+}
+
+static uint64_t benchResendExpiredReceipts(unsigned num) {
+  // scans of the table where nothing has expired, which is what the periodic thread does most of the time
+  unsigned scans = 10000000/num;
+  benchReceiptsReset();
+  benchReceiptsFill(num, &benchMsg);
+  benchBegin();
+  for (unsigned i = 0; i < scans; i++)
+    resendExpiredReceipts(NULL);
+  benchEnd();
+  benchReceiptsReset();
+  return scans;
+}
+
+// stubs of toxcore
+
+static uint32_t benchFriendSendMessage(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                                       size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error) {
+  return ++benchReceiptNext;
+}
+
+static TOX_CONNECTION benchConnectionStatus(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error) {
+  return TOX_CONNECTION_UDP;
+}
+
+int main(int argc, char *argv[]) {
+  // toxcore without the lossless packets, so the parts go as messages with receipts
+  ToxcoreApi api = {.tox_friend_get_connection_status = benchConnectionStatus,
+                    .tox_friend_send_message = benchFriendSendMessage};
+  MY(initialize_api)(&api);
+  MY(initialize_db_inmemory)();
+  CLIENT(friend_read_receipt_cb) = benchNoReceipt;
+
+  benchRun("markerPrint", 0, benchMarkerPrint);
+  benchRun("markerParse", 0, benchMarkerParse);
+  benchRun("markerExists/fragment", 0, benchMarkerExistsFragment);
+  benchRun("markerExists/plain", 0, benchMarkerExistsPlain);
+  for (unsigned size = 1024; size <= (4u << 20); size *= 16)
+    benchRun("splitMessage", size, benchSplitMessage);
+  for (unsigned size = 1024; size <= (4u << 20); size *= 16)
+    benchRun("messageLifetime", size, benchMessageLifetime);
+  for (unsigned num = 1000; num <= 100000; num *= 10)
+    benchRun("sendMessage/parts", num, benchSendMessage);
+  for (unsigned num = 1000; num <= 1000000; num *= 10) {
+    benchRun("addReceipt", num, benchAddReceipt);
+    benchRun("findReceipt", num, benchFindReceipt);
+    benchRun("tryProcessReceipt/in-order", num, benchTryProcessReceiptInOrder);
+    benchRun("tryProcessReceipt/shuffled", num, benchTryProcessReceiptShuffled);
+    benchRun("resendExpiredReceipts/scan", num, benchResendExpiredReceipts);
+  }
+
+  MY(uninitialize)();
+  return 0;
+}
@@ -0,0 +1,91 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include "common.h"
+#include "bloom.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The filter is sized for the false positive rate of about 1e-6 at full capacity:
+// 29 bits and 20 hash functions per key.
+#define BITS_PER_KEY 29
+#define NUM_HASHES   20
+// the number of bits has to fit into unsigned
+#define MAX_CAPACITY (UINT_MAX/BITS_PER_KEY)
+
+// internal declarations
+
+static uint64_t mix(uint64_t h);
+
+// functions
+
+FUNC_LOCAL bloom* bloomCreate(unsigned capacity) {
+  // the capacity is clamped, also the one loaded from the database
+  if (capacity < 1)
+    capacity = 1;
+  else if (capacity > MAX_CAPACITY)
+    capacity = MAX_CAPACITY;
+  unsigned numBits = capacity*BITS_PER_KEY;
+  bloom *b = calloc(1, sizeof(bloom) + (numBits+7)/8);
+  b->capacity = capacity;
+  b->numBits = numBits;
+  b->numHashes = NUM_HASHES;
+  return b;
+}
+
+FUNC_LOCAL bloom* bloomLoad(unsigned capacity, unsigned num, const uint8_t *bits, unsigned length) {
+  bloom *b = bloomCreate(capacity);
+  if (length != bloomSizeBytes(b)) {
+    bloomDelete(b);
+    return NULL;
+  }
+  b->num = num;
+  memcpy(b->bits, bits, length);
+  return b;
+}
+
+FUNC_LOCAL unsigned bloomSizeBytes(const bloom *b) {
+  return (b->numBits+7)/8;
+}
+
+FUNC_LOCAL void bloomAdd(bloom *b, uint64_t key1, uint64_t key2) {
+  uint64_t h1 = mix(key1 ^ mix(key2));
+  uint64_t h2 = mix(h1 ^ key2) | 1;
+  for (unsigned i = 0; i < b->numHashes; i++) {
+    unsigned bit = (h1 + i*h2) % b->numBits;
+    b->bits[bit/8] |= 1 << (bit%8);
+  }
+  b->num++;
+}
+
+FUNC_LOCAL int bloomContains(const bloom *b, uint64_t key1, uint64_t key2) {
+  uint64_t h1 = mix(key1 ^ mix(key2));
+  uint64_t h2 = mix(h1 ^ key2) | 1;
+  for (unsigned i = 0; i < b->numHashes; i++) {
+    unsigned bit = (h1 + i*h2) % b->numBits;
+    if (!(b->bits[bit/8] & (1 << (bit%8))))
+      return 0;
+  }
+  return 1;
+}
+
+FUNC_LOCAL int bloomIsFull(const bloom *b) {
+  return b->num >= b->capacity;
+}
+
+FUNC_LOCAL void bloomDelete(bloom *b) {
+  free(b);
+}
+
+// internal definitions
+
+static uint64_t mix(uint64_t h) { // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
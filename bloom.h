@@ -0,0 +1,21 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include <stdint.h>
+
+typedef struct bloom {
+  unsigned capacity;  // number of keys the filter is sized for
+  unsigned num;       // number of keys added
+  unsigned numBits;
+  unsigned numHashes;
+  uint8_t  bits[];
+} bloom;
+
+bloom* bloomCreate(unsigned capacity);
+bloom* bloomLoad(unsigned capacity, unsigned num, const uint8_t *bits, unsigned length);
+unsigned bloomSizeBytes(const bloom *b);
+void bloomAdd(bloom *b, uint64_t key1, uint64_t key2);
+int bloomContains(const bloom *b, uint64_t key1, uint64_t key2);
+int bloomIsFull(const bloom *b);
+void bloomDelete(bloom *b);
@@ -0,0 +1,94 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include "common.h"
+#include "clock.h"
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define CLOCK_CHEAP CLOCK_MONOTONIC_COARSE // Linux: the tick, no syscall
+#elif defined(CLOCK_MONOTONIC_FAST)
+#define CLOCK_CHEAP CLOCK_MONOTONIC_FAST   // FreeBSD: the same
+#else
+#define CLOCK_CHEAP CLOCK_MONOTONIC
+#endif
+
+static uint64_t baseMs = 0;     // wall clock at the start
+static uint64_t baseMonoMs = 0; // monotonic clock at the start
+static ClockNowCb nowCb = NULL;
+static void *nowUserData = NULL;
+static pthread_mutex_t sleepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleepCond;
+static uint8_t sleepWoken = 0;
+
+// internal declarations
+
+static __attribute__((constructor(101))) void clockInit(); // before the periodic thread starts
+static uint64_t monoMs(clockid_t id);
+
+// functions
+
+FUNC_LOCAL void clockSet(ClockNowCb cb, void *user_data) {
+  nowUserData = user_data;
+  nowCb = cb;
+}
+
+FUNC_LOCAL int clockIsVirtual() {
+  return nowCb != NULL;
+}
+
+FUNC_LOCAL uint64_t clockNowMs() {
+  if (nowCb)
+    return nowCb(nowUserData);
+  return clockWallMs();
+}
+
+FUNC_LOCAL uint64_t clockWallMs() {
+  return baseMs + (monoMs(CLOCK_CHEAP) - baseMonoMs);
+}
+
+FUNC_LOCAL void clockSleepMs(unsigned ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += ms/1000;
+  ts.tv_nsec += (ms%1000)*1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&sleepLock);
+  while (!sleepWoken && pthread_cond_timedwait(&sleepCond, &sleepLock, &ts) == 0)
+    ;
+  sleepWoken = 0;
+  pthread_mutex_unlock(&sleepLock);
+}
+
+FUNC_LOCAL void clockWake() {
+  pthread_mutex_lock(&sleepLock);
+  sleepWoken = 1;
+  pthread_cond_broadcast(&sleepCond);
+  pthread_mutex_unlock(&sleepLock);
+}
+
+// internal definitions
+
+static void clockInit() {
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  baseMonoMs = monoMs(CLOCK_CHEAP);
+  baseMs = (uint64_t)tm.tv_sec*1000 + tm.tv_usec/1000;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sleepCond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static uint64_t monoMs(clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
@@ -0,0 +1,21 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include <stdint.h>
+
+// Clock: the time of the library in milliseconds. By default the wall clock is read once, and the coarse
+// monotonic clock advances it, so reading is cheap, the time doesn't go back when the wall clock is set,
+// and the times stored in the DB stay comparable across the restarts. The client can install its own
+// clock instead, the virtual clock of the simulation then moves only when the simulation moves it.
+
+typedef uint64_t (*ClockNowCb)(void *user_data);
+
+void clockSet(ClockNowCb cb, void *user_data);
+int clockIsVirtual();
+uint64_t clockNowMs();
+// the default clock also when the virtual one is installed: message ids are the wall clock times of 13 digits
+uint64_t clockWallMs();
+// the periodic thread sleeps on the monotonic clock, clockWake cuts the sleep short
+void clockSleepMs(unsigned ms);
+void clockWake();
@@ -0,0 +1,198 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include "common.h"
+#include "control.h"
+#include "database.h"
+#include <string.h>
+
+// Packet layout, integers are little endian:
+//   hello:      id type version reply caps:4
+//   sack query: id type msgId:8
+//   sack:       id type msgId:8 state numParts:4 trigger:4 first:4 count:4 bitmap:(count+7)/8
+//   fragment:   id type msgType msgId:8 partNo:4 numParts:4 off:4 size:4 data
+//   ack:        id type msgId:8 partNo:4
+//   checksum:   id type msgId:8 crc:4
+// the fragment header is never longer than the marker, so the part fits in the packet when it fits in the message
+#define szHead      2
+#define szHello     (szHead+1+1+4)
+#define szSackQuery (szHead+8)
+#define szSackHead  (szHead+8+1+4+4+4+4)
+#define szFragHead  (szHead+1+8+4+4+4+4)
+#define szAck       (szHead+8+4)
+#define szChecksum  (szHead+8+4)
+
+// internal declarations
+
+static uint8_t* putU32(uint8_t *p, uint32_t v);
+static uint8_t* putU64(uint8_t *p, uint64_t v);
+static uint32_t getU32(const uint8_t *p);
+static uint64_t getU64(const uint8_t *p);
+
+// functions
+
+FUNC_LOCAL size_t controlPrintHello(uint8_t *buf, int reply, uint32_t caps) {
+  uint8_t *p = buf;
+  *p++ = CONTROL_PACKET_ID;
+  *p++ = CONTROL_HELLO;
+  *p++ = CONTROL_VERSION;
+  *p++ = reply ? 1 : 0;
+  p = putU32(p, caps);
+  return p - buf;
+}
+
+FUNC_LOCAL size_t controlPrintSackQuery(uint8_t *buf, uint64_t id) {
+  uint8_t *p = buf;
+  *p++ = CONTROL_PACKET_ID;
+  *p++ = CONTROL_SACK_QUERY;
+  p = putU64(p, id);
+  return p - buf;
+}
+
+FUNC_LOCAL size_t controlPrintSack(uint8_t *buf, uint64_t id, uint8_t state, unsigned numParts, unsigned trigger,
+                                   unsigned first, unsigned count, const uint8_t *received) {
+  // 'received' is the bitmap of all parts, its bits first..first+count-1 are copied
+  uint8_t *p = buf;
+  *p++ = CONTROL_PACKET_ID;
+  *p++ = CONTROL_SACK;
+  p = putU64(p, id);
+  *p++ = state;
+  p = putU32(p, numParts);
+  p = putU32(p, trigger);
+  p = putU32(p, first);
+  p = putU32(p, count);
+  memset(p, 0, (count+7)/8);
+  for (unsigned i = 0; i < count; i++)
+    if (received[(first+i)/8] & (1 << ((first+i)%8)))
+      p[i/8] |= 1 << (i%8);
+  return p + (count+7)/8 - buf;
+}
+
+FUNC_LOCAL unsigned controlSackMaxParts(size_t maxSize) {
+  return (maxSize - szSackHead)*8;
+}
+
+FUNC_LOCAL size_t controlPrintFragment(uint8_t *buf, uint8_t msgType, uint64_t id, unsigned partNo, unsigned numParts,
+                                       unsigned off, unsigned size, const uint8_t *data, size_t length) {
+  uint8_t *p = buf;
+  *p++ = CONTROL_PACKET_ID;
+  *p++ = CONTROL_FRAGMENT;
+  *p++ = msgType;
+  p = putU64(p, id);
+  p = putU32(p, partNo);
+  p = putU32(p, numParts);
+  p = putU32(p, off);
+  p = putU32(p, size);
+  memcpy(p, data, length);
+  return p + length - buf;
+}
+
+FUNC_LOCAL size_t controlFragmentSize(size_t length) {
+  return szFragHead + length;
+}
+
+FUNC_LOCAL size_t controlPrintAck(uint8_t *buf, uint64_t id, unsigned partNo) {
+  uint8_t *p = buf;
+  *p++ = CONTROL_PACKET_ID;
+  *p++ = CONTROL_ACK;
+  p = putU64(p, id);
+  p = putU32(p, partNo);
+  return p - buf;
+}
+
+FUNC_LOCAL size_t controlPrintChecksum(uint8_t *buf, uint64_t id, uint32_t crc) {
+  uint8_t *p = buf;
+  *p++ = CONTROL_PACKET_ID;
+  *p++ = CONTROL_CHECKSUM;
+  p = putU64(p, id);
+  p = putU32(p, crc);
+  return p - buf;
+}
+
+FUNC_LOCAL int controlParse(const uint8_t *data, size_t length, control *c) {
+  // returns 1 when the packet is the valid control packet
+  if (length < szHead || data[0] != CONTROL_PACKET_ID)
+    return 0;
+  *c = (control){.type = data[1]};
+  const uint8_t *p = data + szHead;
+  switch (c->type) {
+  case CONTROL_HELLO:
+    if (length < szHello)
+      return 0;
+    c->version = p[0];
+    c->reply = p[1];
+    c->caps = getU32(p+2);
+    return 1;
+  case CONTROL_SACK_QUERY:
+    if (length < szSackQuery)
+      return 0;
+    c->id = getU64(p);
+    return 1;
+  case CONTROL_SACK:
+    if (length < szSackHead)
+      return 0;
+    c->id = getU64(p);
+    c->state = p[8];
+    c->numParts = getU32(p+9);
+    c->trigger = getU32(p+13);
+    c->first = getU32(p+17);
+    c->count = getU32(p+21);
+    c->bits = p+25;
+    return (length - szSackHead)*8 >= c->count && c->first <= c->numParts && c->count <= c->numParts - c->first;
+  case CONTROL_FRAGMENT:
+    if (length < szFragHead)
+      return 0;
+    c->msgType = p[0];
+    c->id = getU64(p+1);
+    c->partNo = getU32(p+9);
+    c->numParts = getU32(p+13);
+    c->off = getU32(p+17);
+    c->size = getU32(p+21);
+    c->data = data + szFragHead;
+    c->length = length - szFragHead;
+    return dbFragmentValid(c->partNo, c->numParts, c->off, c->size, c->length);
+  case CONTROL_ACK:
+    if (length < szAck)
+      return 0;
+    c->id = getU64(p);
+    c->partNo = getU32(p+8);
+    return 1;
+  case CONTROL_CHECKSUM:
+    if (length < szChecksum)
+      return 0;
+    c->id = getU64(p);
+    c->crc = getU32(p+8);
+    return 1;
+  default:
+    return 0; // unknown type, from the newer version
+  }
+}
+
+// internal definitions
+
+static uint8_t* putU32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    *p++ = v >> (8*i);
+  return p;
+}
+
+static uint8_t* putU64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    *p++ = v >> (8*i);
+  return p;
+}
+
+static uint32_t getU32(const uint8_t *p) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++)
+    v |= (uint32_t)p[i] << (8*i);
+  return v;
+}
+
+static uint64_t getU64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v |= (uint64_t)p[i] << (8*i);
+  return v;
+}
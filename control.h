@@ -0,0 +1,75 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// control packets are exchanged by the defragmenters over toxcore lossless custom packets with this id,
+// the other lossless packets belong to the client
+#define CONTROL_PACKET_ID 0xb4
+#define CONTROL_VERSION   1
+
+// packet types
+#define CONTROL_HELLO      1 // capabilities, answered with the reply by the peer that didn't know ours
+#define CONTROL_SACK_QUERY 2 // sender asks for the sack of the message
+#define CONTROL_SACK       3 // receiver reports the parts it has
+#define CONTROL_FRAGMENT   4 // part of the message, instead of the toxcore message with the marker
+#define CONTROL_ACK        5 // receiver has the part sent in the packet
+#define CONTROL_CHECKSUM   6 // CRC-32C of the whole message, sent before its parts
+
+// capabilities
+#define CONTROL_CAP_SACK    0x00000001
+#define CONTROL_CAP_PACKETS 0x00000002 // fragments in the lossless packets
+#define CONTROL_CAP_BATCH   0x00000004 // batches of short messages
+#define CONTROL_CAP_CHECKSUM 0x00000008 // reassembled messages are verified, the sack tells the result
+#define CONTROL_CAP_BINARY  0x00000010 // binary payloads in the fragments
+
+// flag in the message type of the fragment: the binary payload for the binary callback, not the text message
+#define CONTROL_TYPE_BINARY 0x80
+
+// states of the message in the sack
+#define CONTROL_SACK_UNKNOWN 0 // receiver has nothing of the message
+#define CONTROL_SACK_PARTIAL 1 // bitmap of the received parts follows
+#define CONTROL_SACK_DONE    2 // receiver has the whole message
+#define CONTROL_SACK_CORRUPT 3 // receiver has the whole message, and it doesn't match the checksum
+
+typedef struct control {
+  uint8_t        type;
+  // hello
+  uint8_t        version;
+  uint8_t        reply;
+  uint32_t       caps;
+  // sack query, sack, fragment, ack, checksum
+  uint64_t       id;
+  // checksum
+  uint32_t       crc;
+  // sack
+  uint8_t        state;
+  // sack, fragment
+  unsigned       numParts;
+  // fragment, ack
+  unsigned       partNo;
+  // fragment
+  uint8_t        msgType;
+  unsigned       off;
+  unsigned       size;     // size of the whole message
+  const uint8_t *data;     // points into the packet
+  size_t         length;
+  unsigned       trigger;  // part whose arrival caused the sack, 0 in the reply to the query
+  unsigned       first;    // first part in the bitmap, 0-based
+  unsigned       count;    // number of parts in the bitmap
+  const uint8_t *bits;     // bit i is set when the part first+i is received, points into the packet
+} control;
+
+size_t controlPrintHello(uint8_t *buf, int reply, uint32_t caps);
+size_t controlPrintSackQuery(uint8_t *buf, uint64_t id);
+size_t controlPrintSack(uint8_t *buf, uint64_t id, uint8_t state, unsigned numParts, unsigned trigger,
+                        unsigned first, unsigned count, const uint8_t *received);
+unsigned controlSackMaxParts(size_t maxSize);
+size_t controlPrintFragment(uint8_t *buf, uint8_t msgType, uint64_t id, unsigned partNo, unsigned numParts,
+                            unsigned off, unsigned size, const uint8_t *data, size_t length);
+size_t controlFragmentSize(size_t length);
+size_t controlPrintAck(uint8_t *buf, uint64_t id, unsigned partNo);
+size_t controlPrintChecksum(uint8_t *buf, uint64_t id, uint32_t crc);
+int controlParse(const uint8_t *data, size_t length, control *c);
@@ -0,0 +1,66 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+// storage backends: database.c dispatches the db* functions to the backend that was initialized
+
+typedef struct DbBackend {
+  void (*uninitialize)();
+  void (*insertInboundFragment)(void *tox_opaque,
+                                uint32_t friend_number, int type, uint64_t id,
+                                unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                const uint8_t *data, size_t length,
+                                uint64_t tm,
+                                DbMsgReadyCb msgReadyCb,
+                                void *user_data);
+  void (*insertOutboundMessage)(uint32_t friend_number, int type, uint64_t id,
+                                uint64_t tm,
+                                unsigned numParts,
+                                const uint8_t *data, size_t length,
+                                uint32_t receipt);
+  void (*outboundPartConfirmed)(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm);
+  void (*loadPendingSentMessages)(DbMsgPendingSentCb msgPendingSentCb);
+  void (*clearOutboundPending)(uint32_t friend_number, uint64_t id);
+  DbInboundState (*inboundReceived)(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received);
+  void (*periodic)();
+  void (*commit)();      // called by the writer thread with DB_DURABILITY_ASYNC, NULL when there's nothing to commit
+  // messages finished before the restart and not yet delivered, NULL when the backend never leaves them
+  void (*deliverUndelivered)(void *tox_opaque, DbMsgReadyCb msgReadyCb, void *user_data);
+} DbBackend;
+
+// settings shared by the backends, they can be changed before the backend is initialized
+typedef struct DbSettings {
+  DbDurability durability;
+  unsigned     groupCommitTimeMs;
+  unsigned     groupCommitOps;
+  unsigned     gcHistoryTimeSec;   // how long the ids of the finished inbound messages are kept
+  unsigned     gcFilterCapacity;   // SQLite: capacity of the duplicate filter generation
+  // limits of the incomplete inbound messages, 0 means no limit
+  unsigned     inMaxBytesPerFriend;
+  unsigned     inMaxMsgsPerFriend;
+  uint64_t     inMaxBytes;
+  unsigned     inMaxMsgs;
+  unsigned     inIdleTimeSec;      // incomplete messages without new fragments for that long are dropped
+} DbSettings;
+extern DbSettings dbSettings;
+
+// bytes of the bitmap of the received inbound parts
+#define DB_BITMAP_SIZE(numParts) (((size_t)(numParts)+7)/8)
+
+// backends call this with DB_DURABILITY_ASYNC when they have operations to commit
+void dbWriterSignal();
+
+// accounting of the incomplete inbound messages against the limits in dbSettings,
+// the backends call these under their own lock, and charge the messages they already have when initialized
+int dbQuotaAdmit(uint32_t friend_number, unsigned size, unsigned numParts);
+void dbQuotaCharge(uint32_t friend_number, unsigned size, unsigned numParts);
+void dbQuotaRelease(uint32_t friend_number, unsigned size, unsigned numParts);
+void dbQuotaDuplicate(uint32_t friend_number); // the fragment was dropped as the duplicate
+void dbQuotaReset();
+
+// backends
+#if !defined(NO_SQLITE)
+const DbBackend* dbSqliteInitialize(sqlite3 *db, DbLockCb lockCb, DbUnlockCb unlockCb, void *user_data);
+#endif
+const DbBackend* dbMemoryInitialize();
+const DbBackend* dbJournalInitialize(const char *path);
@@ -0,0 +1,631 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include "common.h"
+#include "database.h"
+#include "database-backend.h"
+#include "database-memory.h"
+#include "util.h"
+#include "clock.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// The journal is an append-only file of checksummed records, every change of the state is appended as a record.
+// The whole state is kept in the memory store (database-memory.c), so the journal is only read when it is opened, and it is compacted by
+// writing the live state into a new file once the file grows well beyond that.
+// record: length(4) crc32c(4) type(1) payload(length), the checksum covers the type and the payload,
+// integers are in the host byte order. Replay stops at the first damaged record, which is where
+// the writing was interrupted, and the journal is truncated there.
+
+// macros
+#define LOG(fmt...) //utilLog(__FUNCTION__, "Journal", fmt);
+#define JOURNAL_MAGIC "TOXDFRJ1"
+#define JOURNAL_COMPACT_MIN_SIZE (1024*1024)
+#define RECORD_HEADER_SIZE 9
+
+// record types
+enum {
+  REC_IN_FRAGMENT   = 1, // friend_number type id partNo numParts off sz tm data
+  REC_IN_DONE       = 2, // friend_number id tm: the message is delivered, only its id is kept for the history time
+  REC_IN_STATE      = 3, // friend_number type id tm1 tm2 numParts numDone sz received data: written by compaction
+  REC_OUT_MESSAGE   = 4, // friend_number type id tm numParts receipt data
+  REC_OUT_CONFIRMED = 5, // friend_number id partNo tm
+  REC_OUT_CLEARED   = 6, // friend_number id
+  REC_OUT_STATE     = 7  // friend_number type id tm1 tm2 numParts receipt confirmed data: written by compaction
+};
+
+// journal file: 'lock' guards the state and the write buffer, 'commitLock' guards the file itself,
+// it is taken first, and the async commit only holds 'commitLock' while it writes
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+static char *path = NULL;
+static int fd = -1;
+static uint64_t fileSize = 0;
+static uint64_t compactedSize = 0;
+
+// records that aren't yet written
+static uint8_t *wbuf = NULL;
+static size_t wbufLen = 0;
+static size_t wbufAlloc = 0;
+static size_t wrecStart = 0;   // start of the last record
+static unsigned wOps = 0;
+static uint64_t wStartTm = 0;
+
+// records that the writer thread is writing
+static uint8_t *cbuf = NULL;
+static size_t cbufAlloc = 0;
+
+// replay
+typedef struct reader {
+  const uint8_t *p;
+  const uint8_t *end;
+  int ok;
+} reader;
+
+// internal declarations
+static void journalUninitialize();
+static void journalInsertInboundFragment(void *tox_opaque,
+                                         uint32_t friend_number, int type, uint64_t id,
+                                         unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                         const uint8_t *data, size_t length,
+                                         uint64_t tm,
+                                         DbMsgReadyCb msgReadyCb,
+                                         void *user_data);
+static void journalInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
+                                         uint64_t tm,
+                                         unsigned numParts,
+                                         const uint8_t *data, size_t length,
+                                         uint32_t receipt);
+static void journalOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm);
+static void journalLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb);
+static void journalClearOutboundPending(uint32_t friend_number, uint64_t id);
+static DbInboundState journalInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received);
+static void journalPeriodic();
+static void journalCommitAsync();
+static void journalExpired(mem_msg *m);
+static uint64_t currTimeMs();
+static void recBegin(uint8_t type);
+static void recPut(const void *data, size_t length);
+static void recU32(uint32_t v);
+static void recU64(uint64_t v);
+static void recEnd();
+static void journalOp(int mustCommit);
+static void journalCommit();
+static void journalCommitNow();
+static void writeAll(int wfd, const uint8_t *data, size_t length);
+static void syncFd(int sfd);
+static void replay();
+static int replayRecord(uint8_t type, reader *r);
+static uint32_t getU32(reader *r);
+static uint64_t getU64(reader *r);
+static const uint8_t* getBytes(reader *r, size_t length);
+static void compact();
+static void writeState(mem_msg *m);
+static void err(const char *op);
+
+// backend object
+static const DbBackend backend = {
+  journalUninitialize,
+  journalInsertInboundFragment,
+  journalInsertOutboundMessage,
+  journalOutboundPartConfirmed,
+  journalLoadPendingSentMessages,
+  journalClearOutboundPending,
+  journalInboundReceived,
+  journalPeriodic,
+  journalCommitAsync,
+  NULL                // the message is marked as done instead of its last fragment
+};
+
+// functions
+
+FUNC_LOCAL const DbBackend* dbJournalInitialize(const char *newPath) {
+  pthread_mutex_lock(&commitLock);
+  pthread_mutex_lock(&lock);
+  path = strdup(newPath);
+  if ((fd = open(path, O_RDWR|O_CREAT, 0600)) == -1)
+    err("opening the journal");
+  replay();
+  memQuotaChargeAll();
+  compactedSize = fileSize;
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&commitLock);
+  return &backend;
+}
+
+static void journalUninitialize() {
+  pthread_mutex_lock(&commitLock);
+  pthread_mutex_lock(&lock);
+  journalCommit();
+  if (close(fd) == -1)
+    err("closing the journal");
+  fd = -1;
+  free(path);
+  path = NULL;
+  fileSize = compactedSize = 0;
+  memMsgsDeleteAll();
+  free(wbuf);
+  wbuf = NULL;
+  wbufLen = wbufAlloc = 0;
+  free(cbuf);
+  cbuf = NULL;
+  cbufAlloc = 0;
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&commitLock);
+}
+
+static void journalInsertInboundFragment(void *tox_opaque,
+                                         uint32_t friend_number, int type, uint64_t id,
+                                         unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                         const uint8_t *data, size_t length,
+                                         uint64_t tm,
+                                         DbMsgReadyCb msgReadyCb,
+                                         void *user_data) {
+  pthread_mutex_lock(&lock);
+  if (!memInboundFragment(friend_number, type, id, partNo, numParts, off, sz, data, length, tm, /*replay*/0)) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  mem_msg *m = memMsgFind(/*outbound*/0, friend_number, id);
+  if (m->numDone < m->numParts) {
+    recBegin(REC_IN_FRAGMENT);
+    recU32(friend_number);
+    recU32(type);
+    recU64(id);
+    recU32(partNo);
+    recU32(numParts);
+    recU32(off);
+    recU32(sz);
+    recU64(tm);
+    recPut(data, length);
+    recEnd();
+    journalOp(/*mustCommit*/1);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  // the message is ready: the last fragment itself isn't needed in the journal, the message is marked as done
+  // and committed before it is delivered, so it is never delivered twice, the crash during the callback loses it
+  uint64_t tm1 = m->tm1, tm2 = m->tm2;
+  unsigned size = m->size;
+  uint8_t *message = memInboundDone(m, tm);
+  recBegin(REC_IN_DONE);
+  recU32(friend_number);
+  recU64(id);
+  recU64(tm);
+  recEnd();
+  journalCommitNow();
+  pthread_mutex_unlock(&lock);
+  // notify the caller outside of the lock, the client can send messages from its callback
+  msgReadyCb(tox_opaque, tm1, tm2, friend_number, type, message, size, user_data);
+  free(message);
+}
+
+static void journalInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
+                                         uint64_t tm,
+                                         unsigned numParts,
+                                         const uint8_t *data, size_t length,
+                                         uint32_t receipt) {
+  pthread_mutex_lock(&lock);
+  memOutboundMessage(friend_number, type, id, tm, numParts, data, length, receipt);
+  recBegin(REC_OUT_MESSAGE);
+  recU32(friend_number);
+  recU32(type);
+  recU64(id);
+  recU64(tm);
+  recU32(numParts);
+  recU32(receipt);
+  recPut(data, length);
+  recEnd();
+  journalOp(/*mustCommit*/1);
+  pthread_mutex_unlock(&lock);
+}
+
+static void journalOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm) {
+  // confirmations don't force the write: parts confirmed since the last write will just be sent again after a crash
+  pthread_mutex_lock(&lock);
+  if (memOutboundConfirmed(friend_number, id, partNo, tm)) {
+    recBegin(REC_OUT_CONFIRMED);
+    recU32(friend_number);
+    recU64(id);
+    recU32(partNo);
+    recU64(tm);
+    recEnd();
+    journalOp(/*mustCommit*/0);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void journalLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb) {
+  pthread_mutex_lock(&lock);
+  memLoadPendingSent(msgPendingSentCb);
+  pthread_mutex_unlock(&lock);
+}
+
+static void journalClearOutboundPending(uint32_t friend_number, uint64_t id) {
+  pthread_mutex_lock(&lock);
+  if (memOutboundClear(friend_number, id)) {
+    recBegin(REC_OUT_CLEARED);
+    recU32(friend_number);
+    recU64(id);
+    recEnd();
+    journalCommitNow(); // the client gets the receipt right after this
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static DbInboundState journalInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received) {
+  pthread_mutex_lock(&lock);
+  DbInboundState state = memInboundReceived(friend_number, id, numParts, received);
+  pthread_mutex_unlock(&lock);
+  return state;
+}
+
+static void journalPeriodic() {
+  pthread_mutex_lock(&commitLock);
+  pthread_mutex_lock(&lock);
+  if (fd == -1) {
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&commitLock);
+    return;
+  }
+  uint64_t tm = currTimeMs();
+  memExpireIdle(tm, journalExpired);
+  journalCommit();
+  memPurgeDone(tm);
+  if (fileSize >= JOURNAL_COMPACT_MIN_SIZE && fileSize > 2*compactedSize)
+    compact();
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&commitLock);
+}
+
+static void journalCommitAsync() {
+  // the write buffer is taken over, so the operations can go on while its records are written
+  pthread_mutex_lock(&commitLock);
+  pthread_mutex_lock(&lock);
+  uint8_t *buf = wbuf;
+  size_t bufLen = wbufLen, bufAlloc = wbufAlloc;
+  wbuf = cbuf;
+  wbufAlloc = cbufAlloc;
+  wbufLen = wrecStart = 0;
+  wOps = 0;
+  pthread_mutex_unlock(&lock);
+  if (bufLen) {
+    writeAll(fd, buf, bufLen);
+    syncFd(fd);
+    fileSize += bufLen;
+  }
+  cbuf = buf;
+  cbufAlloc = bufAlloc;
+  pthread_mutex_unlock(&commitLock);
+}
+
+// internal definitions
+
+static void journalExpired(mem_msg *m) {
+  // the expired message is finished like the delivered one, so that its late fragments are ignored
+  recBegin(REC_IN_DONE);
+  recU32(m->friend_number);
+  recU64(m->id);
+  recU64(m->tm2);
+  recEnd();
+}
+
+static uint64_t currTimeMs() {
+  return clockNowMs();
+}
+
+static void recBegin(uint8_t type) {
+  wrecStart = wbufLen;
+  uint8_t header[RECORD_HEADER_SIZE] = {0};
+  header[8] = type;
+  recPut(header, sizeof(header));
+}
+
+static void recPut(const void *data, size_t length) {
+  if (wbufLen + length > wbufAlloc) {
+    while (wbufLen + length > wbufAlloc)
+      wbufAlloc = wbufAlloc ? 2*wbufAlloc : 4096;
+    wbuf = realloc(wbuf, wbufAlloc);
+  }
+  memcpy(wbuf + wbufLen, data, length);
+  wbufLen += length;
+}
+
+static void recU32(uint32_t v) {
+  recPut(&v, sizeof(v));
+}
+
+static void recU64(uint64_t v) {
+  recPut(&v, sizeof(v));
+}
+
+static void recEnd() {
+  uint32_t length = wbufLen - wrecStart - RECORD_HEADER_SIZE;
+  uint32_t crc = utilCrc32c(0, wbuf + wrecStart + 8, length + 1);
+  memcpy(wbuf + wrecStart, &length, 4);
+  memcpy(wbuf + wrecStart + 4, &crc, 4);
+}
+
+static void journalOp(int mustCommit) {
+  // full durability writes every operation that can't be repeated, grouped durability writes them together,
+  // async durability leaves them to the writer thread
+  if (!wOps++)
+    wStartTm = currTimeMs();
+  if (dbSettings.durability == DB_DURABILITY_ASYNC) {
+    if (mustCommit)
+      dbWriterSignal();
+  } else if (dbSettings.durability == DB_DURABILITY_GROUPED
+        ? (wOps >= dbSettings.groupCommitOps || wStartTm + dbSettings.groupCommitTimeMs <= currTimeMs())
+        : mustCommit)
+    journalCommit();
+}
+
+static void journalCommit() {
+  if (!wbufLen)
+    return;
+  writeAll(fd, wbuf, wbufLen);
+  syncFd(fd);
+  fileSize += wbufLen;
+  wbufLen = wrecStart = 0;
+  wOps = 0;
+}
+
+static void journalCommitNow() {
+  // commits regardless of the durability, the async writer may be writing the earlier records, it goes first
+  if (dbSettings.durability == DB_DURABILITY_ASYNC) {
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_lock(&commitLock);
+    pthread_mutex_lock(&lock);
+    journalCommit();
+    pthread_mutex_unlock(&commitLock);
+  } else {
+    journalCommit();
+  }
+}
+
+static void writeAll(int wfd, const uint8_t *data, size_t length) {
+  while (length) {
+    ssize_t res = write(wfd, data, length);
+    if (res == -1) {
+      if (errno == EINTR)
+        continue;
+      err("writing the journal");
+    }
+    data += res;
+    length -= res;
+  }
+}
+
+static void syncFd(int sfd) {
+  if (fsync(sfd) == -1)
+    err("syncing the journal");
+}
+
+static void replay() {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    err("reading the journal size");
+  if (st.st_size == 0) {
+    writeAll(fd, (const uint8_t*)JOURNAL_MAGIC, 8);
+    syncFd(fd);
+    fileSize = 8;
+    return;
+  }
+  uint8_t *buf = malloc(st.st_size);
+  for (off_t off = 0; off < st.st_size; ) {
+    ssize_t res = pread(fd, buf + off, st.st_size - off, off);
+    if (res == -1 && errno != EINTR)
+      err("reading the journal");
+    if (res == 0)
+      ERROR("Journal %s is truncated while it is read", path)
+    if (res > 0)
+      off += res;
+  }
+  if (st.st_size < 8 || memcmp(buf, JOURNAL_MAGIC, 8))
+    ERROR("File %s isn't a defragmenter journal", path)
+  const uint8_t *p = buf + 8, *end = buf + st.st_size;
+  unsigned num = 0;
+  while (end - p >= RECORD_HEADER_SIZE) {
+    uint32_t length, crc;
+    memcpy(&length, p, 4);
+    memcpy(&crc, p + 4, 4);
+    if (length > end - p - RECORD_HEADER_SIZE || utilCrc32c(0, p + 8, length + 1) != crc)
+      break;
+    reader r = {p + RECORD_HEADER_SIZE, p + RECORD_HEADER_SIZE + length, 1};
+    if (!replayRecord(p[8], &r))
+      break;
+    p += RECORD_HEADER_SIZE + length;
+    num++;
+  }
+  fileSize = p - buf;
+  if (p != end) {
+    WARNING("journal %s is damaged at offset %"PRIu64" after %u records, the rest of it is dropped\n", path, fileSize, num)
+    if (ftruncate(fd, fileSize) == -1)
+      err("truncating the journal");
+  }
+  if (lseek(fd, fileSize, SEEK_SET) == -1)
+    err("positioning in the journal");
+  free(buf);
+  LOG("replayed %u records, size=%"PRIu64"", num, fileSize)
+}
+
+static int replayRecord(uint8_t type, reader *r) {
+  uint32_t friend_number = getU32(r);
+  mem_msg *m;
+  switch (type) {
+  case REC_IN_FRAGMENT: {
+    int msgType = getU32(r);
+    uint64_t id = getU64(r);
+    unsigned partNo = getU32(r), numParts = getU32(r), off = getU32(r), sz = getU32(r);
+    uint64_t tm = getU64(r);
+    size_t length = r->end - r->p;
+    const uint8_t *data = getBytes(r, length);
+    if (r->ok)
+      memInboundFragment(friend_number, msgType, id, partNo, numParts, off, sz, data, length, tm, /*replay*/1);
+    break;
+  } case REC_IN_DONE: {
+    uint64_t id = getU64(r), tm = getU64(r);
+    if (!r->ok)
+      break;
+    if (!(m = memMsgFind(/*outbound*/0, friend_number, id))) {
+      m = memMsgNew(/*outbound*/0, friend_number, 0, id, 0, 0);
+      m->tm1 = tm;
+    }
+    free(memInboundDone(m, tm));
+    break;
+  } case REC_IN_STATE: {
+    int msgType = getU32(r);
+    uint64_t id = getU64(r), tm1 = getU64(r), tm2 = getU64(r);
+    unsigned numParts = getU32(r), numDone = getU32(r), sz = getU32(r);
+    if (numParts > sz)
+      r->ok = 0; // corrupt record, the bitmap would be out of proportion
+    const uint8_t *received = getBytes(r, DB_BITMAP_SIZE(numParts));
+    const uint8_t *data = getBytes(r, sz);
+    if (!r->ok || memMsgFind(/*outbound*/0, friend_number, id))
+      break;
+    m = memMsgNew(/*outbound*/0, friend_number, msgType, id, numParts, sz);
+    m->tm1 = tm1;
+    m->tm2 = tm2;
+    m->numDone = numDone;
+    memcpy(m->parts, received, DB_BITMAP_SIZE(numParts));
+    memcpy(m->data, data, sz);
+    break;
+  } case REC_OUT_MESSAGE:
+    case REC_OUT_STATE: {
+    int msgType = getU32(r);
+    uint64_t id = getU64(r), tm1 = getU64(r), tm2 = type == REC_OUT_STATE ? getU64(r) : tm1;
+    unsigned numParts = getU32(r);
+    uint32_t receipt = getU32(r);
+    const uint8_t *confirmed = type == REC_OUT_STATE ? getBytes(r, numParts) : NULL;
+    size_t length = r->end - r->p;
+    const uint8_t *data = getBytes(r, length);
+    if (!r->ok || memMsgFind(/*outbound*/1, friend_number, id))
+      break;
+    m = memOutboundMessage(friend_number, msgType, id, tm1, numParts, data, length, receipt);
+    m->tm2 = tm2;
+    for (unsigned i = 0; confirmed && i < numParts; i++)
+      if ((m->parts[i] = confirmed[i] ? 1 : 0))
+        m->numDone++;
+    break;
+  } case REC_OUT_CONFIRMED: {
+    uint64_t id = getU64(r);
+    unsigned partNo = getU32(r);
+    uint64_t tm = getU64(r);
+    if (r->ok)
+      memOutboundConfirmed(friend_number, id, partNo, tm);
+    break;
+  } case REC_OUT_CLEARED: {
+    uint64_t id = getU64(r);
+    if (r->ok)
+      memOutboundClear(friend_number, id);
+    break;
+  } default:
+    return 0;
+  }
+  return r->ok;
+}
+
+static uint32_t getU32(reader *r) {
+  uint32_t v = 0;
+  const uint8_t *p = getBytes(r, sizeof(v));
+  if (p)
+    memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t getU64(reader *r) {
+  uint64_t v = 0;
+  const uint8_t *p = getBytes(r, sizeof(v));
+  if (p)
+    memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static const uint8_t* getBytes(reader *r, size_t length) {
+  if (!r->ok || length > r->end - r->p) {
+    r->ok = 0;
+    return NULL;
+  }
+  const uint8_t *p = r->p;
+  r->p += length;
+  return p;
+}
+
+static void compact() {
+  // the live state is written into the new file that then replaces the journal
+  journalCommit();
+  size_t pathLen = strlen(path);
+  char *tmpPath = malloc(pathLen + 5);
+  memcpy(tmpPath, path, pathLen);
+  memcpy(tmpPath + pathLen, ".new", 5);
+  int newFd = open(tmpPath, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if (newFd == -1)
+    err("creating the compacted journal");
+  recPut(JOURNAL_MAGIC, 8);
+  memMsgsForEach(writeState);
+  writeAll(newFd, wbuf, wbufLen);
+  syncFd(newFd);
+  if (rename(tmpPath, path) == -1)
+    err("replacing the journal with the compacted one");
+  // the rename itself is only durable once the directory is synced
+  char *dir = dirname(tmpPath);
+  int dirFd = open(dir, O_RDONLY);
+  if (dirFd != -1) {
+    fsync(dirFd);
+    close(dirFd);
+  }
+  free(tmpPath);
+  close(fd);
+  fd = newFd;
+  LOG("compacted the journal from %"PRIu64" to %u bytes", fileSize, (unsigned)wbufLen)
+  fileSize = compactedSize = wbufLen;
+  wbufLen = wrecStart = 0;
+  wOps = 0;
+}
+
+static void writeState(mem_msg *m) {
+  if (m->outbound) {
+    recBegin(REC_OUT_STATE);
+    recU32(m->friend_number);
+    recU32(m->type);
+    recU64(m->id);
+    recU64(m->tm1);
+    recU64(m->tm2);
+    recU32(m->numParts);
+    recU32(m->receipt);
+    recPut(m->parts, m->numParts);
+    recPut(m->data, m->size);
+  } else if (m->done) {
+    recBegin(REC_IN_DONE);
+    recU32(m->friend_number);
+    recU64(m->id);
+    recU64(m->tm2);
+  } else {
+    recBegin(REC_IN_STATE);
+    recU32(m->friend_number);
+    recU32(m->type);
+    recU64(m->id);
+    recU64(m->tm1);
+    recU64(m->tm2);
+    recU32(m->numParts);
+    recU32(m->numDone);
+    recU32(m->size);
+    recPut(m->parts, DB_BITMAP_SIZE(m->numParts));
+    recPut(m->data, m->size);
+  }
+  recEnd();
+}
+
+static void err(const char *op) {
+  fprintf(stderr, "Error while %s: path=%s error=%s (%d)\n", op, path, strerror(errno), errno);
+  abort();
+}
@@ -0,0 +1,360 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include "common.h"
+#include "database.h"
+#include "database-backend.h"
+#include "database-memory.h"
+#include "clock.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+// The in-RAM backend keeps the messages in the hash table with plain byte buffers, fragments are copied
+// into place as they arrive. Nothing survives the process, like with the in-memory SQLite database before.
+
+// macros
+#define LOG(fmt...) //utilLog(__FUNCTION__, "Memory", fmt);
+#define BIT_GET(bits, i) ((bits)[(i)/8] & (1 << ((i)%8)))
+#define BIT_SET(bits, i) {(bits)[(i)/8] |= (1 << ((i)%8));}
+
+// messages
+static mem_msg **msgs = NULL;
+static unsigned msgsNum = 0;
+static unsigned msgsAlloc = 0;
+
+// the backend is called from both the client and the periodic threads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// internal declarations
+static void memoryUninitialize();
+static void memoryInsertInboundFragment(void *tox_opaque,
+                                        uint32_t friend_number, int type, uint64_t id,
+                                        unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                        const uint8_t *data, size_t length,
+                                        uint64_t tm,
+                                        DbMsgReadyCb msgReadyCb,
+                                        void *user_data);
+static void memoryInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
+                                        uint64_t tm,
+                                        unsigned numParts,
+                                        const uint8_t *data, size_t length,
+                                        uint32_t receipt);
+static void memoryOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm);
+static void memoryLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb);
+static void memoryClearOutboundPending(uint32_t friend_number, uint64_t id);
+static DbInboundState memoryInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received);
+static void memoryPeriodic();
+static uint64_t currTimeMs();
+static unsigned msgHash(int outbound, uint32_t friend_number, uint64_t id);
+
+// backend object
+static const DbBackend backend = {
+  memoryUninitialize,
+  memoryInsertInboundFragment,
+  memoryInsertOutboundMessage,
+  memoryOutboundPartConfirmed,
+  memoryLoadPendingSentMessages,
+  memoryClearOutboundPending,
+  memoryInboundReceived,
+  memoryPeriodic,
+  NULL,           // nothing to commit
+  NULL            // nothing is left after the restart
+};
+
+// functions: backend
+
+FUNC_LOCAL const DbBackend* dbMemoryInitialize() {
+  return &backend;
+}
+
+static void memoryUninitialize() {
+  pthread_mutex_lock(&lock);
+  memMsgsDeleteAll();
+  pthread_mutex_unlock(&lock);
+}
+
+static void memoryInsertInboundFragment(void *tox_opaque,
+                                        uint32_t friend_number, int type, uint64_t id,
+                                        unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                        const uint8_t *data, size_t length,
+                                        uint64_t tm,
+                                        DbMsgReadyCb msgReadyCb,
+                                        void *user_data) {
+  pthread_mutex_lock(&lock);
+  if (!memInboundFragment(friend_number, type, id, partNo, numParts, off, sz, data, length, tm, /*replay*/0)) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  mem_msg *m = memMsgFind(/*outbound*/0, friend_number, id);
+  if (m->numDone < m->numParts) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  uint64_t tm1 = m->tm1, tm2 = m->tm2;
+  unsigned size = m->size;
+  uint8_t *message = memInboundDone(m, tm);
+  pthread_mutex_unlock(&lock);
+  // notify the caller outside of the lock, the client can send messages from its callback
+  msgReadyCb(tox_opaque, tm1, tm2, friend_number, type, message, size, user_data);
+  free(message);
+}
+
+static void memoryInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
+                                        uint64_t tm,
+                                        unsigned numParts,
+                                        const uint8_t *data, size_t length,
+                                        uint32_t receipt) {
+  pthread_mutex_lock(&lock);
+  memOutboundMessage(friend_number, type, id, tm, numParts, data, length, receipt);
+  pthread_mutex_unlock(&lock);
+}
+
+static void memoryOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm) {
+  pthread_mutex_lock(&lock);
+  memOutboundConfirmed(friend_number, id, partNo, tm);
+  pthread_mutex_unlock(&lock);
+}
+
+static void memoryLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb) {
+  pthread_mutex_lock(&lock);
+  memLoadPendingSent(msgPendingSentCb);
+  pthread_mutex_unlock(&lock);
+}
+
+static void memoryClearOutboundPending(uint32_t friend_number, uint64_t id) {
+  pthread_mutex_lock(&lock);
+  memOutboundClear(friend_number, id);
+  pthread_mutex_unlock(&lock);
+}
+
+static DbInboundState memoryInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received) {
+  pthread_mutex_lock(&lock);
+  DbInboundState state = memInboundReceived(friend_number, id, numParts, received);
+  pthread_mutex_unlock(&lock);
+  return state;
+}
+
+static void memoryPeriodic() {
+  pthread_mutex_lock(&lock);
+  uint64_t tm = currTimeMs();
+  memExpireIdle(tm, NULL);
+  memPurgeDone(tm);
+  pthread_mutex_unlock(&lock);
+}
+
+// functions: message store, the callers serialize the access
+
+FUNC_LOCAL mem_msg* memMsgFind(int outbound, uint32_t friend_number, uint64_t id) {
+  if (!msgsNum)
+    return NULL;
+  for (mem_msg *m = msgs[msgHash(outbound, friend_number, id)]; m; m = m->next)
+    if (m->id == id && m->friend_number == friend_number && m->outbound == outbound)
+      return m;
+  return NULL;
+}
+
+FUNC_LOCAL mem_msg* memMsgNew(int outbound, uint32_t friend_number, int type, uint64_t id, unsigned numParts, unsigned size) {
+  mem_msg *m = calloc(1, sizeof(mem_msg));
+  m->outbound = outbound;
+  m->friend_number = friend_number;
+  m->type = type;
+  m->id = id;
+  m->numParts = numParts;
+  m->size = size;
+  m->parts = calloc(1, outbound ? numParts : DB_BITMAP_SIZE(numParts));
+  m->data = malloc(size ? size : 1);
+  // insert, the table is grown when it gets full
+  if (msgsNum >= msgsAlloc) {
+    mem_msg **old = msgs;
+    unsigned oldAlloc = msgsAlloc;
+    msgsAlloc = oldAlloc ? 2*oldAlloc : 16;
+    msgs = calloc(msgsAlloc, sizeof(mem_msg*));
+    for (unsigned b = 0; b < oldAlloc; b++)
+      while (old[b]) {
+        mem_msg *o = old[b];
+        old[b] = o->next;
+        unsigned h = msgHash(o->outbound, o->friend_number, o->id);
+        o->next = msgs[h];
+        msgs[h] = o;
+      }
+    free(old);
+  }
+  unsigned h = msgHash(outbound, friend_number, id);
+  m->next = msgs[h];
+  msgs[h] = m;
+  msgsNum++;
+  return m;
+}
+
+FUNC_LOCAL void memMsgDelete(mem_msg *m) {
+  mem_msg **pm = &msgs[msgHash(m->outbound, m->friend_number, m->id)];
+  while (*pm != m)
+    pm = &(*pm)->next;
+  *pm = m->next;
+  msgsNum--;
+  free(m->parts);
+  free(m->data);
+  free(m);
+}
+
+FUNC_LOCAL void memMsgsDeleteAll() {
+  for (unsigned b = 0; b < msgsAlloc; b++)
+    while (msgs[b])
+      memMsgDelete(msgs[b]);
+  free(msgs);
+  msgs = NULL;
+  msgsAlloc = 0;
+}
+
+FUNC_LOCAL void memMsgsForEach(void (*cb)(mem_msg *m)) {
+  for (unsigned b = 0; b < msgsAlloc; b++)
+    for (mem_msg *m = msgs[b]; m; m = m->next)
+      cb(m);
+}
+
+FUNC_LOCAL int memInboundFragment(uint32_t friend_number, int type, uint64_t id,
+                                  unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                  const uint8_t *data, size_t length, uint64_t tm, int replay) {
+  // returns 1 when the fragment is new, replay doesn't check the limits, the journal charges them afterwards
+  mem_msg *m = memMsgFind(/*outbound*/0, friend_number, id);
+  if (!m) {
+    if (!dbFragmentValid(partNo, numParts, off, sz, length) || (!replay && !dbQuotaAdmit(friend_number, sz, numParts)))
+      return 0;
+    m = memMsgNew(/*outbound*/0, friend_number, type, id, numParts, sz);
+    m->tm1 = m->tm2 = tm;
+  }
+  if (m->done) {
+    if (!replay)
+      dbQuotaDuplicate(friend_number);
+    return 0; // late duplicate
+  }
+  if (partNo < 1 || partNo > m->numParts || off + length > m->size) {
+    if (!replay)
+      WARNING("invalid fragment for friend=%u msg id=%"PRIu64": partNo=%u numParts=%u off=%u length=%u, expected numParts=%u size=%u\n",
+        friend_number, id, partNo, numParts, off, (unsigned)length, m->numParts, m->size)
+    return 0;
+  }
+  if (BIT_GET(m->parts, partNo-1)) {
+    if (!replay)
+      dbQuotaDuplicate(friend_number);
+    return 0; // duplicate fragment received
+  }
+  BIT_SET(m->parts, partNo-1)
+  m->numDone++;
+  memcpy(m->data + off, data, length);
+  if (m->tm2 < tm)
+    m->tm2 = tm;
+  return 1;
+}
+
+FUNC_LOCAL uint8_t* memInboundDone(mem_msg *m, uint64_t tm) {
+  // only the id is kept from now on, the message itself is returned to the caller
+  if (m->numParts)
+    dbQuotaRelease(m->friend_number, m->size, m->numParts); // ids restored from the journal have no parts and weren't charged
+  uint8_t *message = m->data;
+  m->data = NULL;
+  m->done = 1;
+  if (m->tm2 < tm)
+    m->tm2 = tm;
+  return message;
+}
+
+FUNC_LOCAL mem_msg* memOutboundMessage(uint32_t friend_number, int type, uint64_t id, uint64_t tm,
+                                       unsigned numParts, const uint8_t *data, size_t length, uint32_t receipt) {
+  mem_msg *m = memMsgNew(/*outbound*/1, friend_number, type, id, numParts, length);
+  memcpy(m->data, data, length);
+  m->tm1 = m->tm2 = tm;
+  m->receipt = receipt;
+  return m;
+}
+
+FUNC_LOCAL int memOutboundConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm) {
+  // returns 1 when the part wasn't confirmed before
+  mem_msg *m = memMsgFind(/*outbound*/1, friend_number, id);
+  if (!m || partNo < 1 || partNo > m->numParts || m->parts[partNo-1])
+    return 0;
+  m->parts[partNo-1] = 1;
+  m->numDone++;
+  if (m->tm2 < tm)
+    m->tm2 = tm;
+  return 1;
+}
+
+FUNC_LOCAL int memOutboundClear(uint32_t friend_number, uint64_t id) {
+  mem_msg *m = memMsgFind(/*outbound*/1, friend_number, id);
+  if (!m)
+    return 0;
+  memMsgDelete(m);
+  return 1;
+}
+
+FUNC_LOCAL void memLoadPendingSent(DbMsgPendingSentCb msgPendingSentCb) {
+  for (unsigned b = 0; b < msgsAlloc; b++)
+    for (mem_msg *m = msgs[b]; m; m = m->next)
+      if (m->outbound)
+        msgPendingSentCb(m->friend_number, m->type, m->id,
+                         m->tm1, m->tm2,
+                         m->numDone, m->numParts,
+                         m->data, m->size,
+                         m->parts, m->numParts,
+                         m->receipt);
+}
+
+FUNC_LOCAL DbInboundState memInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received) {
+  mem_msg *m = memMsgFind(/*outbound*/0, friend_number, id);
+  if (!m)
+    return DB_INBOUND_UNKNOWN;
+  if (m->done)
+    return DB_INBOUND_DONE;
+  *numParts = m->numParts;
+  *received = malloc(DB_BITMAP_SIZE(m->numParts));
+  memcpy(*received, m->parts, DB_BITMAP_SIZE(m->numParts));
+  return DB_INBOUND_PARTIAL;
+}
+
+FUNC_LOCAL void memPurgeDone(uint64_t tm) {
+  // forget the ids of the messages delivered before the history time
+  for (unsigned b = 0; b < msgsAlloc; b++)
+    for (mem_msg *m = msgs[b], *next; m; m = next) {
+      next = m->next;
+      if (m->done && m->tm2 + dbSettings.gcHistoryTimeSec*1000ULL < tm)
+        memMsgDelete(m);
+    }
+}
+
+FUNC_LOCAL void memExpireIdle(uint64_t tm, void (*expiredCb)(mem_msg *m)) {
+  // incomplete messages without new fragments for the idle time are dropped, their ids are kept like of the finished ones
+  if (!dbSettings.inIdleTimeSec)
+    return;
+  for (unsigned b = 0; b < msgsAlloc; b++)
+    for (mem_msg *m = msgs[b]; m; m = m->next)
+      if (!m->outbound && !m->done && m->tm2 + dbSettings.inIdleTimeSec*1000ULL < tm) {
+        WARNING("dropping the incomplete inbound message id=%"PRIu64" from friend=%u: received %u of %u parts, idle since %"PRIu64"\n",
+                m->id, m->friend_number, m->numDone, m->numParts, m->tm2)
+        if (expiredCb)
+          expiredCb(m);
+        free(memInboundDone(m, m->tm2));
+      }
+}
+
+FUNC_LOCAL void memQuotaChargeAll() {
+  dbQuotaReset();
+  for (unsigned b = 0; b < msgsAlloc; b++)
+    for (mem_msg *m = msgs[b]; m; m = m->next)
+      if (!m->outbound && !m->done)
+        dbQuotaCharge(m->friend_number, m->size, m->numParts);
+}
+
+// internal definitions
+
+static uint64_t currTimeMs() {
+  return clockNowMs();
+}
+
+static unsigned msgHash(int outbound, uint32_t friend_number, uint64_t id) {
+  return (unsigned)((id ^ (id >> 32) ^ ((uint64_t)friend_number * 0x9e3779b1) ^ outbound) & (msgsAlloc - 1));
+}
@@ -0,0 +1,44 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+
+// message store kept in memory: the in-RAM backend is the store alone, the journal backend persists it
+
+typedef struct mem_msg {
+  struct mem_msg *next;
+  uint8_t   outbound;
+  uint8_t   done;       // inbound: delivered, only the id is kept
+  uint32_t  friend_number;
+  int       type;
+  uint64_t  id;
+  uint64_t  tm1;
+  uint64_t  tm2;
+  unsigned  numParts;
+  unsigned  numDone;
+  unsigned  size;
+  uint32_t  receipt;
+  uint8_t  *parts;      // inbound: bitmap of the received parts, outbound: confirmation byte per part
+  uint8_t  *data;
+} mem_msg;
+
+mem_msg* memMsgFind(int outbound, uint32_t friend_number, uint64_t id);
+mem_msg* memMsgNew(int outbound, uint32_t friend_number, int type, uint64_t id, unsigned numParts, unsigned size);
+void memMsgDelete(mem_msg *m);
+void memMsgsDeleteAll();
+void memMsgsForEach(void (*cb)(mem_msg *m));
+int memInboundFragment(uint32_t friend_number, int type, uint64_t id,
+                       unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                       const uint8_t *data, size_t length, uint64_t tm, int replay);
+uint8_t* memInboundDone(mem_msg *m, uint64_t tm);
+mem_msg* memOutboundMessage(uint32_t friend_number, int type, uint64_t id, uint64_t tm,
+                            unsigned numParts, const uint8_t *data, size_t length, uint32_t receipt);
+int memOutboundConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm);
+int memOutboundClear(uint32_t friend_number, uint64_t id);
+void memLoadPendingSent(DbMsgPendingSentCb msgPendingSentCb);
+DbInboundState memInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received);
+void memPurgeDone(uint64_t tm);
+void memExpireIdle(uint64_t tm, void (*expiredCb)(mem_msg *m));
+void memQuotaChargeAll();
@@ -0,0 +1,1178 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#if !defined(NO_SQLITE)
+
+#include "common.h"
+#include "sqlite-interface.h"
+#include "database.h"
+#include "database-backend.h"
+#include "bloom.h"
+#include "util.h"
+#include "clock.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+// macros
+#define CK_ERROR(stmt...) \
+  (SQLITE_OK != (rc = stmt))
+#define LOG(fmt...) //utilLog(__FUNCTION__, "Db", fmt);
+#define BIT_GET(bits, i) ((bits)[(i)/8] & (1 << ((i)%8)))
+#define BIT_SET(bits, i) {(bits)[(i)/8] |= (1 << ((i)%8));}
+
+// database objects
+static sqlite3 *db = NULL;
+static DbLockCb dbLockCb = NULL;
+static DbUnlockCb dbUnlockCb = NULL;
+static void *dbLockUserData = NULL;
+
+// schema: version 1 kept both directions in the shared fragmented_meta and fragmented_data tables,
+// version 2 keeps them apart, see createSchemaV2
+#define SCHEMA_VERSION 2
+#define INBOUND_COLUMNS \
+    " id INTEGER PRIMARY KEY," \
+    " friend_id INTEGER NOT NULL," \
+    " frags_id INTEGER NOT NULL," \
+    " type INTEGER NOT NULL," \
+    " timestamp_first INTEGER NOT NULL, timestamp_last INTEGER NOT NULL," \
+    " frags_done INTEGER NOT NULL, frags_num INTEGER NOT NULL," \
+    " size INTEGER NOT NULL," \
+    " received BLOB NULL," \
+    " UNIQUE(friend_id, frags_id)); "
+
+// group commit, see dbSettings: the open transaction is shared by the calling, the periodic and the writer threads,
+// txLock is taken after the client's lock, it is recursive because the loaded pending messages can be cleared
+// from the callback of the loading; msgReadyCb runs without it, so the writer doesn't wait for the client;
+// it also guards the message states, the filter and the prepared statements, which these threads share too
+static pthread_mutex_t txLock;
+static uint8_t txOpen = 0;
+static unsigned txOps = 0;
+static uint64_t txStartTm = 0;
+
+// garbage collection of the inbound meta records: ids of the purged records go into the duplicate filter,
+// which consists of two generations of the Bloom filter, the older one is dropped when the newer one gets full;
+// ids are assigned by the sender's clock, so the filter is consulted up to the largest id it has, not by the time
+#define GC_INTERVAL_MS 60000
+static uint64_t gcLastTm = 0;
+static bloom *filterCurr = NULL;
+static bloom *filterPrev = NULL;
+static int64_t filterCurrGen = 0;
+static uint64_t filterCurrMaxId = 0;
+static uint64_t filterPrevMaxId = 0;
+static uint8_t filterCurrDirty = 0;
+static uint8_t filterPrevDirty = 0;
+
+// in-memory state of the active messages, it saves the lookup queries for every fragment
+// cached rowids are stable because both tables have the explicit INTEGER PRIMARY KEY
+typedef struct msg_state {
+  struct msg_state *next;
+  uint8_t   outbound;
+  uint32_t  friend_number;
+  uint64_t  id;
+  uint64_t  rowid;      // id in fragmented_inbound or in fragmented_outbound
+  unsigned  numParts;
+  unsigned  numDone;    // mirrors frags_done
+  unsigned  size;
+  uint8_t   legacy;     // inbound record was migrated from the older version that didn't keep the received parts
+  uint8_t   dirty;      // outbound confirmations that aren't yet written
+  uint64_t  tmLast;     // outbound: time of the last confirmation
+  uint8_t   parts[];    // inbound: bitmap of the received parts ('received' column), outbound: contents of the 'confirmed' column
+} msg_state;
+static msg_state **msgStates = NULL;
+static unsigned msgStatesNum = 0;
+static unsigned msgStatesDirty = 0;
+static unsigned msgStatesAlloc = 0;
+
+// prepared statements
+static sqlite3_stmt *stmtInsertInbound = NULL;
+static sqlite3_stmt *stmtInsertInboundChunk = NULL;
+static sqlite3_stmt *stmtUpdateInbound = NULL;
+static sqlite3_stmt *stmtSelectInboundDone = NULL;
+static sqlite3_stmt *stmtSelectInboundChunks = NULL;
+static sqlite3_stmt *stmtSelectInboundLegacyPart = NULL;
+static sqlite3_stmt *stmtDeleteInboundChunks = NULL;
+static sqlite3_stmt *stmtSelectInboundExpired = NULL;
+static sqlite3_stmt *stmtUpdateInboundExpired = NULL;
+static sqlite3_stmt *stmtSelectInboundReceived = NULL;
+static sqlite3_stmt *stmtInsertOutbound = NULL;
+static sqlite3_stmt *stmtSelectOutboundPending = NULL;
+static sqlite3_stmt *stmtDeleteOutbound = NULL;
+static sqlite3_stmt *stmtSelectInboundState = NULL;
+static sqlite3_stmt *stmtSelectOutboundState = NULL;
+static sqlite3_stmt *stmtUpdateOutboundConfirmed = NULL;
+static sqlite3_stmt *stmtSelectInboundPurged = NULL;
+static sqlite3_stmt *stmtDeleteInboundPurged = NULL;
+static sqlite3_stmt *stmtSaveFilter = NULL;
+static sqlite3_stmt *stmtDeleteOldFilters = NULL;
+
+// internal declarations
+static void sqliteUninitialize();
+static void sqliteInsertInboundFragment(void *tox_opaque,
+                                        uint32_t friend_number, int type, uint64_t id,
+                                        unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                        const uint8_t *data, size_t length,
+                                        uint64_t tm,
+                                        DbMsgReadyCb msgReadyCb,
+                                        void *user_data);
+static void sqliteInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
+                                        uint64_t tm,
+                                        unsigned numParts,
+                                        const uint8_t *data, size_t length,
+                                        uint32_t receipt);
+static void sqliteOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm);
+static void sqliteLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb);
+static void sqliteClearOutboundPending(uint32_t friend_number, uint64_t id);
+static DbInboundState sqliteInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received);
+static void sqlitePeriodic();
+static void sqliteCommit();
+static void sqliteDeliverUndelivered(void *tox_opaque, DbMsgReadyCb msgReadyCb, void *user_data);
+
+static void* dbLock();
+static void dbUnlock(void *lock);
+static void* dbLockWrite();
+static void dbUnlockWrite(void *lock);
+static uint64_t currTimeMs();
+static void txBegin();
+static void txCommit();
+static void initDb();
+static void execSql(const char *sql);
+static void createSchema();
+static int schemaVersion();
+static void createSchemaV2();
+static void migrateSchemaV1();
+static void updateInboundDone(msg_state *st, uint64_t tm, unsigned partNo);
+static uint8_t* assembleInbound(uint32_t friend_number, uint64_t id, unsigned size);
+static int isLegacyPartReceived(uint32_t friend_number, uint64_t id, unsigned off);
+static unsigned msgStateHash(int outbound, uint32_t friend_number, uint64_t id);
+static msg_state* msgStateFind(int outbound, uint32_t friend_number, uint64_t id);
+static msg_state* msgStateNew(int outbound, uint32_t friend_number, uint64_t id, uint64_t rowid, unsigned numParts, unsigned numDone);
+static msg_state* msgStateLoadInbound(uint32_t friend_number, uint64_t id);
+static msg_state* msgStateLoadOutbound(uint32_t friend_number, uint64_t id);
+static void msgStateSetConfirmed(msg_state *st, const uint8_t *confirmed, unsigned lengthConfirmed);
+static void msgStateDelete(msg_state *st);
+static void msgStatesDeleteAll();
+static void msgStatesFlush();
+static void gcInboundMeta(uint64_t tm);
+static void expireInbound(uint64_t tm);
+static void quotaLoad();
+static void filterLoad();
+static void filterAdd(uint32_t friend_number, uint64_t id);
+static int filterIsPurged(uint32_t friend_number, uint64_t id);
+static void filterSave();
+static void filterSaveGeneration(int64_t gen, const bloom *b, uint64_t maxId);
+static void filtersDelete();
+static sqlite3_stmt* prepareStatement(const char *sql);
+static void destroyPreparedStatement(sqlite3_stmt **stmt);
+static void destroyPreparedStatements();
+static void prepare(sqlite3_stmt **pstmt, const char *sql);
+static void bindInt(sqlite3_stmt *stmt, int n, int a);
+static void bindInt64(sqlite3_stmt *stmt, int n, sqlite3_int64 a);
+static void bindBlob(sqlite3_stmt *stmt, int n, const uint8_t *data, size_t size);
+static void bind_Int_Int64(sqlite3_stmt *stmt, int a1, sqlite3_int64 a2);
+static void execPrepared(sqlite3_stmt *stmt);
+static int execPreparedRowOrNot(sqlite3_stmt *stmt);
+static void resetStmt(sqlite3_stmt *stmt);
+static void errSql(int rc, const char *op, const char *sql);
+// backend object
+static const DbBackend backend = {
+  sqliteUninitialize,
+  sqliteInsertInboundFragment,
+  sqliteInsertOutboundMessage,
+  sqliteOutboundPartConfirmed,
+  sqliteLoadPendingSentMessages,
+  sqliteClearOutboundPending,
+  sqliteInboundReceived,
+  sqlitePeriodic,
+  sqliteCommit,
+  sqliteDeliverUndelivered
+};
+
+// functions
+
+FUNC_LOCAL const DbBackend* dbSqliteInitialize(sqlite3 *new_db, DbLockCb lockCb, DbUnlockCb unlockCb, void *user_data) {
+  db = new_db;
+  dbLockCb = lockCb;
+  dbUnlockCb = unlockCb;
+  dbLockUserData = user_data;
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&txLock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  initDb();
+  return &backend;
+}
+
+static void sqliteUninitialize() {
+  msgStatesFlush();
+  sqliteCommit();
+  msgStatesDeleteAll();
+  filtersDelete();
+  destroyPreparedStatements();
+  pthread_mutex_destroy(&txLock);
+  db = NULL;
+  dbLockCb = NULL;
+  dbUnlockCb = NULL;
+  dbLockUserData = NULL;
+}
+
+static void sqliteInsertInboundFragment(void *tox_opaque,
+                                        uint32_t friend_number, int type, uint64_t id,
+                                        unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                                        const uint8_t *data, size_t length,
+                                        uint64_t tm,
+                                        DbMsgReadyCb msgReadyCb,
+                                        void *user_data) {
+  // Each part is stored in its own chunk record as it arrives, and is assembled when the last part arrives.
+  // Once the message is finished the chunks are deleted, and only the fragmented_inbound record remains
+  // in order to ignore further duplicates. Parts received so far are tracked in the 'received' bitmap,
+  // and are mirrored in memory, so that duplicates are rejected without touching the database.
+
+  LOG("part#%u off=%u sz=%u len=%u data=-->%*s<--", partNo, off, sz, (unsigned)length, (unsigned)length, (const char*)data)
+  void *lock = dbLockWrite();
+  msg_state *st = msgStateFind(/*outbound*/0, friend_number, id);
+  if (!st)
+    st = msgStateLoadInbound(friend_number, id);
+  if (!st) {
+    if (filterIsPurged(friend_number, id)) {
+      dbQuotaDuplicate(friend_number);
+      dbUnlockWrite(lock);
+      return; // late duplicate of the message with the already purged records
+    }
+    // the limits are checked before anything is stored
+    if (!dbQuotaAdmit(friend_number, sz, numParts)) {
+      dbUnlockWrite(lock);
+      return;
+    }
+    prepare(&stmtInsertInbound,
+      "INSERT OR IGNORE INTO fragmented_inbound (friend_id, frags_id, type, timestamp_first, timestamp_last,"
+                                               " frags_done, frags_num, size, received)"
+      " VALUES(?, ?, ?, ?, ?, 0, ?, ?, zeroblob(?));");
+    bindInt  (stmtInsertInbound, 1, friend_number);
+    bindInt64(stmtInsertInbound, 2, id);
+    bindInt  (stmtInsertInbound, 3, type);
+    bindInt64(stmtInsertInbound, 4, tm);
+    bindInt64(stmtInsertInbound, 5, tm);
+    bindInt  (stmtInsertInbound, 6, numParts);
+    bindInt  (stmtInsertInbound, 7, sz);
+    bindInt  (stmtInsertInbound, 8, DB_BITMAP_SIZE(numParts));
+    execPrepared(stmtInsertInbound);
+    if (!sqlite3_changes(db)) {
+      dbQuotaRelease(friend_number, sz, numParts);
+      dbQuotaDuplicate(friend_number);
+      dbUnlockWrite(lock);
+      return; // record is ready, must be a late duplicate
+    }
+    st = msgStateNew(/*outbound*/0, friend_number, id, sqlite3_last_insert_rowid(db), numParts, 0);
+    st->size = sz;
+  }
+  if (partNo < 1 || partNo > st->numParts || off + length > st->size) {
+    WARNING("invalid fragment for friend=%u msg id=%"PRIu64": partNo=%u numParts=%u off=%u length=%u, expected numParts=%u size=%u\n",
+      friend_number, id, partNo, numParts, off, (unsigned)length, st->numParts, st->size)
+    dbUnlockWrite(lock);
+    return;
+  }
+  if (BIT_GET(st->parts, partNo-1) || (st->legacy && length && isLegacyPartReceived(friend_number, id, off))) {
+    BIT_SET(st->parts, partNo-1)
+    dbQuotaDuplicate(friend_number);
+    dbUnlockWrite(lock);
+    return; // duplicate fragment received
+  }
+  prepare(&stmtInsertInboundChunk,
+    "INSERT OR IGNORE INTO fragmented_inbound_chunk (friend_id, frags_id, part_no, off, data) VALUES(?, ?, ?, ?, ?);");
+  bindInt  (stmtInsertInboundChunk, 1, friend_number);
+  bindInt64(stmtInsertInboundChunk, 2, id);
+  bindInt  (stmtInsertInboundChunk, 3, partNo);
+  bindInt  (stmtInsertInboundChunk, 4, off);
+  bindBlob (stmtInsertInboundChunk, 5, data, length);
+  execPrepared(stmtInsertInboundChunk);
+  BIT_SET(st->parts, partNo-1)
+  // the chunk that is already there without its bit was stored right before the crash, it is counted now
+  st->numDone++;
+  updateInboundDone(st, tm, partNo);
+  // see if the message is ready
+  if (st->numDone < st->numParts) {
+    dbUnlockWrite(lock);
+    return;
+  }
+  prepare(&stmtSelectInboundDone,
+    "SELECT timestamp_first, timestamp_last FROM fragmented_inbound WHERE friend_id=? AND frags_id=?;");
+  bind_Int_Int64(stmtSelectInboundDone, friend_number, id);
+  if (!execPreparedRowOrNot(stmtSelectInboundDone))
+    ERROR("Missing the fragmented_inbound record for friend=%u msg id=%"PRIu64"", friend_number, id)
+  uint64_t tm1 = sqlite3_column_int64(stmtSelectInboundDone, 0);
+  uint64_t tm2 = sqlite3_column_int64(stmtSelectInboundDone, 1);
+  resetStmt(stmtSelectInboundDone);
+  uint8_t *message = assembleInbound(friend_number, id, st->size);
+  unsigned size = st->size;
+  dbQuotaRelease(friend_number, st->size, st->numParts);
+  msgStateDelete(st);
+  dbUnlockWrite(lock);
+  // the message is ready, notify the caller outside of the locks, the writer thread doesn't wait for the client
+  LOG("dbInsertInboundFragment >>> msgReadyCb")
+  msgReadyCb(tox_opaque, tm1, tm2, friend_number, type, message, size, user_data);
+  LOG("dbInsertInboundFragment <<< msgReadyCb")
+  free(message);
+}
+
+static void sqliteDeliverUndelivered(void *tox_opaque, DbMsgReadyCb msgReadyCb, void *user_data) {
+  // the done count is written before the chunks are deleted, so the finished message that still has its chunks
+  // wasn't delivered before the crash: it is assembled from them and delivered now, its sender could have
+  // the toxcore receipt of the last part already, and wouldn't send it again
+  static sqlite3_stmt *stmtSelect = NULL;
+  for (;;) {
+    void *lock = dbLockWrite();
+    prepare(&stmtSelect,
+      "SELECT friend_id, frags_id, type, timestamp_first, timestamp_last, size FROM fragmented_inbound i"
+      " WHERE frags_done >= frags_num AND length(received) = (frags_num+7)/8"
+      "   AND EXISTS (SELECT 1 FROM fragmented_inbound_chunk c"
+      "               WHERE c.friend_id=i.friend_id AND c.frags_id=i.frags_id AND c.part_no > 0)"
+      " LIMIT 1;");
+    if (!execPreparedRowOrNot(stmtSelect)) {
+      sqlite3_finalize(stmtSelect);
+      stmtSelect = NULL;
+      dbUnlockWrite(lock);
+      return;
+    }
+    uint32_t friend_number = sqlite3_column_int(stmtSelect, 0);
+    uint64_t id = sqlite3_column_int64(stmtSelect, 1);
+    int type = sqlite3_column_int(stmtSelect, 2);
+    uint64_t tm1 = sqlite3_column_int64(stmtSelect, 3);
+    uint64_t tm2 = sqlite3_column_int64(stmtSelect, 4);
+    unsigned size = sqlite3_column_int(stmtSelect, 5);
+    resetStmt(stmtSelect);
+    WARNING("the message from friend=%u id=%"PRIu64" wasn't delivered before the restart, delivering it now\n",
+      friend_number, id)
+    uint8_t *message = assembleInbound(friend_number, id, size);
+    dbUnlockWrite(lock);
+    msgReadyCb(tox_opaque, tm1, tm2, friend_number, type, message, size, user_data);
+    free(message);
+  }
+}
+
+static void sqliteInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
+                                        uint64_t tm,
+                                        unsigned numParts,
+                                        const uint8_t *data, size_t length,
+                                        uint32_t receipt) {
+  void *lock = dbLockWrite();
+  prepare(&stmtInsertOutbound,
+    "INSERT INTO fragmented_outbound (friend_id, frags_id, type, timestamp_first, timestamp_last,"
+                                    " frags_done, frags_num, receipt, confirmed, message)"
+    " VALUES(?, ?, ?, ?, ?, 0, ?, ?, zeroblob(?), ?);");
+  bindInt  (stmtInsertOutbound, 1, friend_number);
+  bindInt64(stmtInsertOutbound, 2, id);
+  bindInt  (stmtInsertOutbound, 3, type);
+  bindInt64(stmtInsertOutbound, 4, tm);
+  bindInt64(stmtInsertOutbound, 5, tm);
+  bindInt  (stmtInsertOutbound, 6, numParts);
+  bindInt  (stmtInsertOutbound, 7, receipt);
+  bindInt  (stmtInsertOutbound, 8, numParts);
+  bindBlob (stmtInsertOutbound, 9, data, length);
+  execPrepared(stmtInsertOutbound);
+  msgStateNew(/*outbound*/1, friend_number, id, sqlite3_last_insert_rowid(db), numParts, 0);
+  dbUnlockWrite(lock);
+}
+
+static void sqliteOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm) {
+  // confirmations are only recorded in memory here, and are written by dbPeriodic,
+  // all at once for each message: parts confirmed since the last write will just be sent again after a crash
+  void *lock = dbLock();
+  pthread_mutex_lock(&txLock);
+  msg_state *st = msgStateFind(/*outbound*/1, friend_number, id);
+  if (!st)
+    st = msgStateLoadOutbound(friend_number, id);
+  if (!st)
+    abort();
+  if (partNo < 1 || partNo > st->numParts || st->parts[partNo-1]) {
+    pthread_mutex_unlock(&txLock);
+    dbUnlock(lock);
+    return;
+  }
+  st->parts[partNo-1] = 1;
+  st->numDone++;
+  if (st->tmLast < tm)
+    st->tmLast = tm;
+  if (!st->dirty) {
+    st->dirty = 1;
+    msgStatesDirty++;
+  }
+  pthread_mutex_unlock(&txLock);
+  dbUnlock(lock);
+}
+
+static void sqliteLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb) {
+  void *lock = dbLock();
+  pthread_mutex_lock(&txLock);
+  prepare(&stmtSelectOutboundPending,
+    "SELECT friend_id, type, frags_id,"
+          " timestamp_first, timestamp_last,"
+          " frags_done, frags_num,"
+          " message, length(message),"
+          " confirmed, length(confirmed),"
+          " receipt, id"
+    " FROM fragmented_outbound;");
+  while (execPreparedRowOrNot(stmtSelectOutboundPending)) {
+    if (!msgStateFind(/*outbound*/1, sqlite3_column_int(stmtSelectOutboundPending, 0), sqlite3_column_int64(stmtSelectOutboundPending, 2)))
+      msgStateSetConfirmed(msgStateNew(/*outbound*/1,
+                                       sqlite3_column_int  (stmtSelectOutboundPending, 0),
+                                       sqlite3_column_int64(stmtSelectOutboundPending, 2),
+                                       sqlite3_column_int64(stmtSelectOutboundPending, 12),
+                                       sqlite3_column_int  (stmtSelectOutboundPending, 6),
+                                       0),
+                           (const uint8_t*)sqlite3_column_blob(stmtSelectOutboundPending, 9),
+                           sqlite3_column_int  (stmtSelectOutboundPending, 10));
+    msgPendingSentCb(
+      sqlite3_column_int  (stmtSelectOutboundPending, 0),
+      sqlite3_column_int  (stmtSelectOutboundPending, 1),
+      sqlite3_column_int64(stmtSelectOutboundPending, 2),
+      sqlite3_column_int64(stmtSelectOutboundPending, 3),
+      sqlite3_column_int64(stmtSelectOutboundPending, 4),
+      sqlite3_column_int  (stmtSelectOutboundPending, 5),
+      sqlite3_column_int  (stmtSelectOutboundPending, 6),
+      (const uint8_t*)sqlite3_column_blob(stmtSelectOutboundPending, 7),
+      sqlite3_column_int  (stmtSelectOutboundPending, 8),
+      (const uint8_t*)sqlite3_column_blob(stmtSelectOutboundPending, 9),
+      sqlite3_column_int  (stmtSelectOutboundPending, 10),
+      sqlite3_column_int  (stmtSelectOutboundPending, 11)
+    );
+  }
+  resetStmt(stmtSelectOutboundPending);
+  pthread_mutex_unlock(&txLock);
+  dbUnlock(lock);
+}
+
+static void sqliteClearOutboundPending(uint32_t friend_number, uint64_t id) {
+  void *lock = dbLockWrite();
+  prepare(&stmtDeleteOutbound,
+    "DELETE FROM fragmented_outbound WHERE friend_id=? AND frags_id=?;");
+  bind_Int_Int64(stmtDeleteOutbound, friend_number, id);
+  execPrepared(stmtDeleteOutbound);
+  msg_state *st = msgStateFind(/*outbound*/1, friend_number, id);
+  if (st)
+    msgStateDelete(st);
+  // the client gets the receipt right after this
+  if (txOpen)
+    txCommit();
+  dbUnlockWrite(lock);
+}
+
+static DbInboundState sqliteInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received) {
+  // the cached state is used when there is one, the message isn't loaded into the cache otherwise
+  void *lock = dbLock();
+  pthread_mutex_lock(&txLock);
+  DbInboundState state = DB_INBOUND_UNKNOWN;
+  msg_state *st = msgStateFind(/*outbound*/0, friend_number, id);
+  if (st) {
+    *numParts = st->numParts;
+    *received = malloc(DB_BITMAP_SIZE(st->numParts));
+    memcpy(*received, st->parts, DB_BITMAP_SIZE(st->numParts));
+    pthread_mutex_unlock(&txLock);
+    dbUnlock(lock);
+    return DB_INBOUND_PARTIAL;
+  }
+  prepare(&stmtSelectInboundReceived,
+    "SELECT frags_done, frags_num, received, length(received)"
+    " FROM fragmented_inbound"
+    " WHERE friend_id=? AND frags_id=?;");
+  bind_Int_Int64(stmtSelectInboundReceived, friend_number, id);
+  if (execPreparedRowOrNot(stmtSelectInboundReceived)) {
+    unsigned num = sqlite3_column_int(stmtSelectInboundReceived, 1);
+    if (sqlite3_column_int(stmtSelectInboundReceived, 0) >= num) {
+      state = DB_INBOUND_DONE;
+    } else {
+      // parts of the migrated messages aren't known, they are reported as missing, and are ignored when they arrive again
+      state = DB_INBOUND_PARTIAL;
+      *numParts = num;
+      *received = calloc(1, DB_BITMAP_SIZE(num));
+      if (sqlite3_column_int(stmtSelectInboundReceived, 3) == DB_BITMAP_SIZE(num))
+        memcpy(*received, sqlite3_column_blob(stmtSelectInboundReceived, 2), DB_BITMAP_SIZE(num));
+    }
+  } else if (filterIsPurged(friend_number, id)) {
+    state = DB_INBOUND_DONE;
+  }
+  resetStmt(stmtSelectInboundReceived);
+  pthread_mutex_unlock(&txLock);
+  dbUnlock(lock);
+  return state;
+}
+
+static void sqlitePeriodic() {
+  msgStatesFlush();
+  uint64_t tm = currTimeMs();
+  if (gcLastTm + GC_INTERVAL_MS <= tm) {
+    expireInbound(tm);
+    gcInboundMeta(tm);
+    gcLastTm = tm;
+  }
+  if (!txOpen || dbSettings.durability == DB_DURABILITY_ASYNC)
+    return;
+  void *lock = dbLock();
+  pthread_mutex_lock(&txLock);
+  if (txOpen && (txOps >= dbSettings.groupCommitOps || txStartTm + dbSettings.groupCommitTimeMs <= currTimeMs()))
+    txCommit();
+  pthread_mutex_unlock(&txLock);
+  dbUnlock(lock);
+}
+
+static void sqliteCommit() {
+  void *lock = dbLock();
+  pthread_mutex_lock(&txLock);
+  if (txOpen)
+    txCommit();
+  pthread_mutex_unlock(&txLock);
+  dbUnlock(lock);
+}
+
+// internal definitions
+
+static void* dbLock() {
+  return dbLockCb ? dbLockCb(dbLockUserData) : NULL;
+}
+
+static void dbUnlock(void *lock) {
+  if (lock)
+    dbUnlockCb(lock, dbLockUserData);
+}
+
+static void* dbLockWrite() {
+  void *lock = dbLock();
+  pthread_mutex_lock(&txLock);
+  txBegin();
+  return lock;
+}
+
+static void dbUnlockWrite(void *lock) {
+  if (txOpen && dbSettings.durability == DB_DURABILITY_ASYNC) {
+    txOps++;
+    dbWriterSignal();
+  } else if (txOpen && (++txOps >= dbSettings.groupCommitOps || txStartTm + dbSettings.groupCommitTimeMs <= currTimeMs()))
+    txCommit();
+  pthread_mutex_unlock(&txLock);
+  dbUnlock(lock);
+}
+
+static uint64_t currTimeMs() {
+  return clockNowMs();
+}
+
+static void txBegin() {
+  // only group operations when the caller isn't inside of its own transaction
+  if (dbSettings.durability == DB_DURABILITY_FULL || txOpen || !sqlite3_get_autocommit(db))
+    return;
+  execSql("BEGIN;");
+  txOpen = 1;
+  txOps = 0;
+  txStartTm = currTimeMs();
+}
+
+static void txCommit() {
+  execSql("COMMIT;");
+  txOpen = 0;
+  txOps = 0;
+}
+
+static void initDb() {
+  createSchema();
+  filterLoad();
+  quotaLoad();
+}
+
+static void execSql(const char *sql) {
+  int rc;
+  char *exec_errmsg;
+  LOG("execSql: sql=%s", sql)
+  if (CK_ERROR(sqlite3_exec(db, sql, NULL, NULL, &exec_errmsg)))
+    errSql(rc, "executing sql", sql);
+}
+
+static void createSchema() {
+  // the savepoint works both inside and outside of the client's own transaction
+  void *lock = dbLock();
+  execSql("SAVEPOINT fragmented_schema;");
+  int version = schemaVersion();
+  if (version > SCHEMA_VERSION)
+    ERROR("Database schema version %d is newer than the supported version %d", version, SCHEMA_VERSION)
+  if (version == 0)
+    createSchemaV2();
+  else if (version == 1)
+    migrateSchemaV1();
+  execSql("RELEASE fragmented_schema;");
+  dbUnlock(lock);
+}
+
+static int schemaVersion() {
+  // databases of the version 1 don't have the version table
+  static sqlite3_stmt *stmt = NULL;
+  int version = 0;
+  prepare(&stmt, "SELECT name FROM sqlite_master WHERE type='table' AND name IN ('fragmented_version', 'fragmented_meta');");
+  while (execPreparedRowOrNot(stmt))
+    if (version < 1)
+      version = strcmp((const char*)sqlite3_column_text(stmt, 0), "fragmented_meta") ? 2 : 1;
+    else
+      version = 2;
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (version == 2) {
+    prepare(&stmt, "SELECT max(version) FROM fragmented_version;");
+    if (execPreparedRowOrNot(stmt))
+      version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+  }
+  return version;
+}
+
+static void createSchemaV2() {
+  // Inbound records are looked up by their key, and are kept under the explicit rowid that is cached
+  // in memory, so that the byte of the 'received' bitmap is written in place for every part; they aren't
+  // WITHOUT ROWID since the incremental blob I/O needs the rowid.
+  // Inbound payload is stored by the part, and is only accessed through the key range of the chunks.
+  // Outbound messages are stored whole, together with their meta, under the cached rowid as well.
+  execSql(
+    "CREATE TABLE fragmented_version ("
+    " version INTEGER NOT NULL); "
+    "INSERT INTO fragmented_version VALUES(2); "
+    "CREATE TABLE fragmented_filter ("
+    " generation INTEGER PRIMARY KEY,"
+    " capacity INTEGER NOT NULL,"
+    " num INTEGER NOT NULL,"
+    " bits BLOB NOT NULL,"
+    " max_id INTEGER NOT NULL); "
+    "CREATE TABLE fragmented_inbound ("
+    INBOUND_COLUMNS
+    "CREATE INDEX fragmented_inbound_expiry ON fragmented_inbound (timestamp_last); "
+    "CREATE TABLE fragmented_inbound_chunk ("
+    " friend_id INTEGER NOT NULL,"
+    " frags_id INTEGER NOT NULL,"
+    " part_no INTEGER NOT NULL,"
+    " off INTEGER NOT NULL,"
+    " data BLOB NOT NULL,"
+    " PRIMARY KEY(friend_id, frags_id, part_no)); "
+    "CREATE TABLE fragmented_outbound ("
+    " id INTEGER PRIMARY KEY,"
+    " friend_id INTEGER NOT NULL,"
+    " frags_id INTEGER NOT NULL,"
+    " type INTEGER NOT NULL,"
+    " timestamp_first INTEGER NOT NULL, timestamp_last INTEGER NOT NULL,"
+    " frags_done INTEGER NOT NULL, frags_num INTEGER NOT NULL,"
+    " receipt INTEGER NULL,"
+    " confirmed BLOB NULL,"
+    " message BLOB NOT NULL,"
+    " UNIQUE(friend_id, frags_id));"
+  );
+}
+
+static void migrateSchemaV1() {
+  // Partially received messages are moved as the single chunk #0 that the later parts are laid over,
+  // their 'confirmed' byte per part becomes the 'received' bitmap. Records of the oldest version
+  // without 'confirmed' remain legacy, and their chunk #0 is consulted like the older version did.
+  // Meta records of the finished outbound messages were never used, and are dropped.
+  static sqlite3_stmt *stmtSelect = NULL, *stmtUpdate = NULL;
+  createSchemaV2();
+  execSql(
+    "INSERT INTO fragmented_inbound (friend_id, frags_id, type, timestamp_first, timestamp_last,"
+                                   " frags_done, frags_num, size, received)"
+    " SELECT friend_id, frags_id, type, timestamp_first, timestamp_last, frags_done, frags_num,"
+    "        coalesce(length(message), 0), NULL"
+    " FROM fragmented_meta LEFT JOIN fragmented_data USING (outbound, friend_id, frags_id)"
+    " WHERE outbound=0; "
+    "INSERT INTO fragmented_inbound_chunk"
+    " SELECT friend_id, frags_id, 0, 0, message FROM fragmented_data WHERE outbound=0 AND message IS NOT NULL; "
+    "INSERT INTO fragmented_outbound (friend_id, frags_id, type, timestamp_first, timestamp_last,"
+                                    " frags_done, frags_num, receipt, confirmed, message)"
+    " SELECT friend_id, frags_id, type, timestamp_first, timestamp_last, frags_done, frags_num, receipt, confirmed, message"
+    " FROM fragmented_meta JOIN fragmented_data USING (outbound, friend_id, frags_id)"
+    " WHERE outbound=1;"
+  );
+  prepare(&stmtSelect,
+    "SELECT friend_id, frags_id, frags_num, confirmed, length(confirmed)"
+    " FROM fragmented_meta JOIN fragmented_data USING (outbound, friend_id, frags_id)"
+    " WHERE outbound=0 AND confirmed IS NOT NULL;");
+  prepare(&stmtUpdate,
+    "UPDATE fragmented_inbound SET received=? WHERE friend_id=? AND frags_id=?;");
+  while (execPreparedRowOrNot(stmtSelect)) {
+    unsigned numParts = sqlite3_column_int(stmtSelect, 2);
+    if (sqlite3_column_int(stmtSelect, 4) != numParts)
+      continue;
+    const uint8_t *confirmed = (const uint8_t*)sqlite3_column_blob(stmtSelect, 3);
+    uint8_t *received = calloc(1, DB_BITMAP_SIZE(numParts) + 1);
+    for (unsigned i = 0; i < numParts; i++)
+      if (confirmed[i])
+        BIT_SET(received, i)
+    bindBlob (stmtUpdate, 1, received, DB_BITMAP_SIZE(numParts));
+    bindInt  (stmtUpdate, 2, sqlite3_column_int(stmtSelect, 0));
+    bindInt64(stmtUpdate, 3, sqlite3_column_int64(stmtSelect, 1));
+    execPrepared(stmtUpdate);
+    free(received);
+  }
+  sqlite3_finalize(stmtSelect);
+  sqlite3_finalize(stmtUpdate);
+  stmtSelect = stmtUpdate = NULL;
+  execSql(
+    "DROP TABLE fragmented_data; "
+    "DROP TABLE fragmented_meta;"
+  );
+}
+
+static void updateInboundDone(msg_state *st, uint64_t tm, unsigned partNo) {
+  // the record keeps its size, and only the byte of the bitmap with the new part is written,
+  // both writes go together when they aren't inside of the transaction already
+  int rc;
+  int autocommit = sqlite3_get_autocommit(db);
+  if (autocommit)
+    execSql("SAVEPOINT fragmented_part;");
+  prepare(&stmtUpdateInbound,
+    "UPDATE fragmented_inbound SET timestamp_last=max(timestamp_last,?), frags_done=? WHERE id=?;");
+  bindInt64(stmtUpdateInbound, 1, tm);
+  bindInt  (stmtUpdateInbound, 2, st->numDone);
+  bindInt64(stmtUpdateInbound, 3, st->rowid);
+  execPrepared(stmtUpdateInbound);
+  if (sqlite3_changes(db) != 1)
+    ERROR("Expected 1 row in fragmented_inbound to be updated, but actual update count=%d", sqlite3_changes(db))
+  if (!st->legacy) {
+    sqlite3_blob *blob;
+    if (CK_ERROR(sqlite3_blob_open(db, "main", "fragmented_inbound", "received", st->rowid, 1/*write*/, &blob)))
+      errSql(rc, "opening the received bitmap", "fragmented_inbound.received");
+    if (CK_ERROR(sqlite3_blob_write(blob, st->parts + (partNo-1)/8, 1, (partNo-1)/8)))
+      errSql(rc, "writing the received bitmap", "fragmented_inbound.received");
+    sqlite3_blob_close(blob);
+  }
+  if (autocommit)
+    execSql("RELEASE fragmented_part;");
+}
+
+static uint8_t* assembleInbound(uint32_t friend_number, uint64_t id, unsigned size) {
+  // assemble the message, the chunk migrated from the older version goes first as part #0
+  uint8_t *message = calloc(1, size ? size : 1);
+  prepare(&stmtSelectInboundChunks,
+    "SELECT off, data, length(data) FROM fragmented_inbound_chunk WHERE friend_id=? AND frags_id=? ORDER BY part_no;");
+  bind_Int_Int64(stmtSelectInboundChunks, friend_number, id);
+  while (execPreparedRowOrNot(stmtSelectInboundChunks)) {
+    unsigned chunkOff = sqlite3_column_int(stmtSelectInboundChunks, 0);
+    unsigned chunkLen = sqlite3_column_int(stmtSelectInboundChunks, 2);
+    if (chunkOff + chunkLen <= size)
+      memcpy(message + chunkOff, sqlite3_column_blob(stmtSelectInboundChunks, 1), chunkLen);
+  }
+  resetStmt(stmtSelectInboundChunks);
+  // delete the chunks, only leave the fragmented_inbound record in order to ignore further duplicates,
+  // this is committed before the caller gets the message, so it is never delivered twice: the chunks left
+  // after a crash are of the messages that weren't delivered, the crash during the callback loses the message
+  prepare(&stmtDeleteInboundChunks,
+    "DELETE FROM fragmented_inbound_chunk WHERE friend_id=? AND frags_id=?;");
+  bind_Int_Int64(stmtDeleteInboundChunks, friend_number, id);
+  execPrepared(stmtDeleteInboundChunks);
+  if (txOpen)
+    txCommit();
+  return message;
+}
+
+static int isLegacyPartReceived(uint32_t friend_number, uint64_t id, unsigned off) {
+  // parts received before the migration are only recognized by their non-zero first byte in the chunk #0
+  prepare(&stmtSelectInboundLegacyPart,
+    "SELECT substr(data, ?, 1) <> x'00' FROM fragmented_inbound_chunk WHERE friend_id=? AND frags_id=? AND part_no=0;");
+  bindInt  (stmtSelectInboundLegacyPart, 1, off+1);
+  bindInt  (stmtSelectInboundLegacyPart, 2, friend_number);
+  bindInt64(stmtSelectInboundLegacyPart, 3, id);
+  int received = execPreparedRowOrNot(stmtSelectInboundLegacyPart) && sqlite3_column_int(stmtSelectInboundLegacyPart, 0);
+  resetStmt(stmtSelectInboundLegacyPart);
+  return received;
+}
+
+static unsigned msgStateHash(int outbound, uint32_t friend_number, uint64_t id) {
+  return (unsigned)((id ^ (id >> 32) ^ ((uint64_t)friend_number * 0x9e3779b1) ^ outbound) & (msgStatesAlloc - 1));
+}
+
+static msg_state* msgStateFind(int outbound, uint32_t friend_number, uint64_t id) {
+  if (!msgStatesNum)
+    return NULL;
+  for (msg_state *st = msgStates[msgStateHash(outbound, friend_number, id)]; st; st = st->next)
+    if (st->id == id && st->friend_number == friend_number && st->outbound == outbound)
+      return st;
+  return NULL;
+}
+
+static msg_state* msgStateNew(int outbound, uint32_t friend_number, uint64_t id, uint64_t rowid, unsigned numParts, unsigned numDone) {
+  msg_state *st = calloc(1, sizeof(msg_state) + (outbound ? numParts : DB_BITMAP_SIZE(numParts)));
+  st->outbound = outbound;
+  st->friend_number = friend_number;
+  st->id = id;
+  st->rowid = rowid;
+  st->numParts = numParts;
+  st->numDone = numDone;
+  // insert, the table is grown when it gets full
+  if (msgStatesNum >= msgStatesAlloc) {
+    msg_state **old = msgStates;
+    unsigned oldAlloc = msgStatesAlloc;
+    msgStatesAlloc = oldAlloc ? 2*oldAlloc : 16;
+    msgStates = calloc(msgStatesAlloc, sizeof(msg_state*));
+    for (unsigned b = 0; b < oldAlloc; b++)
+      while (old[b]) {
+        msg_state *s = old[b];
+        old[b] = s->next;
+        unsigned h = msgStateHash(s->outbound, s->friend_number, s->id);
+        s->next = msgStates[h];
+        msgStates[h] = s;
+      }
+    free(old);
+  }
+  unsigned h = msgStateHash(outbound, friend_number, id);
+  st->next = msgStates[h];
+  msgStates[h] = st;
+  msgStatesNum++;
+  return st;
+}
+
+static msg_state* msgStateLoadInbound(uint32_t friend_number, uint64_t id) {
+  prepare(&stmtSelectInboundState,
+    "SELECT frags_num, frags_done, size, received, length(received), id"
+    " FROM fragmented_inbound"
+    " WHERE friend_id=? AND frags_id=? AND frags_done < frags_num;");
+  bind_Int_Int64(stmtSelectInboundState, friend_number, id);
+  if (!execPreparedRowOrNot(stmtSelectInboundState)) {
+    resetStmt(stmtSelectInboundState);
+    return NULL;
+  }
+  unsigned numParts = sqlite3_column_int(stmtSelectInboundState, 0);
+  msg_state *st = msgStateNew(/*outbound*/0, friend_number, id, sqlite3_column_int64(stmtSelectInboundState, 5),
+                              numParts, sqlite3_column_int(stmtSelectInboundState, 1));
+  st->size = sqlite3_column_int(stmtSelectInboundState, 2);
+  const uint8_t *received = (const uint8_t*)sqlite3_column_blob(stmtSelectInboundState, 3);
+  if (received && sqlite3_column_int(stmtSelectInboundState, 4) == DB_BITMAP_SIZE(numParts))
+    memcpy(st->parts, received, DB_BITMAP_SIZE(numParts));
+  else
+    st->legacy = 1; // the older version only counted the received parts
+  resetStmt(stmtSelectInboundState);
+  return st;
+}
+
+static msg_state* msgStateLoadOutbound(uint32_t friend_number, uint64_t id) {
+  prepare(&stmtSelectOutboundState,
+    "SELECT id, frags_num, confirmed, length(confirmed)"
+    " FROM fragmented_outbound"
+    " WHERE friend_id=? AND frags_id=?;");
+  bind_Int_Int64(stmtSelectOutboundState, friend_number, id);
+  msg_state *st = NULL;
+  if (execPreparedRowOrNot(stmtSelectOutboundState)) {
+    st = msgStateNew(/*outbound*/1, friend_number, id,
+                     sqlite3_column_int64(stmtSelectOutboundState, 0),
+                     sqlite3_column_int(stmtSelectOutboundState, 1),
+                     0);
+    msgStateSetConfirmed(st,
+                         (const uint8_t*)sqlite3_column_blob(stmtSelectOutboundState, 2),
+                         sqlite3_column_int(stmtSelectOutboundState, 3));
+  }
+  resetStmt(stmtSelectOutboundState);
+  return st;
+}
+
+static void msgStateSetConfirmed(msg_state *st, const uint8_t *confirmed, unsigned lengthConfirmed) {
+  for (unsigned i = 0; i < st->numParts && i < lengthConfirmed; i++)
+    if ((st->parts[i] = confirmed[i] ? 1 : 0))
+      st->numDone++;
+}
+
+static void msgStateDelete(msg_state *st) {
+  if (st->dirty)
+    msgStatesDirty--;
+  msg_state **pst = &msgStates[msgStateHash(st->outbound, st->friend_number, st->id)];
+  while (*pst != st)
+    pst = &(*pst)->next;
+  *pst = st->next;
+  msgStatesNum--;
+  free(st);
+}
+
+static void msgStatesFlush() {
+  if (!msgStatesDirty)
+    return;
+  void *lock = dbLockWrite();
+  for (unsigned b = 0; b < msgStatesAlloc; b++)
+    for (msg_state *st = msgStates[b]; st; st = st->next)
+      if (st->dirty) {
+        prepare(&stmtUpdateOutboundConfirmed,
+          "UPDATE fragmented_outbound SET confirmed=?, timestamp_last=max(timestamp_last,?), frags_done=?"
+          " WHERE id=?;");
+        bindBlob (stmtUpdateOutboundConfirmed, 1, st->parts, st->numParts);
+        bindInt64(stmtUpdateOutboundConfirmed, 2, st->tmLast);
+        bindInt  (stmtUpdateOutboundConfirmed, 3, st->numDone);
+        bindInt64(stmtUpdateOutboundConfirmed, 4, st->rowid);
+        execPrepared(stmtUpdateOutboundConfirmed);
+        st->dirty = 0;
+      }
+  msgStatesDirty = 0;
+  dbUnlockWrite(lock);
+}
+
+static void gcInboundMeta(uint64_t tm) {
+  // only the records of the finished messages are purged, their chunks are already deleted
+  void *lock = dbLockWrite();
+  int ownTx = sqlite3_get_autocommit(db);
+  if (ownTx)
+    execSql("BEGIN;");
+  prepare(&stmtSelectInboundPurged,
+    "SELECT friend_id, frags_id FROM fragmented_inbound"
+    " WHERE timestamp_last < ? AND frags_done >= frags_num;");
+  bindInt64(stmtSelectInboundPurged, 1, tm - dbSettings.gcHistoryTimeSec*1000ULL);
+  unsigned num = 0;
+  while (execPreparedRowOrNot(stmtSelectInboundPurged)) {
+    filterAdd(sqlite3_column_int(stmtSelectInboundPurged, 0), sqlite3_column_int64(stmtSelectInboundPurged, 1));
+    num++;
+  }
+  resetStmt(stmtSelectInboundPurged);
+  if (num) {
+    prepare(&stmtDeleteInboundPurged,
+      "DELETE FROM fragmented_inbound"
+      " WHERE timestamp_last < ? AND frags_done >= frags_num;");
+    bindInt64(stmtDeleteInboundPurged, 1, tm - dbSettings.gcHistoryTimeSec*1000ULL);
+    execPrepared(stmtDeleteInboundPurged);
+    filterSave();
+    LOG("purged %u inbound meta records", num)
+  }
+  if (ownTx)
+    execSql("COMMIT;");
+  dbUnlockWrite(lock);
+}
+
+static void expireInbound(uint64_t tm) {
+  // incomplete messages without new fragments for the idle time lose their chunks, and their records are marked
+  // as finished, so that the late fragments are ignored, and the records are purged like of the delivered messages
+  if (!dbSettings.inIdleTimeSec)
+    return;
+  void *lock = dbLockWrite();
+  prepare(&stmtSelectInboundExpired,
+    "SELECT friend_id, frags_id, size, frags_done, frags_num FROM fragmented_inbound"
+    " WHERE timestamp_last < ? AND frags_done < frags_num;");
+  bindInt64(stmtSelectInboundExpired, 1, tm - dbSettings.inIdleTimeSec*1000ULL);
+  while (execPreparedRowOrNot(stmtSelectInboundExpired)) {
+    uint32_t friend_number = sqlite3_column_int(stmtSelectInboundExpired, 0);
+    uint64_t id = sqlite3_column_int64(stmtSelectInboundExpired, 1);
+    WARNING("dropping the incomplete inbound message id=%"PRIu64" from friend=%u: received %u of %u parts\n",
+            id, friend_number, sqlite3_column_int(stmtSelectInboundExpired, 3), sqlite3_column_int(stmtSelectInboundExpired, 4))
+    dbQuotaRelease(friend_number, sqlite3_column_int(stmtSelectInboundExpired, 2), sqlite3_column_int(stmtSelectInboundExpired, 4));
+    msg_state *st = msgStateFind(/*outbound*/0, friend_number, id);
+    if (st)
+      msgStateDelete(st);
+    prepare(&stmtDeleteInboundChunks,
+      "DELETE FROM fragmented_inbound_chunk WHERE friend_id=? AND frags_id=?;");
+    bind_Int_Int64(stmtDeleteInboundChunks, friend_number, id);
+    execPrepared(stmtDeleteInboundChunks);
+  }
+  resetStmt(stmtSelectInboundExpired);
+  prepare(&stmtUpdateInboundExpired,
+    "UPDATE fragmented_inbound SET frags_done=frags_num"
+    " WHERE timestamp_last < ? AND frags_done < frags_num;");
+  bindInt64(stmtUpdateInboundExpired, 1, tm - dbSettings.inIdleTimeSec*1000ULL);
+  execPrepared(stmtUpdateInboundExpired);
+  dbUnlockWrite(lock);
+}
+
+static void quotaLoad() {
+  // incomplete messages from before count against the limits
+  static sqlite3_stmt *stmt = NULL;
+  void *lock = dbLock();
+  dbQuotaReset();
+  prepare(&stmt, "SELECT friend_id, size, frags_num FROM fragmented_inbound WHERE frags_done < frags_num;");
+  while (execPreparedRowOrNot(stmt))
+    dbQuotaCharge(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2));
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  dbUnlock(lock);
+}
+
+static void filterLoad() {
+  static sqlite3_stmt *stmt = NULL;
+  void *lock = dbLock();
+  prepare(&stmt, "SELECT generation, capacity, num, bits, length(bits), max_id FROM fragmented_filter ORDER BY generation DESC LIMIT 2;");
+  for (int i = 0; execPreparedRowOrNot(stmt); i++) {
+    bloom *b = bloomLoad(sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+                         (const uint8_t*)sqlite3_column_blob(stmt, 3), sqlite3_column_int(stmt, 4));
+    if (!b) {
+      WARNING("ignoring the damaged duplicate filter generation=%"PRIi64"\n", (int64_t)sqlite3_column_int64(stmt, 0))
+      continue;
+    }
+    if (i == 0) {
+      filterCurr = b;
+      filterCurrGen = sqlite3_column_int64(stmt, 0);
+      filterCurrMaxId = sqlite3_column_int64(stmt, 5);
+    } else {
+      filterPrev = b;
+      filterPrevMaxId = sqlite3_column_int64(stmt, 5);
+    }
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  dbUnlock(lock);
+}
+
+static void filterAdd(uint32_t friend_number, uint64_t id) {
+  if (!filterCurr || bloomIsFull(filterCurr)) {
+    if (filterPrev)
+      bloomDelete(filterPrev);
+    filterPrev = filterCurr;
+    filterPrevDirty = filterCurrDirty;
+    filterPrevMaxId = filterCurrMaxId;
+    filterCurr = bloomCreate(dbSettings.gcFilterCapacity);
+    filterCurrGen++;
+    filterCurrMaxId = 0;
+  }
+  bloomAdd(filterCurr, friend_number, id);
+  if (filterCurrMaxId < id)
+    filterCurrMaxId = id;
+  filterCurrDirty = 1;
+}
+
+static int filterIsPurged(uint32_t friend_number, uint64_t id) {
+  // ids above the largest purged one weren't purged, this keeps the false positives
+  // of the filter away from the new messages whatever the sender's clock is
+  return (filterCurr && id <= filterCurrMaxId && bloomContains(filterCurr, friend_number, id)) ||
+         (filterPrev && id <= filterPrevMaxId && bloomContains(filterPrev, friend_number, id));
+}
+
+static void filterSave() {
+  if (filterPrevDirty)
+    filterSaveGeneration(filterCurrGen-1, filterPrev, filterPrevMaxId);
+  if (filterCurrDirty)
+    filterSaveGeneration(filterCurrGen, filterCurr, filterCurrMaxId);
+  prepare(&stmtDeleteOldFilters,
+    "DELETE FROM fragmented_filter WHERE generation < ?;");
+  bindInt64(stmtDeleteOldFilters, 1, filterCurrGen-1);
+  execPrepared(stmtDeleteOldFilters);
+  filterCurrDirty = filterPrevDirty = 0;
+}
+
+static void filterSaveGeneration(int64_t gen, const bloom *b, uint64_t maxId) {
+  prepare(&stmtSaveFilter,
+    "INSERT OR REPLACE INTO fragmented_filter (generation, capacity, num, bits, max_id) VALUES(?, ?, ?, ?, ?);");
+  bindInt64(stmtSaveFilter, 1, gen);
+  bindInt  (stmtSaveFilter, 2, b->capacity);
+  bindInt  (stmtSaveFilter, 3, b->num);
+  bindBlob (stmtSaveFilter, 4, b->bits, bloomSizeBytes(b));
+  bindInt64(stmtSaveFilter, 5, maxId);
+  execPrepared(stmtSaveFilter);
+}
+
+static void filtersDelete() {
+  if (filterCurr)
+    bloomDelete(filterCurr);
+  if (filterPrev)
+    bloomDelete(filterPrev);
+  filterCurr = filterPrev = NULL;
+  filterCurrGen = 0;
+  filterCurrMaxId = filterPrevMaxId = 0;
+  filterCurrDirty = filterPrevDirty = 0;
+  gcLastTm = 0;
+}
+
+static void msgStatesDeleteAll() {
+  for (unsigned b = 0; b < msgStatesAlloc; b++)
+    while (msgStates[b]) {
+      msg_state *st = msgStates[b];
+      msgStates[b] = st->next;
+      free(st);
+    }
+  free(msgStates);
+  msgStates = NULL;
+  msgStatesNum = 0;
+  msgStatesDirty = 0;
+  msgStatesAlloc = 0;
+}
+
+static sqlite3_stmt* prepareStatement(const char *sql) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  const char *tail = NULL;
+  if (CK_ERROR(sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, &tail)))
+    errSql(rc, "preparing statement", sql);
+  return stmt;
+}
+
+static void destroyPreparedStatement(sqlite3_stmt **stmt) {
+  if (*stmt) {
+    sqlite3_finalize(*stmt);
+    *stmt = NULL;
+  }
+}
+
+static void destroyPreparedStatements() {
+  destroyPreparedStatement(&stmtInsertInbound);
+  destroyPreparedStatement(&stmtInsertInboundChunk);
+  destroyPreparedStatement(&stmtUpdateInbound);
+  destroyPreparedStatement(&stmtSelectInboundDone);
+  destroyPreparedStatement(&stmtSelectInboundChunks);
+  destroyPreparedStatement(&stmtSelectInboundLegacyPart);
+  destroyPreparedStatement(&stmtDeleteInboundChunks);
+  destroyPreparedStatement(&stmtSelectInboundExpired);
+  destroyPreparedStatement(&stmtUpdateInboundExpired);
+  destroyPreparedStatement(&stmtSelectInboundReceived);
+  destroyPreparedStatement(&stmtInsertOutbound);
+  destroyPreparedStatement(&stmtSelectOutboundPending);
+  destroyPreparedStatement(&stmtDeleteOutbound);
+  destroyPreparedStatement(&stmtSelectInboundState);
+  destroyPreparedStatement(&stmtSelectOutboundState);
+  destroyPreparedStatement(&stmtUpdateOutboundConfirmed);
+  destroyPreparedStatement(&stmtSelectInboundPurged);
+  destroyPreparedStatement(&stmtDeleteInboundPurged);
+  destroyPreparedStatement(&stmtSaveFilter);
+  destroyPreparedStatement(&stmtDeleteOldFilters);
+}
+
+static void prepare(sqlite3_stmt **pstmt, const char *sql) {
+  if (*pstmt == NULL)
+    *pstmt = prepareStatement(sql);
+}
+
+static void bindInt(sqlite3_stmt *stmt, int n, int a) {
+  int rc;
+  if (CK_ERROR(sqlite3_bind_int(stmt, n, a)))
+    errSql(rc, "binding int value", sqlite3_sql(stmt));
+}
+
+static void bindInt64(sqlite3_stmt *stmt, int n, sqlite3_int64 a) {
+  int rc;
+  if (CK_ERROR(sqlite3_bind_int64(stmt, n, a)))
+    errSql(rc, "binding int64 value", sqlite3_sql(stmt));
+}
+
+static void bindBlob(sqlite3_stmt *stmt, int n, const uint8_t *data, size_t size) {
+  int rc;
+  if (CK_ERROR(sqlite3_bind_blob64(stmt, n, data, size, NULL)))
+    errSql(rc, "binding blob value", sqlite3_sql(stmt));
+}
+
+
+static void bind_Int_Int64(sqlite3_stmt *stmt, int a1, sqlite3_int64 a2) {
+  bindInt  (stmt, 1, a1);
+  bindInt64(stmt, 2, a2);
+}
+
+static void execPrepared(sqlite3_stmt *stmt) {
+  int rc;
+  if ((rc = sqlite3_step(stmt)) != SQLITE_DONE)
+    errSql(rc, "executing prepared statement", sqlite3_sql(stmt));
+  resetStmt(stmt);
+  LOG("execPrepared: sql=%s", sqlite3_sql(stmt))
+}
+
+static int execPreparedRowOrNot(sqlite3_stmt *stmt) {
+  int rc;
+  if ((rc = sqlite3_step(stmt)) != SQLITE_ROW && rc != SQLITE_DONE)
+    errSql(rc, "executing prepared statement", sqlite3_sql(stmt));
+  LOG("execPreparedRowOrNot: sql=%s rowExists=%s", sqlite3_sql(stmt), rc == SQLITE_ROW ? "YES" : "NO")
+  return rc == SQLITE_ROW;
+}
+
+static void resetStmt(sqlite3_stmt *stmt) {
+  sqlite3_reset(stmt);
+}
+
+static void errSql(int rc, const char *op, const char *sql) {
+  fprintf(stderr, "Error while %s: sql=%s error=%s (%d)\n", op, sql, sqlite3_errstr(rc), rc);
+  abort();
+}
+
+#endif // !NO_SQLITE
@@ -5,126 +5,107 @@
 #include "common.h"
 #include "sqlite-interface.h"
 #include "database.h"
+#include "database-backend.h"
 #include "util.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
-
-//#define USE_BLOB_CACHE    // blob cache can't be used until the SQLite bug is fixed
-
-// macros
-#define CK_ERROR(stmt...) \
-  (SQLITE_OK != (rc = stmt))
-#define LOG(fmt...) //utilLog(__FUNCTION__, "Db", fmt);
-
-// database objects
-static sqlite3 *db = NULL;
-static DbLockCb dbLockCb = NULL;
-static DbUnlockCb dbUnlockCb = NULL;
-static void *dbLockUserData = NULL;
-static uint8_t dbInMemory = 0;
-#if defined(USE_BLOB_CACHE)
-#define USE_SQLITE_WORKAROUND // this workaround avoids rowid collisions, but doesn't help in the case of concurrently received messages
-static sqlite3_blob *blobCache = NULL;
-static int64_t blobCacheRowid = 0;
-#endif
-static char dbName[64];
-
-// prepared statements
-static sqlite3_stmt *stmtInsertFragmentedDataInbound = NULL;
-static sqlite3_stmt *stmtInsertFragmentedMetaInbound = NULL;
-static sqlite3_stmt *stmtSelectRowidFromFragmentedMeta = NULL;
-static sqlite3_stmt *stmtInsertFragmentedDataOutbound = NULL;
-static sqlite3_stmt *stmtInsertFragmentedMetaOutbound = NULL;
-static sqlite3_stmt *stmtUpdateFragmentedMeta = NULL;
-static sqlite3_stmt *stmtSelectFragmentedInboundDone = NULL;
-static sqlite3_stmt *stmtSelectFragmentedOutboundPending = NULL;
-static sqlite3_stmt *stmtDeleteFragmentedData = NULL;
+#include <pthread.h>
+
+// backend
+static const DbBackend *backend = NULL;
+
+// writer thread: with DB_DURABILITY_ASYNC the operations take effect on the calling thread, and are only
+// queued for the commit, which the writer thread does in their order. The backend buffers the operations
+// until then: the journal in its write buffer, SQLite in the open transaction. Operations made while
+// the commit is in progress go into the next one.
+static pthread_t writerThread;
+static pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writerCond = PTHREAD_COND_INITIALIZER;
+static uint8_t writerRunning = 0;
+static uint8_t writerPending = 0;
+static uint8_t writerStopFlag = 0;
+
+// settings
+FUNC_LOCAL DbSettings dbSettings = {
+  DB_DURABILITY_FULL,
+  0,              // group commit time
+  0,              // group commit operations
+  7*24*3600,      // inbound history: 7 days
+  16384,          // duplicate filter capacity
+  32*1024*1024,   // incomplete inbound bytes per friend
+  256,            // incomplete inbound messages per friend
+  256*1024*1024,  // incomplete inbound bytes in total
+  4096,           // incomplete inbound messages in total
+  7*24*3600       // incomplete inbound idle time: 7 days
+};
+
+// incomplete inbound messages, friend numbers are small indexes of the friend list, so they index the array
+typedef struct quota_friend {
+  uint64_t bytes;
+  unsigned msgs;
+  uint64_t duplicates; // fragments dropped as duplicates, for the stats
+} quota_friend;
+static quota_friend *quotaFriends = NULL;
+static unsigned quotaFriendsAlloc = 0;
+static uint64_t quotaBytes = 0;
+static unsigned quotaMsgs = 0;
+static uint64_t quotaDuplicates = 0;
 
 // internal declarations
-
-static void* dbLock();
-static void dbUnlock(void *lock);
-static void initDb();
-static void execSql(const char *sql);
-static void createSchema();
-static void readDbName(char *name);
-static uint64_t getFragmentsDataRowid(int outbound, uint32_t friend_number, uint64_t id);
-static void updateFragmentedMetaDone(int outbound, uint64_t tm, uint32_t friend_number, uint64_t id);
-static void deleteDataRecord(int outbound, uint32_t friend_number, uint64_t id);
-static sqlite3_stmt* prepareStatement(const char *sql);
-static void destroyPreparedStatement(sqlite3_stmt **stmt);
-static void destroyPreparedStatements();
-static void prepare(sqlite3_stmt **pstmt, const char *sql);
-static void bindInt(sqlite3_stmt *stmt, int n, int a);
-static void bindInt64(sqlite3_stmt *stmt, int n, sqlite3_int64 a);
-static void bindBlob(sqlite3_stmt *stmt, int n, const uint8_t *data, size_t size);
-static void bind_Int_Int64(sqlite3_stmt *stmt, int a1, sqlite3_int64 a2);
-static void bind_Int_Int_Int64(sqlite3_stmt *stmt, int a1, int a2, sqlite3_int64 a3);
-static void bind_Int_Int64_Int_Int64(sqlite3_stmt *stmt, int a1, sqlite3_int64 a2, int a3, sqlite3_int64 a4);
-static void bind_Int_Int64_Blob_Int_Int(sqlite3_stmt *stmt,
-                                        int a1, sqlite3_int64 a2, const uint8_t *a3data, size_t a3size,
-                                        int a4, int a5);
-static void bind_Int_Int64_Int64_Int_Int64(sqlite3_stmt *stmt,
-                                           int a1, sqlite3_int64 a2, sqlite3_int64 a3, int a4,
-                                           sqlite3_int64 a5);
-static void bind_Int_Int_Int64_Int64_Int64_Int(sqlite3_stmt *stmt,
-                                               int a1, int a2, sqlite3_int64 a3, sqlite3_int64 a4,
-                                               sqlite3_int64 a5, int a6);
-static void bind_Int_Int_Int64_Int64_Int64_Int_Int_Int64(sqlite3_stmt *stmt,
-                                                         int a1, int a2, sqlite3_int64 a3, sqlite3_int64 a4,
-                                                         sqlite3_int64 a5, int a6, int a7, sqlite3_int64 a8);
-static void execPrepared(sqlite3_stmt *stmt);
-static int execPreparedRowOrNot(sqlite3_stmt *stmt);
-static int execPreparedInt64(sqlite3_stmt *stmt, int iCol, int64_t *value);
-static int execPreparedText(sqlite3_stmt *stmt, int iCol, unsigned char *value);
-static void resetStmt(sqlite3_stmt *stmt);
-static void err(int rc, const char *op);
-static void errSql(int rc, const char *op, const char *sql);
-static sqlite3_blob* openBlob(const char *table, const char *field, uint64_t rowid);
-static void readBlob(sqlite3_blob *blob, uint8_t *data, unsigned length, unsigned off);
-static void writeBlob(sqlite3_blob *blob, const uint8_t *data, unsigned length, unsigned off);
-static void closeBlob(sqlite3_blob *blob);
-#if defined(USE_BLOB_CACHE)
-static void blobCacheCloseBlob();
-#endif
+static void writerStart();
+static void writerStop();
+static void* writerRoutine(void *arg);
+static quota_friend* quotaFriend(uint32_t friend_number);
 
 // functions
 
 FUNC_LOCAL void dbInitialize(sqlite3 *new_db, DbLockCb lockCb, DbUnlockCb unlockCb, void *user_data) {
-  db = new_db;
-  dbLockCb = lockCb;
-  dbUnlockCb = unlockCb;
-  dbLockUserData = user_data;
-  initDb();
+#if !defined(NO_SQLITE)
+  backend = dbSqliteInitialize(new_db, lockCb, unlockCb, user_data);
+  writerStart();
+#else
+  ERROR("The SQLite backend isn't built in, use the journal backend instead")
+#endif
 }
 
 FUNC_LOCAL void dbInitializeInMemory() {
-  int rc;
-  if (CK_ERROR(sqlite3_open(":memory:", &db)))
-    err(rc, "creating the in-memory database");
-  dbInMemory = 1;
-  initDb();
+  backend = dbMemoryInitialize();
+  writerStart();
+}
+
+FUNC_LOCAL void dbInitializeJournal(const char *path) {
+  backend = dbJournalInitialize(path);
+  writerStart();
+}
+
+FUNC_LOCAL void dbSetDurability(DbDurability durability, unsigned groupCommitTimeMs, unsigned groupCommitOps) {
+  dbSettings.durability = durability;
+  dbSettings.groupCommitTimeMs = groupCommitTimeMs;
+  dbSettings.groupCommitOps = groupCommitOps;
+}
+
+FUNC_LOCAL void dbSetGcParameters(unsigned historyTimeSec, unsigned filterCapacity) {
+  dbSettings.gcHistoryTimeSec = historyTimeSec;
+  dbSettings.gcFilterCapacity = filterCapacity;
+}
+
+FUNC_LOCAL void dbSetInboundLimits(unsigned maxBytesPerFriend, unsigned maxMsgsPerFriend, uint64_t maxBytes, unsigned maxMsgs, unsigned idleTimeSec) {
+  dbSettings.inMaxBytesPerFriend = maxBytesPerFriend;
+  dbSettings.inMaxMsgsPerFriend = maxMsgsPerFriend;
+  dbSettings.inMaxBytes = maxBytes;
+  dbSettings.inMaxMsgs = maxMsgs;
+  dbSettings.inIdleTimeSec = idleTimeSec;
 }
 
 FUNC_LOCAL void dbUninitialize() {
-#if defined(USE_BLOB_CACHE)
-  if (blobCache)
-    blobCacheCloseBlob();
-#endif
-  destroyPreparedStatements();
-  if (dbInMemory) {
-    int rc;
-    if (CK_ERROR(sqlite3_close(db)))
-      err(rc, "closing the in-memory database");
-    dbInMemory = 0;
-  }
-  db = NULL;
-  dbLockCb = NULL;
-  dbUnlockCb = NULL;
-  dbLockUserData = NULL;
-  memset(dbName, 0, sizeof(dbName));
+  writerStop();
+  if (backend)
+    backend->uninitialize();
+  backend = NULL;
+  dbQuotaReset();
 }
 
 FUNC_LOCAL void dbInsertInboundFragment(void *tox_opaque,
@@ -134,95 +115,11 @@ FUNC_LOCAL void dbInsertInboundFragment(void *tox_opaque,
                                         uint64_t tm,
                                         DbMsgReadyCb msgReadyCb,
                                         void *user_data) {
-  // Try inserting records while some other fragment can also be inserting it.
-  // In case fragmented_meta exists but fragmented_data doesn't, this message is already finished
-  // and fragments are considered duplicates and are ignored.
-
-  LOG("part#%u off=%u sz=%u len=%u data=-->%*s<--", partNo, off, sz, (unsigned)length, (unsigned)length, (const char*)data)
-  void *lock = dbLock();
-  prepare(&stmtInsertFragmentedDataInbound,
-    "INSERT INTO fragmented_data (outbound, friend_id, frags_id, message)"
-    " SELECT 0, ?, ?, zeroblob(?)"
-    " WHERE NOT EXISTS (SELECT 1 FROM fragmented_meta WHERE outbound=0 AND friend_id=? AND frags_id=?);");
-  bind_Int_Int64_Int64_Int_Int64(stmtInsertFragmentedDataInbound, friend_number, id, sz, friend_number, id);
-  execPrepared(stmtInsertFragmentedDataInbound);
-
-  prepare(&stmtInsertFragmentedMetaInbound,
-    "INSERT INTO fragmented_meta (outbound, friend_id, type, frags_id, timestamp_first, timestamp_last,"
-                                " frags_done, frags_num)"
-    " SELECT 0, ?, ?, ?, ?, ?, 0, ?"
-    " WHERE NOT EXISTS (SELECT 1 FROM fragmented_meta WHERE outbound=0 AND friend_id=? AND frags_id=?);");
-  bind_Int_Int_Int64_Int64_Int64_Int_Int_Int64(stmtInsertFragmentedMetaInbound, friend_number, type, id, tm, tm, numParts, friend_number, id);
-  execPrepared(stmtInsertFragmentedMetaInbound);
-
-  uint64_t rowid = getFragmentsDataRowid(/*outbound*/0, friend_number, id);
-  if (!rowid) {
-    dbUnlock(lock);
-    return; // record is ready, must be a late duplicate
-  }
-  // write blob
-#if defined(USE_BLOB_CACHE)
-  if (!blobCache || rowid != blobCacheRowid) {
-    if (blobCache)
-      blobCacheCloseBlob();
-    blobCache = openBlob("fragmented_data", "message", rowid);
-    LOG("opened a blob object for rowid=%"PRIi64"", rowid)
-    blobCacheRowid = rowid;
-  }
-  sqlite3_blob *blob = blobCache;
-#else
-  sqlite3_blob *blob = openBlob("fragmented_data", "message", rowid);
-#endif
-  uint8_t firstByte = 0;
-  readBlob(blob, &firstByte, 1, off);
-  if (firstByte && firstByte != data[0])
-    WARNING("mismatching byte in blob: expected 0x%02x found 0x%02x for friend=%u msg id=%"PRIu64" partNo=%u numParts=%u off=%u sz=%u\n",
-      data[0], firstByte, friend_number, id, partNo, numParts, off, sz);
-  if (firstByte) {
-#if !defined(USE_BLOB_CACHE)
-    closeBlob(blob);
-#endif
-    return; // duplicate fragment received
-  }
-  writeBlob(blob, data, length, off);
-  LOG("wrote a blob portion for rowid=%"PRIi64": length=%u off=%u", rowid, (unsigned)length, off)
-#if !defined(USE_BLOB_CACHE)
-  closeBlob(blob);
-#endif
-  updateFragmentedMetaDone(/*outbound=*/0, tm, friend_number, id);
-  // see if the message is ready
-  prepare(&stmtSelectFragmentedInboundDone,
-    "SELECT timestamp_first, timestamp_last, friend_id, message, length(message)"
-    " FROM fragmented_meta JOIN fragmented_data USING (outbound, friend_id, frags_id)"
-    " WHERE outbound=0 AND friend_id=? AND frags_id=? AND frags_done = frags_num;");
-  bind_Int_Int64(stmtSelectFragmentedInboundDone, friend_number, id);
-  if (execPreparedRowOrNot(stmtSelectFragmentedInboundDone)) {
-#if defined(USE_BLOB_CACHE)
-    // blob isn't needed any more
-    blobCacheCloseBlob();
-#endif
-    // notify the caller that the message is complete
-    // the message is ready, notify the caller
-    LOG("dbInsertInboundFragment >>> msgReadyCb")
-    msgReadyCb(
-      tox_opaque,
-      sqlite3_column_int64(stmtSelectFragmentedInboundDone, 0),
-      sqlite3_column_int64(stmtSelectFragmentedInboundDone, 1),
-      sqlite3_column_int(stmtSelectFragmentedInboundDone, 2),
-      type,
-      (const uint8_t*)sqlite3_column_blob(stmtSelectFragmentedInboundDone, 3),
-      sqlite3_column_int64(stmtSelectFragmentedInboundDone, 4),
-      user_data);
-    LOG("dbInsertInboundFragment <<< msgReadyCb")
-    resetStmt(stmtSelectFragmentedInboundDone);
-    LOG("dbInsertInboundFragment: done resetStmt")
-    // delete the data record, only leave the meta record in order to ignore further duplicates
-    deleteDataRecord(/*outbound=*/0, friend_number, id);
-    LOG("dbInsertInboundFragment: done deleteDataRecord")
-  } else {
-    resetStmt(stmtSelectFragmentedInboundDone);
-  }
-  dbUnlock(lock);
+  // the caller drops the fragments that dbFragmentValid rejects, the duration includes the client's callback
+  // when the message is ready
+  uint64_t start = TRACE_START();
+  backend->insertInboundFragment(tox_opaque, friend_number, type, id, partNo, numParts, off, sz, data, length, tm, msgReadyCb, user_data);
+  TRACE_DB(TRACE_DB_INSERT_INBOUND, friend_number, id, start)
 }
 
 FUNC_LOCAL void dbInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
@@ -230,377 +127,185 @@ FUNC_LOCAL void dbInsertOutboundMessage(uint32_t friend_number, int type, uint64
                                         unsigned numParts,
                                         const uint8_t *data, size_t length,
                                         uint32_t receipt) {
-  void *lock = dbLock();
-  prepare(&stmtInsertFragmentedMetaOutbound,
-    "INSERT INTO fragmented_meta (outbound, friend_id, type, frags_id, timestamp_first, timestamp_last,"
-                                " frags_done, frags_num)"
-    " VALUES(1, ?, ?, ?, ?, ?, 0, ?);");
-  bind_Int_Int_Int64_Int64_Int64_Int(stmtInsertFragmentedMetaOutbound, friend_number, type, id, tm, tm, numParts);
-  execPrepared(stmtInsertFragmentedMetaOutbound);
-
-  prepare(&stmtInsertFragmentedDataOutbound,
-    "INSERT INTO fragmented_data (outbound, friend_id, frags_id, message, confirmed, receipt)"
-    " VALUES(1, ?, ?, ?, zeroblob(?), ?);");
-  bind_Int_Int64_Blob_Int_Int(stmtInsertFragmentedDataOutbound, friend_number, id, data, length, numParts, receipt);
-  execPrepared(stmtInsertFragmentedDataOutbound);
-  dbUnlock(lock);
+  uint64_t start = TRACE_START();
+  backend->insertOutboundMessage(friend_number, type, id, tm, numParts, data, length, receipt);
+  TRACE_DB(TRACE_DB_INSERT_OUTBOUND, friend_number, id, start)
 }
 
 FUNC_LOCAL void dbOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm) {
-  void *lock = dbLock();
-  uint64_t rowid = getFragmentsDataRowid(/*outbound*/1, friend_number, id);
-  if (!rowid)
-    abort();
-  uint8_t one = 1;
-  sqlite3_blob *confirmedBlob = openBlob("fragmented_data", "confirmed", rowid);
-  writeBlob(confirmedBlob, &one, 1, partNo-1);
-  closeBlob(confirmedBlob);
-  updateFragmentedMetaDone(/*outbound=*/1, tm, friend_number, id);
-  dbUnlock(lock);
+  uint64_t start = TRACE_START();
+  backend->outboundPartConfirmed(friend_number, id, partNo, tm);
+  TRACE_DB(TRACE_DB_PART_CONFIRMED, friend_number, id, start)
 }
 
 FUNC_LOCAL void dbLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb) {
-  void *lock = dbLock();
-  prepare(&stmtSelectFragmentedOutboundPending,
-    "SELECT friend_id, type, frags_id,"
-          " timestamp_first, timestamp_last,"
-          " frags_done, frags_num,"
-          " message, length(message),"
-          " confirmed, length(confirmed),"
-          " receipt"
-    " FROM fragmented_meta JOIN fragmented_data USING (outbound, friend_id, frags_id)"
-    " WHERE outbound=1;");
-  while (execPreparedRowOrNot(stmtSelectFragmentedOutboundPending)) {
-    msgPendingSentCb(
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 0),
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 1),
-      sqlite3_column_int64(stmtSelectFragmentedOutboundPending, 2),
-      sqlite3_column_int64(stmtSelectFragmentedOutboundPending, 3),
-      sqlite3_column_int64(stmtSelectFragmentedOutboundPending, 4),
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 5),
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 6),
-      (const uint8_t*)sqlite3_column_blob(stmtSelectFragmentedOutboundPending, 7),
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 8),
-      (const uint8_t*)sqlite3_column_blob(stmtSelectFragmentedOutboundPending, 9),
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 10),
-      sqlite3_column_int  (stmtSelectFragmentedOutboundPending, 11)
-    );
-  }
-  resetStmt(stmtSelectFragmentedOutboundPending);
-  dbUnlock(lock);
-}
-
-FUNC_LOCAL void dbClearOutboundPending(uint32_t friend_number, uint64_t id) {
-  void *lock = dbLock();
-  deleteDataRecord(/*outbound=*/1, friend_number, id);
-  dbUnlock(lock);
-}
-
-FUNC_LOCAL void dbPeriodic() {
-}
-
-// internal definitions
-
-static void* dbLock() {
-  return dbLockCb ? dbLockCb(dbLockUserData) : NULL;
-}
-
-static void dbUnlock(void *lock) {
-  if (lock)
-    dbUnlockCb(lock, dbLockUserData);
-}
-
-static void initDb() {
-  createSchema();
-  readDbName(dbName);
-}
-
-static void execSql(const char *sql) {
-  int rc;
-  char *exec_errmsg;
-  LOG("execSql: sql=%s", sql)
-  if (CK_ERROR(sqlite3_exec(db, sql, NULL, NULL, &exec_errmsg)))
-    errSql(rc, "executing sql", sql);
-}
-
-static void createSchema() {
-  void *lock = dbLock();
-  execSql(
-    "CREATE TABLE IF NOT EXISTS fragmented_meta ("
-    " outbound INTEGER NOT NULL,"
-    " friend_id INTEGER NOT NULL,"
-    " type INTEGER NOT NULL,"
-    " frags_id INTEGER NOT NULL,"
-    " timestamp_first INTEGER NOT NULL, timestamp_last INTEGER NOT NULL,"
-    " frags_done INTEGER NOT NULL, frags_num INTEGER NOT NULL,"
-    " PRIMARY KEY(outbound, friend_id, frags_id)); "
-    "CREATE TABLE IF NOT EXISTS fragmented_data ("
-    " outbound INTEGER NOT NULL,"
-    " friend_id INTEGER NOT NULL,"
-    " frags_id INTEGER NOT NULL,"
-    " message BLOB NULL,"
-    " confirmed BLOB NULL,"
-    " receipt INTEGER NULL,"
-#if !defined(USE_SQLITE_WORKAROUND)
-    " PRIMARY KEY(outbound, friend_id, frags_id));"
-#else
-    " id INTEGER PRIMARY KEY AUTOINCREMENT,"
-    " UNIQUE(outbound, friend_id, frags_id));"
-    "INSERT INTO sqlite_sequence VALUES('fragmented_data', 1000000000);"
-#endif
-  );
-  dbUnlock(lock);
-}
-
-static void readDbName(char *name) {
-  static sqlite3_stmt *stmt = NULL;
-  prepare(&stmt, "PRAGMA database_list;");
-  execPreparedText(stmt, 1, (unsigned char*)name);
-  sqlite3_finalize(stmt);
-}
-
-static uint64_t getFragmentsDataRowid(int outbound, uint32_t friend_number, uint64_t id) {
-  prepare(&stmtSelectRowidFromFragmentedMeta,
-    "SELECT rowid FROM fragmented_data WHERE outbound=? AND friend_id=? AND frags_id=?;");
-  bind_Int_Int_Int64(stmtSelectRowidFromFragmentedMeta, outbound, friend_number, id);
-  int64_t rowid = 0;
-  if (execPreparedInt64(stmtSelectRowidFromFragmentedMeta, 0, &rowid))
-    return rowid;
-  else
-    return 0;
-}
-
-static void updateFragmentedMetaDone(int outbound, uint64_t tm, uint32_t friend_number, uint64_t id) {
-  prepare(&stmtUpdateFragmentedMeta,
-    "UPDATE fragmented_meta SET timestamp_last=max(timestamp_last,?), frags_done = frags_done+1"
-    " WHERE outbound=? AND friend_id=? AND frags_id=?;");
-  bind_Int_Int64_Int_Int64(stmtUpdateFragmentedMeta, tm, outbound, friend_number, id);
-  execPrepared(stmtUpdateFragmentedMeta);
-  if (sqlite3_changes(db) != 1)
-    ERROR("Expected 1 row in fragmented_meta to be updated, but actual update count=%d", sqlite3_changes(db))
+  backend->loadPendingSentMessages(msgPendingSentCb);
 }
 
-static void deleteDataRecord(int outbound, uint32_t friend_number, uint64_t id) {
-  LOG("deleteDataRecord: outbound=%u friend_number=%u id=%"PRIu64"", outbound, friend_number, id)
-  prepare(&stmtDeleteFragmentedData,
-    "DELETE FROM fragmented_data WHERE outbound=? AND friend_id=? AND frags_id=?;");
-  bind_Int_Int_Int64(stmtDeleteFragmentedData, outbound, friend_number, id);
-  execPrepared(stmtDeleteFragmentedData);
+FUNC_LOCAL void dbDeliverUndelivered(void *tox_opaque, DbMsgReadyCb msgReadyCb, void *user_data) {
+  // once after the initialization, when the caller has what the client's callbacks need
+  if (backend->deliverUndelivered)
+    backend->deliverUndelivered(tox_opaque, msgReadyCb, user_data);
 }
 
-static sqlite3_stmt* prepareStatement(const char *sql) {
-  int rc;
-  sqlite3_stmt *stmt = NULL;
-  const char *tail = NULL;
-  if (CK_ERROR(sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, &tail)))
-    errSql(rc, "preparing statement", sql);
-  return stmt;
-}
-
-static void destroyPreparedStatement(sqlite3_stmt **stmt) {
-  if (*stmt) {
-    sqlite3_finalize(*stmt);
-    *stmt = NULL;
+FUNC_LOCAL void dbClearOutboundPending(uint32_t friend_number, uint64_t id) {
+  uint64_t start = TRACE_START();
+  backend->clearOutboundPending(friend_number, id);
+  TRACE_DB(TRACE_DB_CLEAR_OUTBOUND, friend_number, id, start)
+}
+
+FUNC_LOCAL DbInboundState dbInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received) {
+  // the bitmap of the received parts is allocated for the partially received message, the caller frees it
+  *numParts = 0;
+  *received = NULL;
+  uint64_t start = TRACE_START();
+  DbInboundState state = backend->inboundReceived(friend_number, id, numParts, received);
+  TRACE_DB(TRACE_DB_INBOUND_RECEIVED, friend_number, id, start)
+  return state;
+}
+
+FUNC_LOCAL void dbInboundStats(const uint32_t *friend_number, uint64_t *pendingBytes, uint64_t *duplicates) {
+  // NULL friend_number means all friends
+  if (!friend_number) {
+    *pendingBytes = quotaBytes;
+    *duplicates = quotaDuplicates;
+  } else if (*friend_number < quotaFriendsAlloc) {
+    *pendingBytes = quotaFriends[*friend_number].bytes;
+    *duplicates = quotaFriends[*friend_number].duplicates;
+  } else {
+    *pendingBytes = *duplicates = 0;
   }
 }
 
-static void destroyPreparedStatements() {
-  destroyPreparedStatement(&stmtInsertFragmentedDataInbound);
-  destroyPreparedStatement(&stmtInsertFragmentedMetaInbound);
-  destroyPreparedStatement(&stmtSelectRowidFromFragmentedMeta);
-  destroyPreparedStatement(&stmtInsertFragmentedDataOutbound);
-  destroyPreparedStatement(&stmtInsertFragmentedMetaOutbound);
-  destroyPreparedStatement(&stmtUpdateFragmentedMeta);
-  destroyPreparedStatement(&stmtSelectFragmentedInboundDone);
-  destroyPreparedStatement(&stmtSelectFragmentedOutboundPending);
-  destroyPreparedStatement(&stmtDeleteFragmentedData);
-}
-
-static void prepare(sqlite3_stmt **pstmt, const char *sql) {
-  if (*pstmt == NULL)
-    *pstmt = prepareStatement(sql);
-}
-
-static void bindInt(sqlite3_stmt *stmt, int n, int a) {
-  int rc;
-  if (CK_ERROR(sqlite3_bind_int(stmt, n, a)))
-    errSql(rc, "binding int value", sqlite3_sql(stmt));
-}
-
-static void bindInt64(sqlite3_stmt *stmt, int n, sqlite3_int64 a) {
-  int rc;
-  if (CK_ERROR(sqlite3_bind_int64(stmt, n, a)))
-    errSql(rc, "binding int64 value", sqlite3_sql(stmt));
-}
-
-static void bindBlob(sqlite3_stmt *stmt, int n, const uint8_t *data, size_t size) {
-  int rc;
-  if (CK_ERROR(sqlite3_bind_blob64(stmt, n, data, size, NULL)))
-    errSql(rc, "binding blob value", sqlite3_sql(stmt));
-}
-
-
-static void bind_Int_Int64(sqlite3_stmt *stmt, int a1, sqlite3_int64 a2) {
-  bindInt  (stmt, 1, a1);
-  bindInt64(stmt, 2, a2);
-}
-
-static void bind_Int_Int_Int64(sqlite3_stmt *stmt, int a1, int a2, sqlite3_int64 a3) {
-  bindInt  (stmt, 1, a1);
-  bindInt  (stmt, 2, a2);
-  bindInt64(stmt, 3, a3);
-}
-
-static void bind_Int_Int64_Int_Int64(sqlite3_stmt *stmt, int a1, sqlite3_int64 a2, int a3, sqlite3_int64 a4) {
-  bindInt  (stmt, 1, a1);
-  bindInt64(stmt, 2, a2);
-  bindInt  (stmt, 3, a3);
-  bindInt64(stmt, 4, a4);
-}
-
-static void bind_Int_Int64_Blob_Int_Int(sqlite3_stmt *stmt,
-                                        int a1, sqlite3_int64 a2, const uint8_t *a3data, size_t a3size,
-                                        int a4, int a5) {
-  bindInt  (stmt, 1, a1);
-  bindInt64(stmt, 2, a2);
-  bindBlob (stmt, 3, a3data, a3size);
-  bindInt  (stmt, 4, a4);
-  bindInt  (stmt, 5, a5);
-}
-
-static void bind_Int_Int64_Int64_Int_Int64(sqlite3_stmt *stmt,
-                                           int a1, sqlite3_int64 a2, sqlite3_int64 a3, int a4,
-                                           sqlite3_int64 a5) {
-  bindInt  (stmt, 1, a1);
-  bindInt64(stmt, 2, a2);
-  bindInt64(stmt, 3, a3);
-  bindInt64(stmt, 4, a4);
-  bindInt64(stmt, 5, a5);
-}
-
-static void bind_Int_Int_Int64_Int64_Int64_Int(sqlite3_stmt *stmt,
-                                               int a1, int a2, sqlite3_int64 a3, sqlite3_int64 a4,
-                                               sqlite3_int64 a5, int a6) {
-  bindInt  (stmt, 1, a1);
-  bindInt  (stmt, 2, a2);
-  bindInt64(stmt, 3, a3);
-  bindInt64(stmt, 4, a4);
-  bindInt64(stmt, 5, a5);
-  bindInt  (stmt, 6, a6);
-}
-
-static void bind_Int_Int_Int64_Int64_Int64_Int_Int_Int64(sqlite3_stmt *stmt,
-                                                         int a1, int a2, sqlite3_int64 a3, sqlite3_int64 a4,
-                                                         sqlite3_int64 a5, int a6, int a7, sqlite3_int64 a8) {
-  bindInt  (stmt, 1, a1);
-  bindInt  (stmt, 2, a2);
-  bindInt64(stmt, 3, a3);
-  bindInt64(stmt, 4, a4);
-  bindInt64(stmt, 5, a5);
-  bindInt  (stmt, 6, a6);
-  bindInt  (stmt, 7, a7);
-  bindInt64(stmt, 8, a8);
-}
-
-static void execPrepared(sqlite3_stmt *stmt) {
-  int rc;
-  if ((rc = sqlite3_step(stmt)) != SQLITE_DONE)
-    errSql(rc, "executing prepared statement", sqlite3_sql(stmt));
-  resetStmt(stmt);
-  LOG("execPrepared: sql=%s", sqlite3_sql(stmt))
+FUNC_LOCAL void dbPeriodic() {
+  if (!backend)
+    return;
+  uint64_t start = TRACE_START();
+  backend->periodic();
+  TRACE_DB(TRACE_DB_PERIODIC, 0, 0, start)
 }
 
-static int execPreparedRowOrNot(sqlite3_stmt *stmt) {
-  int rc;
-  if ((rc = sqlite3_step(stmt)) != SQLITE_ROW && rc != SQLITE_DONE)
-    errSql(rc, "executing prepared statement", sqlite3_sql(stmt));
-  LOG("execPreparedRowOrNot: sql=%s rowExists=%s", sqlite3_sql(stmt), rc == SQLITE_ROW ? "YES" : "NO")
-  return rc == SQLITE_ROW;
+FUNC_LOCAL void dbWriterSignal() {
+  pthread_mutex_lock(&writerLock);
+  writerPending = 1;
+  pthread_cond_signal(&writerCond);
+  pthread_mutex_unlock(&writerLock);
 }
 
-static int execPreparedInt64(sqlite3_stmt *stmt, int iCol, int64_t *value) {
-  int rc;
-  if ((rc = sqlite3_step(stmt)) != SQLITE_ROW && rc != SQLITE_DONE)
-    errSql(rc, "executing prepared statement", sqlite3_sql(stmt));
-  LOG("execPreparedInt64: sql=%s rowExists=%s ...", sqlite3_sql(stmt), rc == SQLITE_ROW ? "YES" : "NO")
-  if (rc == SQLITE_ROW) {
-    LOG("execPreparedInt64: ... rowExists=%s -> %lli", rc == SQLITE_ROW ? "YES" : "NO", sqlite3_column_int64(stmt, iCol))
-    *value = sqlite3_column_int64(stmt, iCol);
-    resetStmt(stmt);
-    return 1;
-  } else {
-    resetStmt(stmt);
+FUNC_LOCAL int dbFragmentValid(unsigned partNo, unsigned numParts, unsigned off, unsigned sz, size_t length) {
+  // the fragment fits into its message, and every part carries at least one byte; splitMessage gives all parts
+  // but the last one the same length, so each part implies numParts and its own offset
+  if (length == 0 || partNo < 1 || partNo > numParts || numParts > sz || (uint64_t)off + length > sz)
     return 0;
-  }
-}
-
-static int execPreparedText(sqlite3_stmt *stmt, int iCol, unsigned char *value) {
-  int rc;
-  if ((rc = sqlite3_step(stmt)) != SQLITE_ROW && rc != SQLITE_DONE)
-    errSql(rc, "executing prepared statement", sqlite3_sql(stmt));
-  LOG("execPreparedText: sql=%s rowExists=%s ...", sqlite3_sql(stmt), rc == SQLITE_ROW ? "YES" : "NO")
-  if (rc == SQLITE_ROW) {
-    LOG("execPreparedText: ... rowExists=%s -> %s", rc == SQLITE_ROW ? "YES" : "NO", (const char*)sqlite3_column_text(stmt, iCol))
-    strcpy((char*)value, (const char*)sqlite3_column_text(stmt, iCol));
-    resetStmt(stmt);
-    return 1;
-  } else {
-    resetStmt(stmt);
+  if (partNo < numParts)
+    return off == (uint64_t)(partNo-1)*length && numParts == (sz + (uint64_t)length - 1)/length;
+  if (off + length != sz)
+    return 0;
+  if (numParts == 1)
+    return off == 0;
+  unsigned step = off/(numParts-1); // length of the other parts
+  return off == step*(numParts-1) && length <= step;
+}
+
+FUNC_LOCAL int dbQuotaAdmit(uint32_t friend_number, unsigned size, unsigned numParts) {
+  // returns 1 and charges the new message when it fits into the limits, the bitmap of its parts counts too
+  quota_friend *q = quotaFriend(friend_number);
+  uint64_t bytes = size + DB_BITMAP_SIZE(numParts);
+  if ((dbSettings.inMaxBytesPerFriend && q->bytes + bytes > dbSettings.inMaxBytesPerFriend) ||
+      (dbSettings.inMaxMsgsPerFriend && q->msgs + 1 > dbSettings.inMaxMsgsPerFriend) ||
+      (dbSettings.inMaxBytes && quotaBytes + bytes > dbSettings.inMaxBytes) ||
+      (dbSettings.inMaxMsgs && quotaMsgs + 1 > dbSettings.inMaxMsgs)) {
+    WARNING("dropping the inbound message of size=%u from friend=%u: over the limits, friend has %u messages of %"PRIu64" bytes,"
+            " all friends have %u messages of %"PRIu64" bytes\n", size, friend_number, q->msgs, q->bytes, quotaMsgs, quotaBytes)
     return 0;
   }
+  dbQuotaCharge(friend_number, size, numParts);
+  return 1;
 }
 
-static void resetStmt(sqlite3_stmt *stmt) {
-  sqlite3_reset(stmt);
-}
-
-static void err(int rc, const char *op) {
-  fprintf(stderr, "Error while %s: error=%s (%d)\n", op, sqlite3_errstr(rc), rc);
-  abort();
-}
-
-static void errSql(int rc, const char *op, const char *sql) {
-  fprintf(stderr, "Error while %s: sql=%s error=%s (%d)\n", op, sql, sqlite3_errstr(rc), rc);
-  abort();
+FUNC_LOCAL void dbQuotaCharge(uint32_t friend_number, unsigned size, unsigned numParts) {
+  quota_friend *q = quotaFriend(friend_number);
+  uint64_t bytes = size + DB_BITMAP_SIZE(numParts);
+  q->bytes += bytes;
+  q->msgs++;
+  quotaBytes += bytes;
+  quotaMsgs++;
 }
 
-static sqlite3_blob* openBlob(const char *table, const char *field, uint64_t rowid) {
-  int rc;
-  sqlite3_blob *blob;
-  if (CK_ERROR(sqlite3_blob_open(db, dbName,
-                                 table,
-                                 field,
-                                 rowid,
-                                 1, /*flags: writable*/
-                                 &blob)))
-    err(rc, "opening blob");
-  return blob;
+FUNC_LOCAL void dbQuotaRelease(uint32_t friend_number, unsigned size, unsigned numParts) {
+  quota_friend *q = quotaFriend(friend_number);
+  uint64_t bytes = size + DB_BITMAP_SIZE(numParts);
+  q->bytes -= bytes;
+  q->msgs--;
+  quotaBytes -= bytes;
+  quotaMsgs--;
 }
 
-static void readBlob(sqlite3_blob *blob, uint8_t *data, unsigned length, unsigned off) {
-  int rc;
-  if (CK_ERROR(sqlite3_blob_read(blob, data, length, off)))
-    err(rc, "reading blob");
+FUNC_LOCAL void dbQuotaDuplicate(uint32_t friend_number) {
+  quotaFriend(friend_number)->duplicates++;
+  quotaDuplicates++;
 }
 
-static void writeBlob(sqlite3_blob *blob, const uint8_t *data, unsigned length, unsigned off) {
-  int rc;
-  if (CK_ERROR(sqlite3_blob_write(blob, data, length, off)))
-    err(rc, "writing blob");
+FUNC_LOCAL void dbQuotaReset() {
+  free(quotaFriends);
+  quotaFriends = NULL;
+  quotaFriendsAlloc = 0;
+  quotaBytes = 0;
+  quotaMsgs = 0;
+  quotaDuplicates = 0;
 }
 
-static void closeBlob(sqlite3_blob *blob) {
-  int rc;
-  if (CK_ERROR(sqlite3_blob_close(blob)))
-    err(rc, "closing blob");
-  LOG("closed blob")
-}
+// internal definitions
 
-#if defined(USE_BLOB_CACHE)
-static void blobCacheCloseBlob() {
-  closeBlob(blobCache);
-  blobCache = NULL;
-  blobCacheRowid = 0;
+static void writerStart() {
+  if (dbSettings.durability != DB_DURABILITY_ASYNC || !backend->commit)
+    return;
+  writerStopFlag = 0;
+  writerPending = 0;
+  int res;
+  if ((res = pthread_create(&writerThread, 0/*attr*/, &writerRoutine, 0/*arg*/)))
+    ERROR("Failed to start the writer thread, error=%d", res)
+  writerRunning = 1;
+}
+
+static void writerStop() {
+  // the backend commits the rest itself when it is uninitialized
+  if (!writerRunning)
+    return;
+  pthread_mutex_lock(&writerLock);
+  writerStopFlag = 1;
+  pthread_cond_signal(&writerCond);
+  pthread_mutex_unlock(&writerLock);
+  int res;
+  if ((res = pthread_join(writerThread, NULL)))
+    ERROR("Failed to stop the writer thread, error=%d", res)
+  writerRunning = 0;
+}
+
+static void* writerRoutine(void *arg) {
+  pthread_mutex_lock(&writerLock);
+  while (!writerStopFlag) {
+    if (!writerPending) {
+      pthread_cond_wait(&writerCond, &writerLock);
+      continue;
+    }
+    writerPending = 0;
+    pthread_mutex_unlock(&writerLock);
+    backend->commit();
+    pthread_mutex_lock(&writerLock);
+  }
+  pthread_mutex_unlock(&writerLock);
+  return NULL;
+}
+
+static quota_friend* quotaFriend(uint32_t friend_number) {
+  if (friend_number >= quotaFriendsAlloc) {
+    unsigned alloc = quotaFriendsAlloc ? quotaFriendsAlloc : 16;
+    while (alloc <= friend_number)
+      alloc *= 2;
+    quotaFriends = realloc(quotaFriends, alloc*sizeof(quota_friend));
+    memset(quotaFriends + quotaFriendsAlloc, 0, (alloc - quotaFriendsAlloc)*sizeof(quota_friend));
+    quotaFriendsAlloc = alloc;
+  }
+  return &quotaFriends[friend_number];
 }
-#endif
-
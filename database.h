@@ -5,6 +5,22 @@
 #include <stdint.h>
 #include <stddef.h>
 
+typedef struct sqlite3 sqlite3;
+
+// durability levels
+typedef enum DbDurability {
+  DB_DURABILITY_FULL,    // every operation is committed on its own
+  DB_DURABILITY_GROUPED, // operations are committed in groups, see dbSetDurability
+  DB_DURABILITY_ASYNC    // operations are committed by the writer thread, see database.c
+} DbDurability;
+
+// state of the inbound message
+typedef enum DbInboundState {
+  DB_INBOUND_UNKNOWN, // nothing is received, or the message was dropped over the limits
+  DB_INBOUND_PARTIAL, // some parts are received
+  DB_INBOUND_DONE     // message is delivered, or expired
+} DbInboundState;
+
 // callbacks
 typedef void* (*DbLockCb)(void *user_data);
 typedef void (*DbUnlockCb)(void*, void *user_data);
@@ -23,6 +39,11 @@ typedef void (*DbMsgPendingSentCb)(uint32_t friend_number, int type, uint64_t id
 // interface
 void dbInitialize(sqlite3 *new_db, DbLockCb lockCb, DbUnlockCb unlockCb, void *user_data);
 void dbInitializeInMemory();
+void dbInitializeJournal(const char *path);
+void dbSetDurability(DbDurability durability, unsigned groupCommitTimeMs, unsigned groupCommitOps);
+void dbSetGcParameters(unsigned historyTimeSec, unsigned filterCapacity);
+void dbSetInboundLimits(unsigned maxBytesPerFriend, unsigned maxMsgsPerFriend, uint64_t maxBytes, unsigned maxMsgs, unsigned idleTimeSec);
+int dbFragmentValid(unsigned partNo, unsigned numParts, unsigned off, unsigned sz, size_t length);
 void dbUninitialize();
 void dbInsertInboundFragment(void *tox_opaque,
                              uint32_t friend_number, int type, uint64_t id,
@@ -38,5 +59,8 @@ void dbInsertOutboundMessage(uint32_t friend_number, int type, uint64_t id,
                              uint32_t receipt);
 void dbOutboundPartConfirmed(uint32_t friend_number, uint64_t id, unsigned partNo, uint64_t tm);
 void dbLoadPendingSentMessages(DbMsgPendingSentCb msgPendingSentCb);
+void dbDeliverUndelivered(void *tox_opaque, DbMsgReadyCb msgReadyCb, void *user_data);
 void dbClearOutboundPending(uint32_t friend_number, uint64_t id);
+DbInboundState dbInboundReceived(uint32_t friend_number, uint64_t id, unsigned *numParts, uint8_t **received);
+void dbInboundStats(const uint32_t *friend_number, uint64_t *pendingBytes, uint64_t *duplicates);
 void dbPeriodic();
@@ -13,11 +13,13 @@
 
 static const uint8_t markerChar[3] = {0xe2, 0x80, 0x8b}; // ZERO WIDTH SPACE' (U+200B), 3 bytes in UTF8 representation
 // frag_id is always 13 digits long, milliseconds timestamp
+// batch marker: ZWSP 'B' batch_id|len1|len2|...|lenN ZWSP, followed by the messages, batch_id is like frag_id
 static const int szMarkerChar = sizeof(markerChar);
 #define szTm     13
 #define szIntMin 1
 #define szIntMax 10
 #define nInts    4
+#define chBatch  'B'
 
 typedef size_t U;
 
@@ -73,6 +75,75 @@ FUNC_LOCAL uint8_t markerParse(const uint8_t *message, size_t length,
   return fldOff[3] + fldSz[3] + szMarkerChar;
 }
 
+FUNC_LOCAL size_t markerBatchSizeBytes(const size_t *lengths, unsigned num) {
+  size_t sz = szMarkerChar+1+szTm+1+szMarkerChar + num-1;
+  for (unsigned i = 0; i < num; i++)
+    sz += numDigits(lengths[i]);
+  return sz;
+}
+
+FUNC_LOCAL size_t markerBatchPrint(uint64_t id, const size_t *lengths, unsigned num, uint8_t *marker) {
+  uint8_t *p = marker;
+  for (int i = 0; i < szMarkerChar; i++)
+    *p++ = markerChar[i];
+  *p++ = chBatch;
+  p += sprintf((char*)p, "%"PRIu64, id);
+  for (unsigned i = 0; i < num; i++)
+    p += sprintf((char*)p, "|%u", (unsigned)lengths[i]);
+  for (int i = 0; i < szMarkerChar; i++)
+    *p++ = markerChar[i];
+  return p - marker;
+}
+
+FUNC_LOCAL int markerBatchExists(const uint8_t *message, size_t length) {
+  size_t markerSize;
+  return markerBatchParse(message, length, NULL, NULL, &markerSize) != 0;
+}
+
+FUNC_LOCAL unsigned markerBatchParse(const uint8_t *message, size_t length, uint64_t *id, size_t *lengths,
+                                     size_t *markerSize) {
+  // returns the number of messages, 0 when it isn't a batch; 'id' and 'lengths' can be NULL,
+  // otherwise 'lengths' should have room for length/2 entries
+  if (length <= szMarkerChar+1+szTm+1+szIntMin+szMarkerChar || !isMarkerChar(message) || message[szMarkerChar] != chBatch)
+    return 0;
+  size_t p = szMarkerChar+1;
+  uint64_t bid = 0;
+  int nDigits = 0;
+  for (; p < length && isdigit(message[p]) && nDigits < 20; p++, nDigits++)
+    bid = bid*10 + (message[p] - '0');
+  if (!nDigits || p == length || message[p] != '|')
+    return 0;
+  p++;
+  if (id)
+    *id = bid;
+  size_t sum = 0;
+  unsigned num = 0;
+  while (1) {
+    size_t len = 0;
+    int nDigits = 0;
+    for (; p < length && isdigit(message[p]) && nDigits < szIntMax; p++, nDigits++)
+      len = len*10 + (message[p] - '0');
+    if (!nDigits || !len)
+      return 0;
+    if (lengths)
+      lengths[num] = len;
+    num++;
+    sum += len;
+    if (p < length && message[p] == '|') {
+      p++;
+    } else if (p+szMarkerChar <= length && isMarkerChar(message+p)) {
+      p += szMarkerChar;
+      break;
+    } else {
+      return 0;
+    }
+  }
+  if (sum != length - p)
+    return 0;
+  *markerSize = p;
+  return num;
+}
+
 // internal definitions
 
 static int numDigits(unsigned i) {
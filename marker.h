@@ -11,3 +11,7 @@ int markerExists(const uint8_t *message, size_t length);
 uint8_t markerParse(const uint8_t *message, size_t length,
                     uint64_t *id,
                     unsigned *partNo, unsigned *numParts, unsigned *off, unsigned *sz);
+size_t markerBatchSizeBytes(const size_t *lengths, unsigned num);
+size_t markerBatchPrint(uint64_t id, const size_t *lengths, unsigned num, uint8_t *marker);
+int markerBatchExists(const uint8_t *message, size_t length);
+unsigned markerBatchParse(const uint8_t *message, size_t length, uint64_t *id, size_t *lengths, size_t *markerSize);
@@ -37,6 +37,8 @@ const unsigned char *sqlite3_column_text(sqlite3_stmt*, int iCol);
 int sqlite3_step(sqlite3_stmt*);
 int sqlite3_reset(sqlite3_stmt *pStmt);
 int sqlite3_changes(sqlite3*);
+sqlite3_int64 sqlite3_last_insert_rowid(sqlite3*);
+int sqlite3_get_autocommit(sqlite3*);
 int sqlite3_finalize(sqlite3_stmt *pStmt);
 
 int sqlite3_exec(
@@ -10,6 +10,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <math.h>
+#include <sys/resource.h>
 #include <sqlite3.h>
 #include <tox/tox.h>
 #include "tox-defragmenter.h"
@@ -34,16 +42,38 @@ typedef struct Tox Tox;
 
 static unsigned myFriendId = 0;
 static unsigned hisFriendId = 0;
+static bool hub = false; // simulates hubFriends friends, the other peer has the same number of them
+static unsigned hubFriends = 0;
+static bool crash = false;    // the client keeps its state in the journal, the connecting peer can be killed and restarted
+static bool restarted = false; // the journal was there
+static unsigned crashDelivered = 0; // crash=N: the peer kills itself in the callback of the N-th message it gets
 static sqlite3 *sqlite = NULL;
 static bool sawIfaceEOF = false;
 static bool sawNetEOF = false;
 static bool sawNetEndSignal = false;
+static bool sentDone = false;
+static bool sawNetDone = false;
 static unsigned netExpectMessages = 0;
 static unsigned netReceivedMessages = 0;
-static uint8_t netReceivedReceiptsShort[1024*1024] = {0}; // XXX limit
-static uint8_t netReceivedReceiptsLong[1024*1024] = {0}; // XXX limit
+static uint8_t netReceivedReceiptsShort[1024*1024] = {0}; // 1: the client waits for it, 2: received
+static uint8_t netReceivedReceiptsLong[1024*1024] = {0};
+static unsigned netReceivedReceiptsNum = 0;
 static unsigned msgIdIface = 0;
 static unsigned msgIdNet = 0;
+static const char *msgIface = NULL; // message that the client is sending, it goes through as is when it's short
+static uint64_t startUs = 0;
+static uint64_t lastDeliveredUs = 0;
+static uint64_t lastReceiptUs = 0;
+static uint64_t netDeliveredBytes = 0;
+static bool netConnected = true;
+static bool netMidLine = false;     // EOF in the middle of the line is the other peer killed, not the protocol error
+static jmp_buf netEofJmp;
+static int netListenFd = -1;        // kept by the listening peer so that the killed peer connects again
+static unsigned netDisconnects = 0;
+static uint64_t netDuplicatesBefore = 0; // duplicates dropped before the first restart of the other peer
+static unsigned journalSkip = 0;    // messages of the input that were handed off before the restart
+static bool journalDone = false;    // both peers were done before the restart
+static uint64_t resumedUs = 0;      // first message or receipt after the restart
 
 //
 // files
@@ -61,10 +91,186 @@ static stream streamIn, streamOut, streamNet;
 static void usage() {
   fprintf(stderr, "Usage: ./test-peer myFriendId hisFriendId\n");
   fprintf(stderr, "                   dbFname netSocketFname connectOrListen={C,L}\n");
+  fprintf(stderr, "                   (dbFname ending with .journal selects the journal backend, the empty one the in-memory backend)\n");
   fprintf(stderr, "                   paramMaxMessageLength paramFragmentsAtATime paramReceiptExpirationTimeMs\n");
+  fprintf(stderr, "                   paramBatchDelayMs (0 disables batching)\n");
+  fprintf(stderr, "                   [impairment: loss=%%,dup=%%,reorder=N,delay=ms,jitter=ms,rate=bytes/s,down=ms/periodMs,seed=N,clock=ms]\n");
+  fprintf(stderr, "                   (clock=ms runs the library on the virtual clock that starts at ms)\n");
+  fprintf(stderr, "       ./test-peer hub numFriends load myFriendId\n");
+  fprintf(stderr, "                   dbFname ... (like above)\n");
+  fprintf(stderr, "                   (the hub sends the load to all friends and checks what they send, both peers need the same load)\n");
+  fprintf(stderr, "       ./test-peer crash myFriendId hisFriendId ... (like above)\n");
+  fprintf(stderr, "                   (the client's state is journaled in test-client{myFriendId}.txt instead of stdout,\n");
+  fprintf(stderr, "                    so the connecting peer can be killed and restarted with the same input and database)\n");
+  fprintf(stderr, "       ./test-peer crash=N myFriendId hisFriendId ... (like above)\n");
+  fprintf(stderr, "                   (also kills itself in the callback of the N-th message, after the client journaled it)\n");
+  fprintf(stderr, "       ./test-peer gen load\n");
+  fprintf(stderr, "                   (writes the load as the input of the peer)\n");
+  fprintf(stderr, "                   load: num=N,size=min-max,dist={uniform,log},binary=%%,concurrency=N,seed=N\n");
   exit(1);
 }
 
+//
+// impairment of the link to the other peer: what the defragmenter recovers from is lost, duplicated, reordered,
+// and everything is delayed and throttled. Short messages that the client sends, their receipts and the end signal
+// are never lost, like in toxcore, where the client deals with them.
+//
+static struct impairment {
+  unsigned lossPct;
+  unsigned dupPct;
+  unsigned reorder;  // packet overtakes up to this many packets queued before it
+  unsigned delayMs;
+  unsigned jitterMs; // added to the delay, up to this much
+  unsigned rate;     // bytes per second, 0 is unlimited
+  unsigned downMs;   // link is down for downMs in the end of every periodMs, the friend is offline then
+  unsigned periodMs;
+  unsigned seed;
+} impair = {0};
+static unsigned impairLost = 0;
+static unsigned impairLostDown = 0;
+static unsigned impairDuplicated = 0;
+static unsigned impairReordered = 0;
+static uint64_t linkFreeUs = 0; // when the throttled link can take the next packet
+static bool virtualClock = false;   // the library's clock is set by the simulation
+static unsigned virtualClockStartMs = 0;
+static bool linkWasUp = true;
+
+static void parseImpairment(const char *spec) {
+  char *str = strdup(spec), *save = NULL;
+  for (char *kv = strtok_r(str, ",", &save); kv; kv = strtok_r(NULL, ",", &save)) {
+    unsigned v1 = 0, v2 = 0;
+    char key[16];
+    int n = sscanf(kv, "%15[a-z]=%u/%u", key, &v1, &v2);
+    if (n == 3 && !strcmp(key, "down")) {
+      impair.downMs = v1;
+      impair.periodMs = v2;
+    } else if (n == 2 && !strcmp(key, "loss")) {
+      impair.lossPct = v1;
+    } else if (n == 2 && !strcmp(key, "dup")) {
+      impair.dupPct = v1;
+    } else if (n == 2 && !strcmp(key, "reorder")) {
+      impair.reorder = v1;
+    } else if (n == 2 && !strcmp(key, "delay")) {
+      impair.delayMs = v1;
+    } else if (n == 2 && !strcmp(key, "jitter")) {
+      impair.jitterMs = v1;
+    } else if (n == 2 && !strcmp(key, "rate")) {
+      impair.rate = v1;
+    } else if (n == 2 && !strcmp(key, "seed")) {
+      impair.seed = v1;
+    } else if (n == 2 && !strcmp(key, "clock")) {
+      virtualClock = true;
+      virtualClockStartMs = v1;
+    } else {
+      ERROR("bad impairment '%s'", kv)
+    }
+  }
+  if (impair.downMs >= impair.periodMs && impair.periodMs)
+    ERROR("the link can't be down for the whole period")
+  free(str);
+}
+
+//
+// load of the hub and of the gen command: every message is made from the seed, the friend and its number, which
+// the message starts with, so the receiving hub makes it again to check it
+//
+static struct load {
+  unsigned num;         // messages to every friend
+  unsigned sizeMin;
+  unsigned sizeMax;
+  bool     logSizes;    // sizes are log-uniform, many short messages and few long ones, otherwise they're uniform
+  unsigned binaryPct;   // binary payloads among the messages
+  unsigned concurrency; // messages to every friend that wait for their receipts
+  unsigned seed;
+} load = {.num = 10, .sizeMin = 10, .sizeMax = 1000, .concurrency = 1};
+
+static void parseLoad(const char *spec) {
+  char *str = strdup(spec), *save = NULL;
+  for (char *kv = strtok_r(str, ",", &save); kv; kv = strtok_r(NULL, ",", &save)) {
+    unsigned v1 = 0, v2 = 0;
+    char key[16], val[16];
+    int n = sscanf(kv, "%15[a-z]=%u-%u", key, &v1, &v2);
+    if (n == 3 && !strcmp(key, "size")) {
+      load.sizeMin = v1;
+      load.sizeMax = v2;
+    } else if (n == 2 && !strcmp(key, "num")) {
+      load.num = v1;
+    } else if (n == 2 && !strcmp(key, "binary")) {
+      load.binaryPct = v1;
+    } else if (n == 2 && !strcmp(key, "concurrency")) {
+      load.concurrency = v1;
+    } else if (n == 2 && !strcmp(key, "seed")) {
+      load.seed = v1;
+    } else if (sscanf(kv, "%15[a-z]=%15s", key, val) == 2 && !strcmp(key, "dist") &&
+               (!strcmp(val, "uniform") || !strcmp(val, "log"))) {
+      load.logSizes = !strcmp(val, "log");
+    } else {
+      ERROR("bad load '%s'", kv)
+    }
+  }
+  if (!load.sizeMin || load.sizeMin > load.sizeMax || !load.concurrency)
+    ERROR("bad load '%s'", spec)
+  free(str);
+}
+
+static uint64_t loadRandom(uint64_t *state) {
+  // splitmix64
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27))*0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static uint8_t* loadMessage(unsigned friend, unsigned seq, size_t *length, bool *binary) {
+  // text is "seq " and alphanumerics, binary is seq in 4 bytes and any bytes
+  static const char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  uint64_t state = load.seed;
+  state = loadRandom(&state) ^ friend;
+  state = loadRandom(&state) ^ seq;
+  double u = (loadRandom(&state) >> 11)*0x1.0p-53;
+  size_t sz = load.logSizes ? (size_t)(load.sizeMin*pow((double)load.sizeMax/load.sizeMin, u) + 0.5)
+                            : load.sizeMin + (size_t)(u*(load.sizeMax - load.sizeMin + 1));
+  if (sz > load.sizeMax)
+    sz = load.sizeMax;
+  *binary = loadRandom(&state)%100 < load.binaryPct;
+  char hdr[16];
+  size_t hdrSz = *binary ? 4 : sprintf(hdr, "%u ", seq);
+  if (sz < hdrSz)
+    sz = hdrSz;
+  uint8_t *msg = malloc(sz+1);
+  if (*binary) {
+    for (unsigned i = 0; i < 4; i++)
+      msg[i] = seq >> 8*i;
+    for (size_t i = hdrSz; i < sz; i++)
+      msg[i] = loadRandom(&state);
+  } else {
+    memcpy(msg, hdr, hdrSz);
+    for (size_t i = hdrSz; i < sz; i++)
+      msg[i] = alnum[loadRandom(&state)%(sizeof(alnum)-1)];
+  }
+  msg[sz] = 0;
+  *length = sz;
+  return msg;
+}
+
+static void loadGenerate() {
+  // in the format of the peer's input, the end signal isn't written so that the loads can be concatenated
+  for (unsigned seq = 0; seq < load.num; seq++) {
+    size_t length;
+    bool binary;
+    uint8_t *msg = loadMessage(0/*friend*/, seq, &length, &binary);
+    if (binary) {
+      printf("B %lu ", 2*length);
+      for (size_t i = 0; i < length; i++)
+        printf("%02x", msg[i]);
+      printf("\n");
+    } else {
+      printf("M %lu %s\n", length, msg);
+    }
+    free(msg);
+  }
+}
+
 //
 // packet queues
 //
@@ -74,8 +280,15 @@ typedef struct packet { // dual-purpose: represents message or receipt
   uint8_t       *msg;             // msg: data
   size_t         msgLength;       // msg: length
   unsigned       msgId;           // msg: id
+  bool           lossless;        // msg: lossless packet, doesn't get receipts
+  bool           binary;          // msg: binary payload, written in hex
+  bool           plain;           // msg: client's message passed through, never lost
+  unsigned       friendId;        // msg, rcpt: the sender as the other peer knows it
   unsigned       receipt;         // rcpt: number=msgId
   unsigned       cntMsgEndSignal; // end: message count to expect
+  bool           done;            // done: everything was received, only acks and receipts can be still needed
+  bool           reliable;        // net: never lost
+  uint64_t       dueUs;           // net: when it can go
 } packet;
 static packet *ifaceOutBegin = NULL;
 static packet *ifaceOutEnd = NULL;
@@ -109,6 +322,12 @@ static packet* packetCreateMessage(const uint8_t *msg, size_t length, unsigned m
   return p;
 }
 
+static packet* packetCreateLossless(const uint8_t *data, size_t length) {
+  packet *p = packetCreateMessage(data, length, 0/*msgId*/);
+  p->lossless = true;
+  return p;
+}
+
 static packet* packetCreateReceipt(unsigned receipt) {
   packet *p = malloc(sizeof(packet));
   *p = (packet){.next = NULL, .msg = NULL, .receipt = receipt};
@@ -133,10 +352,122 @@ static void packetDelete(packet *p) {
 static unsigned max2(unsigned i1, unsigned i2) {return i1 > i2 ? i1 : i2;}
 static unsigned max3(unsigned i1, unsigned i2, unsigned i3) {return max2(max2(i1, i2), i3);}
 
+static uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static uint64_t virtualClockNow(void *user_data) {
+  // starts near 0 unlike the wall clock
+  return virtualClockStartMs + (nowUs() - startUs)/1000;
+}
+
+static unsigned wireFriendId(unsigned friend_number) {
+  // this peer as the other one knows it: the hub's friends are numbered the same on both ends
+  return hub ? friend_number : myFriendId;
+}
+
+static unsigned randomPct() {
+  return rand_r(&impair.seed)%100;
+}
+
+//
+// net queue, impaired
+//
+
+static bool linkUp() {
+  if (!netConnected)
+    return false;
+  // the peers start together, so they see the same periods
+  if (!impair.periodMs)
+    return true;
+  return (nowUs() - startUs)/1000 % impair.periodMs < impair.periodMs - impair.downMs;
+}
+
+static void linkCheck() {
+  // packets that didn't go yet are lost when the link goes down
+  bool up = linkUp();
+  if (linkWasUp && !up) {
+    packet **pp = &netOutBegin;
+    netOutEnd = NULL;
+    while (*pp)
+      if (!(*pp)->reliable) {
+        packet *p = *pp;
+        *pp = p->next;
+        packetDelete(p);
+        impairLostDown++;
+      } else {
+        netOutEnd = *pp;
+        pp = &(*pp)->next;
+      }
+  }
+  linkWasUp = up;
+}
+
+static void netInsert(packet *p) {
+  // in the order of the due time, unless it overtakes some packets before it
+  p->dueUs = nowUs() + impair.delayMs*1000 + (impair.jitterMs ? rand_r(&impair.seed)%(impair.jitterMs*1000) : 0);
+  unsigned pos = 0;
+  for (packet *q = netOutBegin; q && q->dueUs <= p->dueUs; q = q->next)
+    pos++;
+  unsigned overtake = impair.reorder ? rand_r(&impair.seed)%(impair.reorder+1) : 0;
+  if (overtake && pos) {
+    pos = pos > overtake ? pos - overtake : 0;
+    impairReordered++;
+  }
+  packet **pp = &netOutBegin;
+  for (unsigned i = 0; i < pos; i++)
+    pp = &(*pp)->next;
+  p->next = *pp;
+  *pp = p;
+  if (!p->next)
+    netOutEnd = p;
+}
+
+static void netSend(packet *p) {
+  if (!p->reliable) {
+    if (!linkUp()) {
+      impairLostDown++;
+      packetDelete(p);
+      return;
+    }
+    if (impair.lossPct && randomPct() < impair.lossPct) {
+      impairLost++;
+      packetDelete(p);
+      return;
+    }
+    if (p->msg && impair.dupPct && randomPct() < impair.dupPct) {
+      // the copy doesn't get the receipt, toxcore never repeats them
+      packet *d = packetCreateMessage(p->msg, p->msgLength, 0/*msgId*/);
+      d->lossless = p->lossless;
+      d->friendId = p->friendId;
+      netInsert(d);
+      impairDuplicated++;
+    }
+  }
+  netInsert(p);
+}
+
+static unsigned netWaitMs() {
+  // until the first packet can go
+  if (!netOutBegin)
+    return UINT_MAX;
+  uint64_t now = nowUs();
+  uint64_t at = netOutBegin->dueUs > linkFreeUs ? netOutBegin->dueUs : linkFreeUs;
+  return at <= now ? 0 : (at - now + 999)/1000;
+}
+
 static char readChar(stream *s) {
   char ch;
   int n;
-  switch ((n=read(s->fd, &ch, 1))) {
+  n = read(s->fd, &ch, 1);
+  // the other peer that was done closes with the packets still coming to it unread, this resets the connection
+  if (n == -1 && (crash || sawNetDone) && s == &streamNet && errno == ECONNRESET)
+    n = 0;
+  if (n == 0 && crash && s == &streamNet && netMidLine)
+    longjmp(netEofJmp, 1);
+  switch (n) {
   case 1:
     LOG("readChar->%c (stream=%p)", ch, s)
     return ch;
@@ -170,16 +501,38 @@ static unsigned readUInt(stream *s, char skip) {
   return u;
 }
 
+static bool readBytes(stream *s, void *buf, size_t sz) {
+  // the stream socket can return less than it has
+  for (size_t done = 0; done < sz;) {
+    ssize_t n = read(s->fd, (uint8_t*)buf + done, sz - done);
+    if (n <= 0) {
+      if (crash && s == &streamNet && netMidLine)
+        longjmp(netEofJmp, 1);
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
 static char* readString(stream *s, char skip) {
   unsigned sz = readUInt(s, ' ');
   char *buf = malloc(sz+1);
-  if (read(s->fd, buf, sz) != sz)
+  if (!readBytes(s, buf, sz))
     ERROR("can't read a string of length %u", sz)
   buf[sz] = 0;
   skipChar(s, skip);
   return buf;
 }
 
+static uint8_t* hexDecode(const char *hex, size_t *length) {
+  *length = strlen(hex)/2;
+  uint8_t *data = malloc(*length ? *length : 1);
+  for (size_t i = 0; i < *length; i++)
+    sscanf(hex + 2*i, "%2hhx", &data[i]);
+  return data;
+}
+
 static int openSocket(const char *sockName, char connectOrListen) {
   struct sockaddr_un address;
   int fd, fd1;
@@ -193,7 +546,7 @@ static int openSocket(const char *sockName, char connectOrListen) {
   case 'C': {
     while (true) {
       res = connect(fd, (struct sockaddr*)&address, sizeof(address));
-      if (res && errno == ENOENT) {
+      if (res && (errno == ENOENT || errno == ECONNREFUSED)) { // the listener can still be between bind and listen
         SLEEP_MS(50) // 50 ms
         continue;
       }
@@ -209,22 +562,27 @@ static int openSocket(const char *sockName, char connectOrListen) {
     fd1 = accept(fd, &sa, &len);
     if (fd1 < 0)
       ERROR("accept error")
-    close(fd);
+    if (crash)
+      netListenFd = fd;
+    else
+      close(fd);
     return fd1;
   } default:
     ERROR("argument error, expected C or L, got %c", connectOrListen)
   }
 }
 
+static uint8_t* receiptState(uint32_t message_id) {
+  // short messages get the receipts from the net side, their numbers grow faster than the message count
+  bool isShort = message_id < DEFRAG_RECEIPTS_LO;
+  uint32_t idx = isShort ? message_id : message_id - DEFRAG_RECEIPTS_LO;
+  if (idx >= (isShort ? sizeof(netReceivedReceiptsShort) : sizeof(netReceivedReceiptsLong)))
+    ERROR("receipt %u is beyond the receipts that are kept", message_id)
+  return isShort ? &netReceivedReceiptsShort[idx] : &netReceivedReceiptsLong[idx];
+}
+
 static bool receivedAllReceipts() {
-  unsigned cnt = 0;
-  for (int i = 0; i <= msgIdIface && cnt < msgIdIface; i++) {
-    if (netReceivedReceiptsShort[i])
-      cnt++;
-    if (netReceivedReceiptsLong[i])
-      cnt++;
-  }
-  return cnt == msgIdIface;
+  return netReceivedReceiptsNum == msgIdIface;
 }
 
 //
@@ -232,6 +590,7 @@ static bool receivedAllReceipts() {
 //
 static tox_friend_read_receipt_cb *cb_friend_read_receipt = NULL;
 static tox_friend_message_cb *cb_friend_message_cb = NULL;
+static tox_friend_lossless_packet_cb *cb_friend_lossless_packet = NULL;
 
 //
 // base Tox iface (net side)
@@ -243,38 +602,343 @@ static void base_callback_friend_message(Tox *tox, tox_friend_message_cb *callba
   cb_friend_message_cb = callback;
 }
 static TOX_CONNECTION base_friend_get_connection_status(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error) {
-  return TOX_CONNECTION_UDP;
+  return linkUp() ? TOX_CONNECTION_UDP : TOX_CONNECTION_NONE;
 }
 static uint32_t base_friend_send_message(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                         size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error) {
+  if (!linkUp())
+    return 0; // friend is offline
   msgIdNet++;
-  packetAppend(packetCreateMessage(message, length, msgIdNet), &netOutBegin, &netOutEnd);
+  packet *p = packetCreateMessage(message, length, msgIdNet);
+  p->plain = p->reliable = message == (const uint8_t*)msgIface;
+  p->friendId = wireFriendId(friend_number);
+  netSend(p);
   LOG("base_friend_send_message: length=%lu msgIdNet=%u appended to the outbound Net queue\n", length, msgIdNet)
   return msgIdNet;
 }
-static ToxcoreApi apiBase = {.tox_callback_friend_read_receipt = base_callback_friend_read_receipt,
+static void base_callback_friend_lossless_packet(Tox *tox, tox_friend_lossless_packet_cb *callback) {
+  cb_friend_lossless_packet = callback;
+}
+static bool base_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                             TOX_ERR_FRIEND_CUSTOM_PACKET *error) {
+  if (!linkUp())
+    return false;
+  packet *p = packetCreateLossless(data, length);
+  p->friendId = wireFriendId(friend_number);
+  netSend(p);
+  return true;
+}
+static void base_iterate(Tox *tox, void *user_data) {
+}
+static uint32_t base_iteration_interval(const Tox *tox) {
+  return 50; // ms
+}
+static ToxcoreApi apiBase = {.tox_iterate = base_iterate,
+                             .tox_iteration_interval = base_iteration_interval,
+                             .tox_callback_friend_read_receipt = base_callback_friend_read_receipt,
                              .tox_callback_friend_message = base_callback_friend_message,
                              .tox_friend_get_connection_status = base_friend_get_connection_status,
-                             .tox_friend_send_message = base_friend_send_message
+                             .tox_friend_send_message = base_friend_send_message,
+                             .tox_callback_friend_lossless_packet = base_callback_friend_lossless_packet,
+                             .tox_friend_send_lossless_packet = base_friend_send_lossless_packet
                             };
 // front Tox iface
 static ToxcoreApi apiFront;
 
+//
+// hub: it sends to every friend in turn, a few messages at a time, and checks what every friend sends
+//
+typedef struct hub_slot { // message that waits for its receipt
+  unsigned receipt;       // 0 when the slot is free
+  unsigned seq;
+  uint64_t sentUs;
+} hub_slot;
+typedef struct hub_friend {
+  unsigned  numSent;
+  unsigned  numInFlight;
+  hub_slot *slots;        // load.concurrency of them
+  uint8_t  *received;     // by seq
+} hub_friend;
+static hub_friend *hubFriendsState = NULL;
+static uint32_t *hubLatencyUs = NULL; // from the send call to the receipt, of every message
+static unsigned hubLatencyNum = 0;
+static uint64_t hubSentBytes = 0;
+
+static void hubInitialize() {
+  hubFriendsState = calloc(hubFriends, sizeof(hub_friend));
+  for (unsigned f = 0; f < hubFriends; f++) {
+    hubFriendsState[f].slots = calloc(load.concurrency, sizeof(hub_slot));
+    hubFriendsState[f].received = calloc(load.num ? load.num : 1, 1);
+  }
+  hubLatencyUs = malloc((hubFriends*load.num + 1)*sizeof(uint32_t));
+}
+
+static void hubUninitialize() {
+  for (unsigned f = 0; f < hubFriends; f++) {
+    free(hubFriendsState[f].slots);
+    free(hubFriendsState[f].received);
+  }
+  free(hubFriendsState);
+  free(hubLatencyUs);
+}
+
+static void hubSend() {
+  // the client waits while the friends are offline
+  if (sawIfaceEOF || !linkUp())
+    return;
+  for (unsigned f = 0; f < hubFriends; f++) {
+    hub_friend *hf = &hubFriendsState[f];
+    while (hf->numSent < load.num && hf->numInFlight < load.concurrency) {
+      size_t length;
+      bool binary;
+      uint8_t *msg = loadMessage(f, hf->numSent, &length, &binary);
+      uint32_t receipt;
+      if (binary) {
+        receipt = tox_defragmenter_friend_send_binary(NULL, f, msg, length, NULL);
+      } else {
+        msgIface = (const char*)msg;
+        receipt = apiFront.tox_friend_send_message(NULL, f, TOX_MESSAGE_TYPE_NORMAL, msg, length, NULL);
+        msgIface = NULL;
+      }
+      free(msg);
+      if (receipt == 0)
+        ERROR("Failed to send the message #%u of length=%lu to friend=%u", hf->numSent, length, f)
+      hub_slot *slot = hf->slots;
+      while (slot->receipt)
+        slot++;
+      *slot = (hub_slot){.receipt = receipt, .seq = hf->numSent, .sentUs = nowUs()};
+      hf->numSent++;
+      hf->numInFlight++;
+      hubSentBytes += length;
+      ++msgIdIface;
+    }
+  }
+  if (msgIdIface == hubFriends*load.num) {
+    sawIfaceEOF = true;
+    packet *p = packetCreateEndSignal(msgIdIface);
+    p->reliable = true;
+    netSend(p);
+  }
+}
+
+static void hubReceipt(uint32_t friend_number, uint32_t message_id) {
+  // receipts that aren't waited for are the repeated ones
+  if (friend_number >= hubFriends)
+    ERROR("receipt from the unknown friend=%u", friend_number)
+  hub_friend *hf = &hubFriendsState[friend_number];
+  for (hub_slot *slot = hf->slots; slot < hf->slots + load.concurrency; slot++)
+    if (slot->receipt == message_id) {
+      uint64_t now = nowUs();
+      hubLatencyUs[hubLatencyNum++] = now - slot->sentUs;
+      slot->receipt = 0;
+      hf->numInFlight--;
+      netReceivedReceiptsNum++;
+      lastReceiptUs = now;
+      return;
+    }
+}
+
+static void hubReceived(uint32_t friend_number, const uint8_t *msg, size_t length, bool binary) {
+  // every message is the one that the friend had to send, and it comes once
+  if (friend_number >= hubFriends)
+    ERROR("message from the unknown friend=%u", friend_number)
+  unsigned seq = 0;
+  if (binary && length >= 4)
+    seq = msg[0] | msg[1] << 8 | msg[2] << 16 | (unsigned)msg[3] << 24;
+  else if (!binary)
+    for (size_t i = 0; i < length && isdigit(msg[i]); i++)
+      seq = seq*10 + msg[i] - '0';
+  if (seq >= load.num || hubFriendsState[friend_number].received[seq])
+    ERROR("unexpected or repeated message #%u of length=%lu from friend=%u", seq, length, friend_number)
+  size_t expLength;
+  bool expBinary;
+  uint8_t *exp = loadMessage(friend_number, seq, &expLength, &expBinary);
+  if (length != expLength || binary != expBinary || memcmp(msg, exp, length))
+    ERROR("message #%u of length=%lu from friend=%u isn't the one sent", seq, length, friend_number)
+  free(exp);
+  hubFriendsState[friend_number].received[seq] = 1;
+}
+
+static int cmpLatency(const void *l1, const void *l2) {
+  uint32_t u1 = *(const uint32_t*)l1, u2 = *(const uint32_t*)l2;
+  return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+}
+
+static void hubReport(uint64_t endUs) {
+  // throughput both ways, the latency of the messages completed by their receipts, and what it all cost
+  qsort(hubLatencyUs, hubLatencyNum, sizeof(uint32_t), cmpLatency);
+  #define PCT_MS(pct) (hubLatencyNum ? hubLatencyUs[(hubLatencyNum-1)*pct/100]/1e3 : 0.)
+  double sendSec = (lastReceiptUs > startUs ? lastReceiptUs - startUs : 1)/1e6;
+  double recvSec = (lastDeliveredUs > startUs ? lastDeliveredUs - startUs : 1)/1e6;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stderr, "hub %u: %u friends; sent %u messages at %.1f msg/s, %.3f MB/s; received %u messages at %.1f msg/s, %.3f MB/s\n",
+    myFriendId, hubFriends, hubLatencyNum, hubLatencyNum/sendSec, hubSentBytes/sendSec/(1<<20),
+    netReceivedMessages, netReceivedMessages/recvSec, netDeliveredBytes/recvSec/(1<<20));
+  fprintf(stderr, "hub %u: completion latency p50 %.1f ms, p99 %.1f ms, max %.1f ms; cpu %.2f s user, %.2f s system;"
+                  " peak RSS %ld KB\n",
+    myFriendId, PCT_MS(50), PCT_MS(99), PCT_MS(100),
+    ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6, ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6, ru.ru_maxrss);
+  #undef PCT_MS
+}
+
+//
+// crash: the client journals what it handed off to the library and what it got from it, and the restarted peer
+// goes on from there, like the client with its own database would. The listening peer waits for the killed one
+// to connect again, the friend is offline meanwhile.
+//
+static void journalPrintf(const char *fmt, ...) {
+  if (!crash)
+    return;
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(streamOut.file, fmt, ap);
+  va_end(ap);
+  fflush(streamOut.file);
+}
+
+static void journalRestore(const char *fname) {
+  FILE *file = fopen(fname, "r");
+  if (!file)
+    return;
+  restarted = true;
+  char *line = NULL;
+  size_t alloc = 0;
+  unsigned u;
+  while (getline(&line, &alloc, file) > 0)
+    switch (line[0]) {
+    case 'S': // handed off with its receipt
+      sscanf(line, "S %u", &u);
+      *receiptState(u) = 1;
+      msgIdIface++;
+      journalSkip++;
+      break;
+    case 'R': // receipt
+      sscanf(line, "R %u", &u);
+      if (*receiptState(u) == 1) {
+        *receiptState(u) = 2;
+        netReceivedReceiptsNum++;
+      }
+      break;
+    case 'M': // message received
+    case 'B':
+      netReceivedMessages++;
+      break;
+    case 'E': // the input was all handed off
+      sawIfaceEOF = true;
+      break;
+    case 'X': // the other peer's end signal
+      sscanf(line, "X %u", &netExpectMessages);
+      sawNetEndSignal = true;
+      break;
+    case 'D': // both were done
+      journalDone = true;
+      break;
+    }
+  free(line);
+  fclose(file);
+}
+
+static void netSendEndSignal() {
+  packet *p = packetCreateEndSignal(msgIdIface);
+  p->reliable = true;
+  netSend(p);
+}
+
+static void netDisconnected() {
+  // the other peer was killed, what was on the way to it is lost
+  if (netListenFd == -1)
+    ERROR("the listening peer can't be restarted")
+  if (!netDisconnects++) {
+    ToxDefragmenterStats stats;
+    tox_defragmenter_get_stats(&stats);
+    netDuplicatesBefore = stats.duplicatesDropped;
+  }
+  fclose(streamNet.file);
+  streamNet.fd = netListenFd;
+  netConnected = false;
+  sawNetDone = false;
+  sentDone = false;
+}
+
+static void netAccept() {
+  int fd = accept(netListenFd, NULL, NULL);
+  if (fd < 0)
+    ERROR("accept error")
+  streamNet = (stream){.fd = fd, .file = fdopen(fd, "w")};
+  netConnected = true;
+  if (sawIfaceEOF)
+    netSendEndSignal(); // the restarted peer doesn't know it
+}
+
 //
 // front callback handlers
 //
+static void onAnyWR(bool sendMsgId, packet *p, stream *s);
+
+static void ifaceOut(packet *p) {
+  // the journal is written right away, the client can be killed any moment
+  if (crash)
+    onAnyWR(false/*sendMsgId*/, p, &streamOut);
+  else
+    packetAppend(p, &ifaceOutBegin, &ifaceOutEnd);
+}
+
+static void crashPoint() {
+  // the message is the client's now, the library didn't yet get control back
+  if (crashDelivered && netReceivedMessages == crashDelivered)
+    kill(getpid(), SIGKILL);
+}
+
 static void front_friend_message(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                  size_t length, void *user_data) {
-  packetAppend(packetCreateMessage(message, length, 0/*msgId*/), &ifaceOutBegin, &ifaceOutEnd);
+  if (hub)
+    hubReceived(friend_number, message, length, false/*binary*/);
+  else
+    ifaceOut(packetCreateMessage(message, length, 0/*msgId*/));
   netReceivedMessages++;
+  netDeliveredBytes += length;
+  lastDeliveredUs = nowUs();
+  if (!resumedUs)
+    resumedUs = lastDeliveredUs;
+  crashPoint();
+}
+
+static void front_friend_binary(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data) {
+  if (hub) {
+    hubReceived(friend_number, data, length, true/*binary*/);
+  } else {
+    packet *p = packetCreateMessage(data, length, 0/*msgId*/);
+    p->binary = true;
+    ifaceOut(p);
+  }
+  netReceivedMessages++;
+  netDeliveredBytes += length;
+  lastDeliveredUs = nowUs();
+  if (!resumedUs)
+    resumedUs = lastDeliveredUs;
+  crashPoint();
+}
+
+static void front_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data) {
+  ERROR("unexpected lossless packet of length=%lu from friend=%u", length, friend_number) // the defragmenter's own packets don't reach here
 }
 
 static void front_read_receipt(Tox *tox, uint32_t friend_number, uint32_t message_id, void *user_data) {
-  if (message_id < DEFRAG_RECEIPTS_LO)
-    netReceivedReceiptsShort[message_id] = 1;
-  else
-    netReceivedReceiptsLong[message_id - DEFRAG_RECEIPTS_LO] = 1;
-  packetAppend(packetCreateReceipt(message_id), &ifaceOutBegin, &ifaceOutEnd);
+  if (hub) {
+    hubReceipt(friend_number, message_id);
+    return;
+  }
+  // the late receipt of the batch that was sent again isn't of any message, the client ignores it
+  uint8_t *st = receiptState(message_id);
+  if (*st == 1) {
+    *st = 2;
+    netReceivedReceiptsNum++;
+    lastReceiptUs = nowUs();
+    if (!resumedUs)
+      resumedUs = lastReceiptUs;
+  }
+  ifaceOut(packetCreateReceipt(message_id));
 }
 
 //
@@ -282,13 +946,27 @@ static void front_read_receipt(Tox *tox, uint32_t friend_number, uint32_t messag
 //
 static void onAnyWR(bool sendMsgId, packet *p, stream *s) {
   LOG("sending pkt=%p into the stream %p", p, s)
-  if (p->msg)
+  if (p->lossless) {
+    fprintf(s->file, "L %u %lu ", p->friendId, p->msgLength); // to Net, binary
+    fwrite(p->msg, 1, p->msgLength, s->file);
+    fprintf(s->file, "\n");
+  } else if (p->binary) {
+    fprintf(s->file, "B %lu ", 2*p->msgLength); // to Iface, hex
+    for (size_t i = 0; i < p->msgLength; i++)
+      fprintf(s->file, "%02x", p->msg[i]);
+    fprintf(s->file, "\n");
+  } else if (p->msg)
     if (sendMsgId)
-      fprintf(s->file, "M %u %u %lu %.*s\n", p->msgId, myFriendId, p->msgLength, (int)p->msgLength, p->msg); // to Net
+      fprintf(s->file, "%c %u %u %lu %.*s\n", p->plain ? 'P' : 'M', p->msgId, p->friendId, p->msgLength, (int)p->msgLength, p->msg); // to Net
     else
       fprintf(s->file, "M %lu %.*s\n", p->msgLength, (int)p->msgLength, p->msg); // to Iface
   else if (p->receipt)
-    fprintf(s->file, "R %u\n", p->receipt);
+    if (sendMsgId)
+      fprintf(s->file, "R %u %u\n", p->friendId, p->receipt); // to Net
+    else
+      fprintf(s->file, "R %u\n", p->receipt); // to Iface
+  else if (p->done)
+    fprintf(s->file, "D\n");
   else
     fprintf(s->file, "E %u\n", p->cntMsgEndSignal);
   fflush(s->file);
@@ -301,27 +979,90 @@ static void onIfaceWR(stream *s) {
   onAnyWR(false/*sendMsgId*/, packetPickFront(&ifaceOutBegin, &ifaceOutEnd), s);
 }
 static bool isIfaceRD() {
-  return !sawIfaceEOF; // expect commands unless saw EOF
+  return !hub && !sawIfaceEOF && linkUp(); // expect commands unless saw EOF, the client waits while the friend is offline
+}
+
+static void sendHostileFragments() {
+  // fragments that no sender makes: huge numParts, the peer drops them and delivers nothing
+  static const struct {unsigned partNo, numParts, off, sz;} hostile[] = {
+    {0xffffffff, 0xffffffff, 0, 10},
+    {1,          0x7ffffff0, 0, 10},
+    {2,          3,          9, 10}
+  };
+  for (unsigned i = 0; i < sizeof(hostile)/sizeof(hostile[0]); i++) {
+    uint64_t id = 1500000000000ULL + i;
+    char text[80];
+    int len = sprintf(text, "\xe2\x80\x8b%"PRIu64"|%u|%u|%u|%u\xe2\x80\x8bX",
+                      id, hostile[i].partNo, hostile[i].numParts, hostile[i].off, hostile[i].sz);
+    packet *p = packetCreateMessage((const uint8_t*)text, len, 0/*msgId*/);
+    p->reliable = true;
+    p->friendId = wireFriendId(hisFriendId);
+    netSend(p);
+    // the same as the control packet: id type msgType msgId partNo numParts off sz data
+    uint8_t pkt[28] = {0xb4/*CONTROL_PACKET_ID*/, 4/*CONTROL_FRAGMENT*/, TOX_MESSAGE_TYPE_NORMAL};
+    uint64_t v[5] = {id+10, hostile[i].partNo, hostile[i].numParts, hostile[i].off, hostile[i].sz};
+    for (unsigned b = 0; b < 8; b++)
+      pkt[3+b] = v[0] >> 8*b;
+    for (unsigned f = 1; f < 5; f++)
+      for (unsigned b = 0; b < 4; b++)
+        pkt[11+(f-1)*4+b] = v[f] >> 8*b;
+    pkt[27] = 'X';
+    p = packetCreateLossless(pkt, sizeof(pkt));
+    p->reliable = true;
+    p->friendId = wireFriendId(hisFriendId);
+    netSend(p);
+  }
 }
 
 static void onIfaceRD(stream *s) {
-  switch (readChar(s)) {
+  char cmd = readChar(s);
+  if ((cmd == 'M' || cmd == 'B') && journalSkip) { // the library has it since before the restart
+    skipChar(s, ' ');
+    free(readString(s, '\n'));
+    journalSkip--;
+    return;
+  }
+  switch (cmd) {
   case 'M': { // message
     skipChar(s, ' ');
     char *msg = readString(s, '\n');
     LOG("IFACE: onIfaceRD read msg=%s", msg)
+    msgIface = msg;
     int receipt = apiFront.tox_friend_send_message(NULL, hisFriendId, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t*)msg, strlen(msg), NULL);
+    msgIface = NULL;
     ++msgIdIface;
-    free(msg);
     if (receipt == 0)
       ERROR("Failed to send the message #%u of length=%lu", msgIdIface, strlen(msg))
+    free(msg);
+    *receiptState(receipt) = 1;
+    journalPrintf("S %u\n", receipt);
     LOG("IFACE: SENT msgNum=%u receipt=%u", msgIdIface, receipt)
     break;
+  } case 'B': { // binary payload in hex
+    skipChar(s, ' ');
+    char *hex = readString(s, '\n');
+    size_t length;
+    uint8_t *data = hexDecode(hex, &length);
+    int receipt = tox_defragmenter_friend_send_binary(NULL, hisFriendId, data, length, NULL);
+    ++msgIdIface;
+    free(hex);
+    free(data);
+    if (receipt == 0)
+      ERROR("Failed to send the binary payload #%u of length=%lu", msgIdIface, length)
+    *receiptState(receipt) = 1;
+    journalPrintf("S %u\n", receipt);
+    LOG("IFACE: SENT binary msgNum=%u receipt=%u", msgIdIface, receipt)
+    break;
+  } case 'H': { // hostile fragments bypassing the library
+    skipChar(s, '\n');
+    sendHostileFragments();
+    break;
   } case 'E': {
     skipChar(s, '\n');
     LOG("IFACE: got the end signal\n");
     sawIfaceEOF = true;
-    packetAppend(packetCreateEndSignal(msgIdIface), &netOutBegin, &netOutEnd);
+    journalPrintf("E\n");
+    netSendEndSignal();
     break;
   } default:
     ABORT
@@ -333,23 +1074,40 @@ static void onIfaceRD(stream *s) {
 //
 static bool isNetWR() {
   LOG("isNetWR netOutBegin=%p", netOutBegin)
-  return netOutBegin != NULL;
+  linkCheck();
+  return netOutBegin != NULL && netWaitMs() == 0 && linkUp();
 }
 static void onNetWR(stream *s) {
   LOG(">>> onNetWR %p %p", netOutBegin, netOutEnd)
-  onAnyWR(true/*sendMsgId*/, packetPickFront(&netOutBegin, &netOutEnd), s);
+  packet *p = packetPickFront(&netOutBegin, &netOutEnd);
+  if (impair.rate) {
+    uint64_t now = nowUs();
+    linkFreeUs = (linkFreeUs > now ? linkFreeUs : now) + (p->msgLength + 16/*header*/)*1000000/impair.rate;
+  }
+  onAnyWR(true/*sendMsgId*/, p, s);
   LOG("<<< onNetWR %p %p", netOutBegin, netOutEnd)
 }
 static bool isNetRD() {
   LOG("isNetRD sawNetEndSignal=%d sawNetEOF=%d netReceivedMessages=%u netExpectMessages=%u receivedAllReceipts=%u",
     sawNetEndSignal, sawNetEOF, netReceivedMessages, netExpectMessages, receivedAllReceipts())
-  return !sawNetEndSignal || !sawNetEOF || netReceivedMessages < netExpectMessages || !receivedAllReceipts();
-    // expect packets unless saw EOF or still have packets or receipts to receive
+  return !sawNetEOF; // the other peer closes when both are done
 }
 static void onNetRD(stream *s) {
   LOG(">>> onNetRD")
-  switch (readChar(s)) {
-  case 'M': { // message: M msgId fromFriendId sz msg nl
+  if (!netConnected) {
+    netAccept();
+    return;
+  }
+  if (crash && setjmp(netEofJmp)) {
+    netMidLine = false;
+    netDisconnected();
+    return;
+  }
+  char cmd = readChar(s);
+  netMidLine = true;
+  switch (cmd) {
+  case 'M':   // message: M msgId fromFriendId sz msg nl
+  case 'P': { // client's message passed through: P msgId fromFriendId sz msg nl
     skipChar(s, ' ');
     unsigned msgId = readUInt(s, ' ');
     unsigned fromFriendId = readUInt(s, ' ');
@@ -358,43 +1116,84 @@ static void onNetRD(stream *s) {
     cb_friend_message_cb(NULL, fromFriendId, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t*)msg, strlen(msg), NULL/*user_data*/);
     LOG("NET: onNetRD <<< passed to cb msg=%s len=%lu", msg, strlen(msg))
     free(msg);
-    // send receipt back to the sender
-    packetAppend(packetCreateReceipt(msgId), &netOutBegin, &netOutEnd);
+    // send receipt back to the sender, duplicates don't have it
+    if (msgId) {
+      packet *r = packetCreateReceipt(msgId);
+      r->reliable = cmd == 'P';
+      r->friendId = wireFriendId(fromFriendId);
+      netSend(r);
+    }
     break;
-  } case 'R': { // receipt: R msgId nl
+  } case 'L': { // lossless packet: L fromFriendId sz data nl
     skipChar(s, ' ');
+    unsigned fromFriendId = readUInt(s, ' ');
+    unsigned sz = readUInt(s, ' ');
+    uint8_t *data = malloc(sz ? sz : 1);
+    if (!readBytes(s, data, sz))
+      ERROR("can't read a lossless packet of length %u", sz)
+    skipChar(s, '\n');
+    cb_friend_lossless_packet(NULL, fromFriendId, data, sz, NULL/*user_data*/);
+    free(data);
+    break;
+  } case 'R': { // receipt: R fromFriendId msgId nl
+    skipChar(s, ' ');
+    unsigned fromFriendId = readUInt(s, ' ');
     unsigned msgId = readUInt(s, '\n');
     LOG("NET: onNetRD >>> got the receipt %u\n", msgId);
-    cb_friend_read_receipt(NULL, 1/*friend*/, msgId, NULL/*user_data*/);
+    cb_friend_read_receipt(NULL, fromFriendId, msgId, NULL/*user_data*/);
     LOG("NET: onNetRD <<< got the receipt %u\n", msgId);
     break;
   } case 'E': { // end signal: E netExpectMessages nl
     skipChar(s, ' ');
     sawNetEndSignal = true;
     netExpectMessages = readUInt(s, '\n');
+    journalPrintf("X %u\n", netExpectMessages);
+    break;
+  } case 'D': { // done signal: D nl
+    skipChar(s, '\n');
+    sawNetDone = true;
     break;
   } case 0: {
-    if (!sawNetEndSignal)
-      ERROR("Net EOF but no end signal")
+    // the other peer only closes after both are done, it was killed when this peer isn't done yet
+    if (crash && (!sawNetEndSignal || !sawNetDone || !sentDone)) {
+      netDisconnected();
+      break;
+    }
+    if (!sawNetEndSignal || !sawNetDone)
+      ERROR("Net EOF but no end or done signal")
     sawNetEOF = true;
     break;
   } default:
     ABORT
   }
+  netMidLine = false;
   LOG("<<< onNetRD")
 }
 static bool needContinue() {
-  LOG("needContinue: %d %d %d %u %u %p %p %u -> %d",
+  bool done = sawIfaceEOF &&
+              sawNetEndSignal && netReceivedMessages >= netExpectMessages && receivedAllReceipts() &&
+              !ifaceOutBegin;
+  LOG("needContinue: %d %d %d %u %u %p %p %u %d -> %d",
     sawIfaceEOF, sawNetEndSignal, sawNetEOF, netReceivedMessages, netExpectMessages, ifaceOutBegin, netOutBegin, receivedAllReceipts(),
-        !sawIfaceEOF ||
-        !sawNetEndSignal || netReceivedMessages < netExpectMessages || !receivedAllReceipts() ||
-        ifaceOutBegin || netOutBegin
-  )
-  return !sawIfaceEOF ||
-         !sawNetEndSignal || netReceivedMessages < netExpectMessages || !receivedAllReceipts() ||
-         ifaceOutBegin || netOutBegin;
+    sawNetDone, !done || !sawNetDone || netOutBegin != NULL)
+  if (done && !sentDone) {
+    packet *p = packetCreateEndSignal(0);
+    p->done = p->reliable = true;
+    netSend(p);
+    sentDone = true;
+  }
+  // the acks and the receipts that the other peer waits for can be lost, so both peers stay until both are done
+  return !done || !sawNetDone || netOutBegin;
 }
 static void onTimeout() {
+  if (hub)
+    hubSend();
+  apiFront.tox_iterate(NULL, NULL/*user_data*/);
+}
+static unsigned iterationIntervalMs() {
+  unsigned intervalMs = apiFront.tox_iteration_interval(NULL);
+  unsigned waitMs = linkUp() ? netWaitMs() : UINT_MAX;
+  return waitMs < intervalMs ? waitMs : intervalMs;
 }
 
 typedef bool (*IsXX)();
@@ -417,7 +1216,9 @@ static void loop3(stream *s1, IsXX isWR1, OnXX onWR1, IsXX isRD1, OnXX onRD1,
     if (isWR1 && isWR1()) FD_SET(s1->fd, &wrSet);
     if (isWR2 && isWR2()) FD_SET(s2->fd, &wrSet);
     if (isWR3 && isWR3()) FD_SET(s3->fd, &wrSet);
-    res = select(max3(s1->fd, s2->fd, s3->fd)+1, &rdSet, &wrSet, NULL, NULL);
+    unsigned intervalMs = iterationIntervalMs();
+    struct timeval tv = {.tv_sec = intervalMs/1000, .tv_usec = (intervalMs%1000)*1000};
+    res = select(max3(s1->fd, s2->fd, s3->fd)+1, &rdSet, &wrSet, NULL, &tv);
     if (res > 0) {
       if (FD_ISSET(s1->fd, &rdSet)) onRD1(s1);
       if (FD_ISSET(s2->fd, &rdSet)) onRD2(s2);
@@ -425,9 +1226,10 @@ static void loop3(stream *s1, IsXX isWR1, OnXX onWR1, IsXX isRD1, OnXX onRD1,
       if (FD_ISSET(s1->fd, &wrSet)) onWR1(s1);
       if (FD_ISSET(s2->fd, &wrSet)) onWR2(s2);
       if (FD_ISSET(s3->fd, &wrSet)) onWR3(s3);
-    } else {
+    } else if (res < 0) {
       CK(res)
     }
+    onTimeout(); // the client iterates Tox between the events
   } while (needToContinue());
 }
 
@@ -445,42 +1247,159 @@ static void loop(IsXX needToContinue) {
 //
 
 int main(int argc, char *argv[]) {
-  if (argc != 9)
-    usage();
-  myFriendId = atoi(argv[1]);
-  hisFriendId = atoi(argv[2]);
+  if (argc == 3 && !strcmp(argv[1], "gen")) {
+    parseLoad(argv[2]);
+    loadGenerate();
+    return 0;
+  }
+  if (argc > 1 && !strcmp(argv[1], "hub")) {
+    if (argc != 12 && argc != 13)
+      usage();
+    hub = true;
+    hubFriends = atoi(argv[2]);
+    parseLoad(argv[3]);
+    myFriendId = atoi(argv[4]);
+    argc -= 2; // the rest are like the peer's
+    argv += 2;
+    hubInitialize();
+  } else {
+    if (argc > 1 && (!strcmp(argv[1], "crash") || !strncmp(argv[1], "crash=", 6))) {
+      crash = true;
+      crashDelivered = argv[1][5] ? atoi(argv[1] + 6) : 0;
+      argc--; // the rest are like the peer's
+      argv++;
+    }
+    if (argc != 10 && argc != 11)
+      usage();
+    myFriendId = atoi(argv[1]);
+    hisFriendId = atoi(argv[2]);
+  }
   streamIn  = (stream){.fd = STDIN_FILENO,  .file = stdin};
   streamOut = (stream){.fd = STDOUT_FILENO, .file = stdout};
+  if (crash) {
+    char journalFname[64];
+    sprintf(journalFname, "test-client%u.txt", myFriendId);
+    journalRestore(journalFname);
+    if (journalDone) {
+      fprintf(stderr, "peer %u: was done before the restart\n", myFriendId);
+      return 0;
+    }
+    streamOut.file = fopen(journalFname, "a");
+    if (!streamOut.file)
+      ERROR("can't open the journal %s", journalFname)
+    streamOut.fd = fileno(streamOut.file);
+  }
   // open
   streamNet.fd = openSocket(argv[4]/*netSocketFname*/, argv[5][0] /*doConnect*/);
   streamNet.file = fdopen(streamNet.fd, "w");
   LOG("pid#%d: connected, streamIn=%p streamOut=%p streamNet=%p", getpid(), &streamIn, &streamOut, &streamNet)
+  startUs = nowUs();
+  if (argc == 11)
+    parseImpairment(argv[10]);
+  impair.seed += myFriendId; // repeatable, and different for the peers
+  if (sawIfaceEOF)
+    netSendEndSignal(); // the restarted peer handed off everything before
 
   // params
+  if (virtualClock)
+    tox_defragmenter_set_clock(virtualClockNow, NULL);
   tox_defragmenter_set_parameters(atoi(argv[6]), atoi(argv[7]), atoi(argv[8]), DEFRAG_RECEIPTS_LO, DEFRAG_RECEIPTS_HI);
+  tox_defragmenter_set_batching(atoi(argv[9]), 0/*maxMessages*/);
+  tox_defragmenter_set_trace_level(2/*every part*/);
 
-  // initialize interface
-  if (argv[3][0]) {
+  // initialize interface, the restarted peer loads the unfinished messages then
+  uint64_t initUs = nowUs();
+  size_t dbFnameLen = strlen(argv[3]);
+  apiFront = tox_defragmenter_initialize_api(&apiBase);
+  if (dbFnameLen > 8 && !strcmp(argv[3] + dbFnameLen - 8, ".journal")) {
+    tox_defragmenter_initialize_db_journal(argv[3]/*dbFname*/);
+  } else if (argv[3][0]) {
     CK(sqlite3_open(argv[3]/*dbFname*/, &sqlite))
-    apiFront = tox_defragmenter_initialize_api(&apiBase);
     tox_defragmenter_initialize_db(sqlite, NULL, NULL, NULL);
   } else {
     tox_defragmenter_initialize_db_inmemory();
   }
   apiFront.tox_callback_friend_message(NULL, front_friend_message);
   apiFront.tox_callback_friend_read_receipt(NULL, front_read_receipt);
+  apiFront.tox_callback_friend_lossless_packet(NULL, front_lossless_packet);
+  tox_defragmenter_callback_friend_binary(front_friend_binary);
+  initUs = nowUs() - initUs;
+  ToxDefragmenterStats statsInit;
+  tox_defragmenter_get_stats(&statsInit);
+  signal(SIGPIPE, SIG_IGN); // the other peer can finish first, packets to it are then dropped
 
   // loop
   loop(&needContinue);
+  journalPrintf("D\n");
+
+  // stats: everything was delivered both ways
+  ToxDefragmenterStats stats;
+  tox_defragmenter_get_stats(&stats);
+  LOG("stats: sent=%lu resent=%lu confirmed=%lu bytesSent=%lu bytesReceived=%lu completed=%lu duplicates=%lu",
+    stats.fragmentsSent, stats.fragmentsResent, stats.fragmentsConfirmed, stats.bytesSent, stats.bytesReceived,
+    stats.messagesCompleted, stats.duplicatesDropped)
+  if (stats.pendingOutboundBytes || stats.messagesFailed || (!restarted && stats.fragmentsConfirmed > stats.fragmentsSent) || // parts sent before the restart are confirmed too
+      (!hub && !restarted && (!stats.bytesSent || !stats.bytesReceived || !stats.messagesCompleted))) // the hub's load can be all short
+    ERROR("unexpected stats: pendingOutboundBytes=%lu messagesFailed=%lu fragmentsSent=%lu fragmentsConfirmed=%lu"
+          " messagesCompleted=%lu",
+      stats.pendingOutboundBytes, stats.messagesFailed, stats.fragmentsSent, stats.fragmentsConfirmed,
+      stats.messagesCompleted)
+
+  // latency: every reassembled message and every delivered message is counted
+  uint64_t numInbound = 0, numOutbound = 0;
+  for (unsigned c = 0; c < TOX_DEFRAGMENTER_SIZE_CLASSES; c++) {
+    ToxDefragmenterHistogram hist;
+    tox_defragmenter_get_latency(TOX_DEFRAGMENTER_LATENCY_INBOUND, c, &hist);
+    numInbound += hist.num;
+    tox_defragmenter_get_latency(TOX_DEFRAGMENTER_LATENCY_OUTBOUND, c, &hist);
+    numOutbound += hist.num;
+  }
+  if (numInbound != stats.messagesCompleted || (!hub && !restarted && !numOutbound))
+    ERROR("unexpected latency histograms: inbound num=%lu for %lu messages, outbound num=%lu",
+      numInbound, stats.messagesCompleted, numOutbound)
+
+  // report: goodput of what the client received, and how soon everything was done both ways
+  uint64_t endUs = nowUs();
+  double recvSec = (lastDeliveredUs ? lastDeliveredUs - startUs : 0)/1e6;
+  fprintf(stderr, "peer %u: received %u messages, %lu bytes in %.2f s, goodput %.1f KB/s;"
+                  " receipts of %u messages in %.2f s; done in %.2f s\n",
+    myFriendId, netReceivedMessages, netDeliveredBytes, recvSec, recvSec > 0 ? netDeliveredBytes/recvSec/1024 : 0.,
+    msgIdIface, (lastReceiptUs ? lastReceiptUs - startUs : 0)/1e6, (endUs - startUs)/1e6);
+  fprintf(stderr, "peer %u: fragments sent %lu, resent %lu, duplicates dropped %lu;"
+                  " link lost %u packets, %u of them while down, duplicated %u, reordered %u\n",
+    myFriendId, stats.fragmentsSent, stats.fragmentsResent, stats.duplicatesDropped,
+    impairLost + impairLostDown, impairLostDown, impairDuplicated, impairReordered);
+  if (hub)
+    hubReport(endUs);
+  if (restarted)
+    fprintf(stderr, "peer %u: restarted with %lu bytes pending outbound, %lu inbound, loaded in %.1f ms;"
+                    " resumed in %.2f s, fragments sent since %lu\n",
+      myFriendId, statsInit.pendingOutboundBytes, statsInit.pendingInboundBytes, initUs/1e3,
+      (resumedUs ? resumedUs - startUs : 0)/1e6, stats.fragmentsSent);
+  if (netDisconnects)
+    fprintf(stderr, "peer %u: the other peer was restarted %u times, redundant fragments dropped %lu\n",
+      myFriendId, netDisconnects, stats.duplicatesDropped - netDuplicatesBefore);
+
+  // trace
+  char traceFname[64];
+  sprintf(traceFname, "test-trace%u.bin", myFriendId);
+  if (!tox_defragmenter_trace_dump(traceFname))
+    ERROR("Failed to dump the trace into %s", traceFname)
 
   // finish
   tox_defragmenter_uninitialize();
+  if (hub)
+    hubUninitialize();
 
   // close
   if (sqlite)
     sqlite3_close(sqlite);
   fclose(streamNet.file);
   close(streamNet.fd);
+  if (netListenFd != -1)
+    close(netListenFd);
+  if (crash)
+    fclose(streamOut.file);
 
   return 0;
 }
@@ -10,77 +10,116 @@ echo "Starting tests (`date`)"
 PARAM_MAX_MESSAGE_LENGTH=75
 PARAM_FAGMENTS_AT_A_TIME=10
 PARAM_RECEIPT_EXPIRATION_TIME_MS=1000
-PARAMS="$PARAM_MAX_MESSAGE_LENGTH $PARAM_FAGMENTS_AT_A_TIME $PARAM_RECEIPT_EXPIRATION_TIME_MS"
+PARAM_BATCH_DELAY_MS=20
+PARAMS="$PARAM_MAX_MESSAGE_LENGTH $PARAM_FAGMENTS_AT_A_TIME $PARAM_RECEIPT_EXPIRATION_TIME_MS $PARAM_BATCH_DELAY_MS"
+# friends of the hub run, and the load that the hubs send to every one of them
+HUB_FRIENDS=16
+HUB_LOAD="num=10,size=10-5000,dist=log,binary=10,concurrency=3"
+# link of the impaired run: loss and duplication %, reorder window, delay and jitter ms, bytes/s, down ms/period ms
+IMPAIRMENT="loss=5,dup=5,reorder=3,delay=10,jitter=30,rate=200000,down=500/3000"
+# the library's clock starts near 0 in the simulation, message ids still come from the wall clock
+VIRTUAL_CLOCK="loss=5,clock=0"
+# times that the connecting peer of the crash run is killed and restarted
+CRASH_KILLS=3
+# the first start of the connecting peer kills itself in the callback of this message, after the client journaled it
+CRASH_DELIVERED=2
 CMD_PEER=./test-peer
+CMD_TRACE_DECODE=./trace-decode
 NET_SOCKET=test-net-socket
+SEED=${SEED:-$(od -An -N2 -tu2 /dev/urandom | tr -d ' ')} # SEED=N ./test.sh repeats the run with these messages
 
 ## procedures
-randomNumber() {
-  local max=$1
-  max=$((max+1))
-  local r=$(od -An -N2 -i /dev/random)
-  echo `expr $r % $max`
-}
-randomNumberInRange() {
-  local min=$1
-  local max=$2
-  echo $((min + $(randomNumber $((max-min)))))
+generateTestInput() {
+  local seed=$1
+  $CMD_PEER gen "num=10,size=30-100,seed=$((seed*8+1))"
+  $CMD_PEER gen "num=10,size=1000-2000,seed=$((seed*8+2))"
+  $CMD_PEER gen "num=10,size=50-5000,seed=$((seed*8+3))"
+  $CMD_PEER gen "num=20,size=10-60,seed=$((seed*8+4))" # burst of short messages, batched
+  $CMD_PEER gen "num=10,size=1-3000,binary=100,seed=$((seed*8+5))" # binary payloads with zero bytes
+  echo "H" # forged fragments with the hostile numParts, nothing is delivered
+  echo "E"
 }
-randomString() {
-  local len=$1
-  cat /dev/urandom | LC_CTYPE=C tr -cd "[:alnum:]" | fold -w $len | head -1
+generateCrashInput() {
+  # long messages only, the library keeps them in the database until they are received
+  local seed=$1
+  $CMD_PEER gen "num=8,size=2000-10000,seed=$((seed*8+1))"
+  $CMD_PEER gen "num=3,size=2000-5000,binary=100,seed=$((seed*8+2))"
+  echo "E"
 }
-generateMessage() {
-  local len=$1
-  echo "M $len $(randomString $len)"
+startCrashPeer() {
+  $CMD_PEER $1 5 7 test-db1.$DB_EXT $NET_SOCKET C $PARAMS < test-in3.txt &
+  PID1=$!
 }
-generateMessages() {
-  local num=$1
-  local lenMin=$2
-  local lenMax=$3
-  while [ $num -gt 0 ]; do
-    generateMessage $(randomNumberInRange $lenMin $lenMax)
-    num=$((num-1))
+waitJournaled() {
+  # the killed peer has handed off all of its messages
+  while ! grep -q "^E" test-client5.txt 2>/dev/null; do
+    kill -0 $PID1 2>/dev/null || return
+    sleep 0.1
   done
 }
-generateTestInput() {
-  generateMessages 10 30 100
-  generateMessages 10 1000 2000
-  generateMessages 10 50 5000
-  echo "E"
-}
 compareMsgs() {
   local f1=$1
   local f2=$2
-  grep "^M" $f1 | sort > ${f1}.x
-  grep "^M" $f2 | sort > ${f2}.x
+  grep "^[MB]" $f1 | sort > ${f1}.x
+  grep "^[MB]" $f2 | sort > ${f2}.x
   diff ${f1}.x ${f2}.x > /dev/null 2>&1
 }
+hasDuplicates() {
+  # messages received twice, or receipts of the handed off messages received twice
+  awk '/^[MB]/ {if (seen[$0]++) d++} /^S/ {sent[$2]=1} /^R/ {if (sent[$2] && got[$2]++) d++} END {exit !d}' $1
+}
+waitPeers() {
+  local fail=0
+  wait $PID1 || fail=$((fail+1))
+  wait $PID2 || fail=$((fail+1))
+  if [ $fail -ne 0 ]; then
+    cleanup
+    echo "FAILURE: $fail process(es) failed"
+    exit 1
+  fi
+}
 cleanup() {
-  rm -f $NET_SOCKET test-in*txt* test-out*txt* test-db*.sqlite
+  rm -f $NET_SOCKET test-in*txt* test-out*txt* test-client*txt* test-db*.sqlite test-db*.journal* test-trace*.bin
 }
 
 ## generate input
-echo "Generating messages ..."
-generateTestInput > test-in1.txt
-generateTestInput > test-in2.txt
+echo "Generating messages (SEED=$SEED) ..."
+generateTestInput $((SEED*2)) > test-in1.txt
+generateTestInput $((SEED*2+1)) > test-in2.txt
+
+## run peer simulation for each storage backend, over the impaired link, and on the virtual clock
+for RUN in sqlite journal memory impaired virtual; do
 
-## run peer simulation
-echo "Testing ..."
-rm -f test-db1.sqlite test-db2.sqlite $NET_SOCKET
-$CMD_PEER 5 7 test-db1.sqlite $NET_SOCKET C $PARAMS < test-in1.txt > test-out1.txt &
-$CMD_PEER 7 5 test-db2.sqlite $NET_SOCKET L $PARAMS < test-in2.txt > test-out2.txt &
+DB_EXT=$RUN
+RUN_IMPAIRMENT=
+if [ $RUN = impaired ]; then
+  DB_EXT=sqlite
+  RUN_IMPAIRMENT=$IMPAIRMENT
+elif [ $RUN = virtual ]; then
+  DB_EXT=sqlite
+  RUN_IMPAIRMENT=$VIRTUAL_CLOCK
+fi
+echo "Testing ($RUN) ..."
+DB1=test-db1.$DB_EXT
+DB2=test-db2.$DB_EXT
+if [ $DB_EXT = memory ]; then
+  DB1= # the empty file name selects the in-memory backend
+  DB2=
+fi
+rm -f test-db1.$DB_EXT test-db2.$DB_EXT $NET_SOCKET
+$CMD_PEER 5 7 "$DB1" $NET_SOCKET C $PARAMS $RUN_IMPAIRMENT < test-in1.txt > test-out1.txt &
+PID1=$!
+$CMD_PEER 7 5 "$DB2" $NET_SOCKET L $PARAMS $RUN_IMPAIRMENT < test-in2.txt > test-out2.txt &
+PID2=$!
 
 ## wait for the peers to finish
-FAIL=0
-for job in `jobs -p`
-do
-  wait $job || let "FAIL+=1"
-done
+waitPeers
 
-if [ "$FAIL" -ne "0" ]; then
+## the traces have the completed messages
+if ! $CMD_TRACE_DECODE test-trace5.bin | grep -q "msg-complete" ||
+   ! $CMD_TRACE_DECODE test-trace7.bin | grep -q "msg-ready"; then
   cleanup
-  echo "FAILURE: $FAIL process(es) failed"
+  echo "FAILURE: traces don't have the messages!"
   exit 1
 fi
 
@@ -93,5 +132,60 @@ if ! compareMsgs test-in1.txt test-out2.txt ||
   exit 1
 fi
 
+done
+
+## hubs of many friends, they check the messages themselves
+echo "Testing (hub) ..."
+rm -f $NET_SOCKET
+$CMD_PEER hub $HUB_FRIENDS "$HUB_LOAD,seed=$SEED" 5 "" $NET_SOCKET C $PARAMS < /dev/null &
+PID1=$!
+$CMD_PEER hub $HUB_FRIENDS "$HUB_LOAD,seed=$SEED" 7 "" $NET_SOCKET L $PARAMS < /dev/null &
+PID2=$!
+waitPeers
+
+## the connecting peer is killed during the transfer and restarted on the same database and journal
+generateCrashInput $((SEED*2)) > test-in3.txt
+generateCrashInput $((SEED*2+1)) > test-in4.txt
+for DB_EXT in ${CRASH_BACKENDS:-sqlite journal}; do
+echo "Testing (crash, $DB_EXT) ..."
+rm -f test-db1.$DB_EXT test-db2.$DB_EXT test-client*.txt $NET_SOCKET
+$CMD_PEER crash 7 5 test-db2.$DB_EXT $NET_SOCKET L $PARAMS < test-in4.txt &
+PID2=$!
+# the message that the client got right before the crash isn't delivered again
+startCrashPeer crash=$CRASH_DELIVERED
+wait $PID1
+if [ $? -ne 137 ]; then
+  cleanup
+  echo "FAILURE: the peer didn't crash in the callback"
+  exit 1
+fi
+echo "the peer 5 crashed in the callback, restarting it"
+startCrashPeer crash
+KILL=0
+while [ $KILL -lt $CRASH_KILLS ]; do
+  waitJournaled
+  sleep $(printf "0.%03u" $(((SEED*7 + KILL*331) % 900 + 50)))
+  kill -9 $PID1 2>/dev/null || break
+  wait $PID1
+  [ $? -eq 137 ] || break
+  echo "killed the peer 5, restarting it"
+  startCrashPeer crash
+  KILL=$((KILL+1))
+done
+waitPeers
+echo "Comparing message files ..."
+if ! compareMsgs test-in3.txt test-client7.txt ||
+   ! compareMsgs test-in4.txt test-client5.txt; then
+  cleanup
+  echo "FAILURE: messages don't match after the restarts!"
+  exit 1
+fi
+if hasDuplicates test-client5.txt || hasDuplicates test-client7.txt; then
+  cleanup
+  echo "FAILURE: messages or receipts were delivered twice after the restarts!"
+  exit 1
+fi
+done
+
 cleanup
 echo "SUCCESS: Tests succeeded! (`date`)"
@@ -6,10 +6,12 @@
 #include "tox-defragmenter.h"
 #include "database.h"
 #include "marker.h"
+#include "control.h"
 #include "util.h"
+#include "trace.h"
+#include "clock.h"
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -21,12 +23,15 @@
 static Tox *toxInstance = NULL;
 static uint8_t initializedApi = 0;
 static uint8_t initializedDb = 0;
+static uint8_t undeliveredPending = 0; // inbound messages from before the restart wait for the client's callback
 static ToxcoreApi base_toxcore_api;
 #define TOX(function) base_toxcore_api.tox_##function
 #define MY(function) tox_defragmenter_##function
 #define CLIENT(function) client_##function
 static tox_friend_read_receipt_cb *client_friend_read_receipt_cb = 0;
 static tox_friend_message_cb *client_friend_message_cb = 0;
+static tox_friend_lossless_packet_cb *client_friend_lossless_packet_cb = 0;
+static tox_defragmenter_friend_binary_cb *client_friend_binary_cb = 0;
 static unsigned markerMaxSizeEver = 0;
 static uint64_t lastMsgId = 0;
 
@@ -34,6 +39,16 @@ static uint64_t lastMsgId = 0;
 #define NEWA(elt, num) ((elt*)calloc(sizeof(elt), num))
 #define REALLOC(old, elt, numOld, numNew) ((elt*)memRealloc(old, sizeof(elt)*numOld, sizeof(elt)*numNew))
 #define DEL(obj) free(obj)
+// outbound messages, their fragment arrays and payloads come from the pools, and are returned with their size
+#define PNEW(type) ((type*)poolGet(sizeof(type)))
+#define PNEWA(elt, num) ((elt*)poolGet(sizeof(elt)*(num)))
+#define PDEL(obj) poolPut(obj, sizeof(*(obj)))
+#define PDELA(arr, num) poolPut(arr, sizeof((arr)[0])*(num))
+#define BIT_GET(bits, i) ((bits)[(i)/8] & (1 << ((i)%8)))
+#define BITS_WORDS(num) (((num) + 63)/64)
+#define BITS_GET(bits, i) (((bits)[(i)/64] >> ((i)%64)) & 1)
+#define BITS_SET(bits, i) ((bits)[(i)/64] |= (uint64_t)1 << ((i)%64))
+#define BITS_CLR(bits, i) ((bits)[(i)/64] &= ~((uint64_t)1 << ((i)%64)))
 #define MVA(arr, idx1, idx2, idxDelta) { \
   memmove(arr+idx1+idxDelta, arr+idx1, sizeof(arr[0])*(idx2-idx1)); \
   memset(idxDelta > 0 ? arr+idx1 : arr+idx2-idxDelta, 0, sizeof(arr[0])*idxDelta); \
@@ -54,19 +69,45 @@ struct params {
   0x7fffffff  // receipt range high
 };
 
+struct batchParams {
+  unsigned delayMs;
+  unsigned maxMessages;
+} batchParams = {
+  // defaults
+  0,          // batching is off
+  32          // 32 messages in the batch
+};
+
 #define FID "%"PRIu64
 #define FTM "%"PRIu64
 
+// control packets
+#define CONTROL_MAX_SIZE TOX_MAX_CUSTOM_PACKET_SIZE
+#define CONTROL_CAPS     (CONTROL_CAP_SACK | CONTROL_CAP_PACKETS | CONTROL_CAP_BATCH | CONTROL_CAP_CHECKSUM | \
+                          CONTROL_CAP_BINARY) // capabilities of this version
+#define CHECKSUMS_NUM    256 // checksums of the inbound messages that are remembered
+#define BATCHES_SEEN_NUM 128 // ids of the inbound batches that are remembered per friend, their repeats are dropped
+
+// pools: two size classes per power of 2, 32, 48, 64, 96, ... 96KB, larger blocks are malloc'ed
+#define POOL_CLASSES    24
+#define POOL_SLAB_SIZE  (64*1024)        // classes up to POOL_SLAB_ITEM are carved from the slabs
+#define POOL_SLAB_ITEM  1024
+#define POOL_KEEP_BYTES (4*1024*1024)    // free blocks kept by each of the larger classes, the rest go back to malloc
+
 //
 // structures
 //
 
 typedef struct fragment {
-  size_t          length;
   uint8_t         *data;
+  uint64_t        packetTm;  // when it was sent in the lossless packet that we wait the ack for
+  uint64_t        sentTm;    // when it was last sent
+  unsigned        length;
   uint32_t        receipt;   // receipt from below that we are waiting for
+  unsigned        off;
   unsigned        timesSent; // how many times did we send it
-  int             confirmed; // receipt received
+  unsigned        sentSeq;   // number of the last send within the message
+  uint8_t         markerSize;
 } fragment;
 
 typedef struct msg_outbound {
@@ -75,23 +116,76 @@ typedef struct msg_outbound {
   uint32_t         friend_number;
   uint64_t         id;
   TOX_MESSAGE_TYPE type;
+  size_t           length;
+  uint32_t         crc;          // CRC-32C of the whole message
   unsigned         numParts;
   fragment         *fragments;
+  uint64_t         *confirmed;   // bits of the parts: receipt or ack received
+  uint64_t         *idle;        // bits of the parts that are neither confirmed nor in transit, they are to be sent
+  unsigned         idleFrom;     // parts below it aren't idle
   uint32_t         receipt;     // receipt number we sent to the client
-  unsigned         lastSent;
+  uint64_t         sendTm;      // when the client sent it
   unsigned         numTransit;
   unsigned         numConfirmed;
   unsigned         numLoss;
+  unsigned         sendSeq;      // sends of the parts so far
   int              fromDb;
+  // sack: parts of the message loaded from db wait for the receiver to tell which ones it has
+  uint8_t          sackQueried;
+  uint8_t          sackDone;     // sack was received, or isn't coming
+  unsigned         sackQuerySeq; // sendSeq when the query was sent
+  uint64_t         sackWaitTm;
+  // checksum: the receiver verifies the reassembled message, the parts are kept until it tells the result
+  uint8_t          crcSent;
+  uint8_t          verified;
+  uint64_t         verdictTm;    // when all parts were confirmed, or the verdict was asked for
 } msg_outbound;
 
+typedef struct peer {
+  uint8_t       known;      // hello was received
+  uint32_t      caps;       // capabilities common to both defragmenters
+  uint64_t      helloTm;    // when the hello was sent
+  unsigned      hellosSent; // hellos not answered yet
+  ToxDefragmenterStats stats; // cumulative counters, kept when the friend goes offline
+  uint64_t      batchesSeen[BATCHES_SEEN_NUM]; // ids of the inbound batches, also kept
+  unsigned      batchesSeenNext;
+} peer;
+
+typedef struct batch {
+  struct batch     *next;
+  uint32_t         friend_number;
+  TOX_MESSAGE_TYPE type;
+  unsigned         num;
+  size_t           *lengths;
+  uint32_t         *clientReceipts; // receipts we gave to the client
+  uint8_t          *data;           // messages one after another
+  size_t           size;
+  uint8_t          *frame;          // message that is sent, made when the batch is closed
+  size_t           frameLength;
+  uint64_t         openTm;
+  uint32_t         receipt;         // receipt from below that we are waiting for
+  uint64_t         id;              // the receiver drops the batch that it already got when it's sent again
+} batch;
+
 typedef struct receipt_record {
   uint32_t      receipt;
   msg_outbound  *msg;
+  batch         *batch;
   unsigned      partNo;
   uint64_t      timestamp;
 } receipt_record;
 
+typedef struct checksum_record {
+  uint32_t      friend_number;
+  uint64_t      id;
+  uint32_t      crc;
+  uint8_t       corrupt;   // the message arrived and didn't match
+} checksum_record;
+
+typedef struct pool_block {
+  struct pool_block *next;
+} pool_block;
+
 //
 // static data
 //
@@ -102,26 +196,50 @@ static unsigned receiptsHi = 0;
 static unsigned receiptsNum = 0;
 static unsigned receiptsAlloc = 0;
 static uint32_t lastReceipt = 0;
+static peer *peers = NULL;
+static unsigned peersAlloc = 0;
+static batch *batches = NULL;
+static checksum_record checksums[CHECKSUMS_NUM];
+static unsigned checksumsNext = 0;
+static checksum_record *inboundChecksum = NULL; // of the message whose part is being inserted
+static uint8_t inboundVerdict = 0;              // sack state, set when that message is reassembled
+static ToxDefragmenterHistogram latency[TOX_DEFRAGMENTER_LATENCY_PART_RTT+1][TOX_DEFRAGMENTER_SIZE_CLASSES];
+static pool_block *poolFree[POOL_CLASSES];   // free blocks of each class
+static size_t poolFreeBytes[POOL_CLASSES];
+static pool_block *poolSlabs = NULL;         // every slab starts with the link to the next one
+static uint8_t *poolSlabPos = NULL;
+static size_t poolSlabLeft = 0;
 
 //
 // declarations
 //
 static void* memRealloc(void *mem, unsigned szOld, unsigned szNew);
+static int poolClass(size_t size);
+static size_t poolClassSize(int c);
+static void* poolGet(size_t size);
+static void poolPut(void *mem, size_t size);
+static void poolsRelease();
+static unsigned bitsNext(const uint64_t *bits, unsigned i, unsigned num);
 static uint64_t getCurrTimeMs();
 static uint32_t generateReceiptNo();
 static void initialize();
 static void uninitialize();
+static void deliverUndelivered(Tox *tox, void *user_data);
 static void receiptsInitialize();
 static void receiptsUninitialize();
 static void MY(callback_friend_read_receipt)(Tox *tox, tox_friend_read_receipt_cb *callback);
 static void MY(callback_friend_message)(Tox *tox, tox_friend_message_cb *callback);
+static void MY(callback_friend_lossless_packet)(Tox *tox, tox_friend_lossless_packet_cb *callback);
 static void msgsOutboundLink(msg_outbound *msg);
 static void msgsOutboundUnlink(msg_outbound *msg);
 static void msgOutboundDelete(msg_outbound *msg);
 static void msgsOutboundDeleteAll();
+static msg_outbound* msgOutboundFind(uint32_t friend_number, uint64_t id);
 static int isFriendOnline(Tox *tox, uint32_t friend_number);
 static Tox* MY(new)(const struct Tox_Options *options, TOX_ERR_NEW *error);
 static void MY(kill)(Tox *tox);
+static void MY(iterate)(Tox *tox, void *user_data);
+static uint32_t MY(iteration_interval)(const Tox *tox);
 static uint32_t MY(friend_send_message)(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                         size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error);
 static uint32_t MY(friend_send_message_long)(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
@@ -129,11 +247,22 @@ static uint32_t MY(friend_send_message_long)(Tox *tox, uint32_t friend_number, T
 static void msgSendNextParts(Tox *tox, msg_outbound *msg);
 static void msgIsComplete(Tox *tox, msg_outbound *msg, void *user_data);
 static int msgSendPart(Tox *tox, msg_outbound *msg, unsigned i);
-static msg_outbound* splitMessage(const uint8_t *message, size_t length, size_t maxLength, uint64_t id);
-static void addReceipt(uint32_t receipt, msg_outbound *msg, unsigned partNo, uint64_t timestamp);
+static int msgSendPartPacket(Tox *tox, msg_outbound *msg, unsigned i);
+static void msgPartUntransit(msg_outbound *msg, unsigned i);
+static void msgPartConfirmed(msg_outbound *msg, unsigned i);
+static void msgPartIdle(msg_outbound *msg, unsigned i);
+static int msgAwaitsSack(Tox *tox, msg_outbound *msg);
+static int msgAwaitsVerdict(Tox *tox, msg_outbound *msg);
+static void msgContinue(Tox *tox, msg_outbound *msg, void *user_data);
+static void msgChecksumSend(Tox *tox, msg_outbound *msg);
+static void msgResend(Tox *tox, msg_outbound *msg, void *user_data);
+static msg_outbound* splitMessage(const uint8_t *message, size_t length, int type, uint64_t id);
+static void addReceipt(uint32_t receipt, msg_outbound *msg, unsigned partNo, batch *batch, uint64_t timestamp);
 static int findReceipt(uint32_t receipt);
+static void clearReceipt(int recIdx);
 static void compressReceipts();
 static void resendExpiredReceipts(Tox *tox);
+static void resendExpiredPackets(Tox *tox);
 static void sendMore(Tox *tox);
 static void loadPendingSentMessages();
 static void loadPendingSentMessage(uint32_t friend_number, int type, uint64_t id,
@@ -156,6 +285,45 @@ static void messageReady(void *tox_opaque,
                          uint32_t friend_number, int type, const uint8_t *message, size_t length, void *user_data);
 static void processInFragment(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                               size_t length, void *user_data);
+static void processInBatch(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                           size_t length, void *user_data);
+static void processInPart(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type,
+                          uint64_t id, unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                          const uint8_t *data, size_t length, void *user_data);
+static int controlAvailable();
+static int controlSend(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length);
+static bool MY(friend_send_lossless_packet)(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                            TOX_ERR_FRIEND_CUSTOM_PACKET *error);
+static void MY(friend_lossless_packet_cb)(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data);
+static void controlReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data);
+static peer* peerFind(uint32_t friend_number);
+static uint32_t peerCaps(Tox *tox, uint32_t friend_number);
+static void peersForgetOffline(Tox *tox);
+static int msgBinaryUnsendable(Tox *tox, msg_outbound *msg);
+static void msgsFailUnsendable(Tox *tox);
+static ToxDefragmenterStats* statsOf(uint32_t friend_number);
+static void statsPending(const uint32_t *friend_number, ToxDefragmenterStats *stats);
+static void helloReceived(Tox *tox, uint32_t friend_number, const control *c);
+static void sackQuerySend(Tox *tox, msg_outbound *msg);
+static void sackSend(Tox *tox, uint32_t friend_number, uint64_t id, unsigned trigger);
+static void sackReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data);
+static void fragmentReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data);
+static void ackReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data);
+static checksum_record* checksumFind(uint32_t friend_number, uint64_t id);
+static void checksumReceived(uint32_t friend_number, const control *c);
+static int batchAvailable();
+static batch* batchFind(uint32_t friend_number);
+static int batchFits(batch *b, size_t length);
+static uint32_t batchAdd(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length);
+static void batchClose(Tox *tox, batch *b);
+static void batchSend(Tox *tox, batch *b);
+static int batchesSendRefused(Tox *tox, uint32_t friend_number);
+static void batchDelivered(Tox *tox, batch *b, void *user_data);
+static void batchDelete(batch *b);
+static void batchesDeleteAll();
+static void batchesFlush(Tox *tox);
+static int batchSeen(uint32_t friend_number, uint64_t id);
+static void latencyAdd(TOX_DEFRAGMENTER_LATENCY kind, size_t length, uint64_t tm1, uint64_t tm2);
 static void doPeriodic(Tox *tox);
 
 //
@@ -169,14 +337,108 @@ static void* memRealloc(void *mem, unsigned szOld, unsigned szNew) {
   return mem;
 }
 
+static int poolClass(size_t size) {
+  // the class of the smallest blocks that fit the size, -1 when it's too large for the pools
+  if (size <= 32)
+    return 0;
+  unsigned b = 63 - __builtin_clzll(size - 1); // 2^b < size <= 2^(b+1)
+  int c = 2*(b-5) + (size <= (size_t)3 << (b-1) ? 1 : 2);
+  return c < POOL_CLASSES ? c : -1;
+}
+
+static size_t poolClassSize(int c) {
+  return (size_t)(c%2 ? 48 : 32) << c/2;
+}
+
+static void* poolGet(size_t size) {
+  int c = poolClass(size);
+  if (c == -1)
+    return malloc(size);
+  size_t sz = poolClassSize(c);
+  pool_block *b = poolFree[c];
+  if (b) {
+    poolFree[c] = b->next;
+    poolFreeBytes[c] -= sz;
+    return b;
+  }
+  if (sz > POOL_SLAB_ITEM)
+    return malloc(sz);
+  if (poolSlabLeft < sz) {
+    // the tail of the previous slab is left unused
+    pool_block *slab = malloc(POOL_SLAB_SIZE);
+    slab->next = poolSlabs;
+    poolSlabs = slab;
+    poolSlabPos = (uint8_t*)slab + 16;
+    poolSlabLeft = POOL_SLAB_SIZE - 16;
+  }
+  void *mem = poolSlabPos;
+  poolSlabPos += sz;
+  poolSlabLeft -= sz;
+  return mem;
+}
+
+static void poolPut(void *mem, size_t size) {
+  if (!mem)
+    return;
+  int c = poolClass(size);
+  if (c == -1) {
+    free(mem);
+    return;
+  }
+  size_t sz = poolClassSize(c);
+  if (sz > POOL_SLAB_ITEM && poolFreeBytes[c] + sz > POOL_KEEP_BYTES) {
+    free(mem);
+    return;
+  }
+  pool_block *b = mem;
+  b->next = poolFree[c];
+  poolFree[c] = b;
+  poolFreeBytes[c] += sz;
+}
+
+static void poolsRelease() {
+  // all blocks are back by now
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    if (poolClassSize(c) > POOL_SLAB_ITEM)
+      while (poolFree[c]) {
+        pool_block *b = poolFree[c];
+        poolFree[c] = b->next;
+        free(b);
+      }
+    poolFree[c] = NULL;
+    poolFreeBytes[c] = 0;
+  }
+  while (poolSlabs) {
+    pool_block *slab = poolSlabs;
+    poolSlabs = slab->next;
+    free(slab);
+  }
+  poolSlabPos = NULL;
+  poolSlabLeft = 0;
+}
+
+static unsigned bitsNext(const uint64_t *bits, unsigned i, unsigned num) {
+  // the first set bit at i or after it, num when there's none
+  if (i >= num)
+    return num;
+  unsigned w = i/64;
+  uint64_t word = bits[w] & (~(uint64_t)0 << (i%64));
+  while (!word) {
+    if (++w == BITS_WORDS(num))
+      return num;
+    word = bits[w];
+  }
+  return w*64 + __builtin_ctzll(word);
+}
+
 static uint64_t getCurrTimeMs() {
-  struct timeval tm;
-  gettimeofday(&tm, NULL);
-  return tm.tv_sec*1000 + tm.tv_usec/1000;
+  return clockNowMs();
 }
 
 static uint64_t generateMsgId() {
-  uint64_t msgId = getCurrTimeMs();
+  // ids are of the wall clock with the virtual clock too: the markers carry them as 13 digits,
+  // and they are compared with the ids stored before
+  uint64_t msgId = clockWallMs();
   // prevent id collisions in case of a very fast message creation
   while (msgId <= lastMsgId)
     msgId++;
@@ -207,13 +469,32 @@ static uint32_t generateReceiptNo() {
 
 static void initialize() {
   receiptsInitialize();
+  markerMaxSizeEver = markerMaxSizeBytes(INT_MAX, INT_MAX); // the pending messages are split again with it
   loadPendingSentMessages();
-  markerMaxSizeEver = markerMaxSizeBytes(INT_MAX, INT_MAX);
+  undeliveredPending = 1;
 }
 
 static void uninitialize() {
+  undeliveredPending = 0;
   msgsOutboundDeleteAll();
+  poolsRelease();
+  batchesDeleteAll();
   receiptsUninitialize();
+  DEL(peers);
+  peers = NULL;
+  peersAlloc = 0;
+  memset(checksums, 0, sizeof(checksums));
+  checksumsNext = 0;
+  memset(latency, 0, sizeof(latency));
+}
+
+static void deliverUndelivered(Tox *tox, void *user_data) {
+  // inbound messages finished before the restart, and not delivered then, go to the client before the new ones
+  if (!undeliveredPending || !CLIENT(friend_message_cb))
+    return;
+  undeliveredPending = 0;
+  inboundChecksum = NULL; // their checksums are gone with the restart
+  dbDeliverUndelivered(tox, messageReady, user_data);
 }
 
 static void receiptsInitialize() {
@@ -243,17 +524,25 @@ static void MY(callback_friend_message)(Tox *tox, tox_friend_message_cb *callbac
   TOX(callback_friend_message)(tox, MY(friend_message_cb));
 }
 
+static void MY(callback_friend_lossless_packet)(Tox *tox, tox_friend_lossless_packet_cb *callback) {
+  CLIENT(friend_lossless_packet_cb) = callback;
+  TOX(callback_friend_lossless_packet)(tox, MY(friend_lossless_packet_cb));
+}
+
 //
 // thread
 //
 
 static pthread_t thread;
 static int threadStopFlag = 0;
+static uint8_t periodicIterated = 0; // the client iterates Tox, the periodic work is then done there
+static uint64_t periodicTm = 0;
 
 static void* threadRoutine(void *arg) {
   while (!threadStopFlag) {
-    sleep(2);
-    if (toxInstance)
+    clockSleepMs(2000);
+    // the virtual clock only moves with tox_iterate, the periodic work is done there
+    if (toxInstance && !periodicIterated && !clockIsVirtual())
       doPeriodic(toxInstance);
   }
   return NULL;
@@ -270,6 +559,7 @@ static __attribute__((destructor)) void threadFini(void) {
   LOG("stopping thread")
   void *v;
   threadStopFlag = 1;
+  clockWake();
   int res;
   if ((res = pthread_join(thread, &v)))
     ERROR("Failed to stop the thread, error=%d", res)
@@ -292,7 +582,7 @@ static void msgsOutboundLink(msg_outbound *msg) {
 
 static void msgsOutboundUnlink(msg_outbound *msg) {
   if (msg == msgsOutbound) {
-    if (msg->next != msg->prev)
+    if (msg->next != msg)
       msgsOutbound = msg->prev;
     else
       msgsOutbound = NULL;
@@ -304,9 +594,10 @@ static void msgsOutboundUnlink(msg_outbound *msg) {
 static void msgOutboundDelete(msg_outbound *msg) {
   // free
   for (int i = 0; i < msg->numParts; i++)
-    free(msg->fragments[i].data);
-  free(msg->fragments);
-  free(msg);
+    poolPut(msg->fragments[i].data, msg->fragments[i].length);
+  PDELA(msg->fragments, msg->numParts);
+  PDELA(msg->confirmed, 2*BITS_WORDS(msg->numParts));
+  PDEL(msg);
 }
 
 static void msgsOutboundDeleteAll() {
@@ -317,6 +608,17 @@ static void msgsOutboundDeleteAll() {
   }
 }
 
+static msg_outbound* msgOutboundFind(uint32_t friend_number, uint64_t id) {
+  msg_outbound *msg = msgsOutbound;
+  if (msg)
+    do {
+      if (msg->id == id && msg->friend_number == friend_number)
+        return msg;
+      msg = msg->next;
+    } while (msg != msgsOutbound);
+  return NULL;
+}
+
 static int isFriendOnline(Tox *tox, uint32_t friend_number) {
   return TOX(friend_get_connection_status)(tox, friend_number, NULL) != TOX_CONNECTION_NONE;
 }
@@ -324,27 +626,71 @@ static int isFriendOnline(Tox *tox, uint32_t friend_number) {
 static Tox* MY(new)(const struct Tox_Options *options, TOX_ERR_NEW *error) {
   if (toxInstance)
     ERROR("Multiple Tox instances aren't yet suported.")
-  toxInstance = MY(new)(options, error);
+  toxInstance = TOX(new)(options, error);
+  // control packets are received even when the client doesn't use the lossless packets
+  if (toxInstance && controlAvailable())
+    TOX(callback_friend_lossless_packet)(toxInstance, MY(friend_lossless_packet_cb));
   return toxInstance;
 }
 
 static void MY(kill)(Tox *tox) {
   if (toxInstance != tox)
     ERROR("Tox instance mismatch.")
-  MY(kill)(tox);
+  TOX(kill)(tox);
   toxInstance = NULL;
 }
 
+static void MY(iterate)(Tox *tox, void *user_data) {
+  deliverUndelivered(tox, user_data);
+  TOX(iterate)(tox, user_data);
+  batchesFlush(tox);
+  // on the client's thread, the expirations are checked twice within their time
+  uint64_t now = getCurrTimeMs();
+  unsigned intervalMs = params.receiptExpirationTimeMs/2 < 2000 ? params.receiptExpirationTimeMs/2 : 2000;
+  periodicIterated = 1;
+  if (periodicTm + intervalMs <= now) {
+    periodicTm = now;
+    doPeriodic(tox);
+  }
+}
+
+static uint32_t MY(iteration_interval)(const Tox *tox) {
+  // wake up when the open batch is due
+  uint32_t interval = TOX(iteration_interval)(tox);
+  uint64_t now = getCurrTimeMs();
+  for (batch *b = batches; b; b = b->next)
+    if (!b->frame) {
+      uint64_t due = b->openTm + batchParams.delayMs;
+      if (due <= now)
+        return 0;
+      if (due - now < interval)
+        interval = due - now;
+    }
+  return interval;
+}
+
 static uint32_t MY(friend_send_message)(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                         size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error) {
-  // prevent the client from sending the fragment signature
-  if (markerExists(message, length))
+  // prevent the client from sending the fragment or the batch signature
+  if (markerExists(message, length) || markerBatchExists(message, length))
     return 0;
   // send
   if (length <= params.maxMessageLength) {
+    uint32_t receipt = batchAdd(tox, friend_number, type, message, length);
+    if (receipt) {
+      if (error)
+        *error = TOX_ERR_FRIEND_SEND_MESSAGE_OK;
+      return receipt;
+    }
+    // messages stay in order: the message waits while the earlier batch can't be sent
+    if (!batchesSendRefused(tox, friend_number))
+      return 0;
     LOG("SEND", "passing through the short outgoing message of length=%d for friend_number=%d",
       (unsigned)length, friend_number)
-    return TOX(friend_send_message)(tox, friend_number, type, message, length, error);
+    receipt = TOX(friend_send_message)(tox, friend_number, type, message, length, error);
+    if (receipt)
+      statsOf(friend_number)->bytesSent += length;
+    return receipt;
   } else {
     LOG("SEND", "GOT LONG MESSAGE with length=%d for friend_number=%d, splitting ...",
       (unsigned)length, friend_number)
@@ -354,24 +700,22 @@ static uint32_t MY(friend_send_message)(Tox *tox, uint32_t friend_number, TOX_ME
 
 static uint32_t MY(friend_send_message_long)(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                              size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error) {
-  msg_outbound *msg = splitMessage(message, length, params.maxMessageLength, generateMsgId());
+  msg_outbound *msg = splitMessage(message, length, type, generateMsgId());
   msg->friend_number = friend_number;
-  for (unsigned i = 0; i < msg->numParts; i++) {
-    if (msg->numTransit < params.fragmentsAtATime) {
-      if (msgSendPart(tox, msg, i))
-        msg->lastSent = i;
-    } else {
-      break;
-    }
-  }
-  if (msg->numTransit > 0) {
+  msg->type = type;
+  peerCaps(tox, friend_number); // learn the capabilities of the friend early
+  msgChecksumSend(tox, msg);
+  msgSendNextParts(tox, msg);
+  // binary payloads wait for the capabilities of the friend
+  if (msg->numTransit > 0 || (type & CONTROL_TYPE_BINARY)) {
     // fill the remaining fields
-    msg->type = type;
     msg->receipt = generateReceiptNo();
+    msg->sendTm = getCurrTimeMs();
     // insert into the list
     msgsOutboundLink(msg);
+    TRACE(TRACE_LEVEL_MESSAGES, TRACE_MSG_SEND, friend_number, msg->id, length, msg->numParts)
     // add to db
-    dbInsertOutboundMessage(friend_number, type, msg->id, msg->id, msg->numParts,
+    dbInsertOutboundMessage(friend_number, type, msg->id, msg->sendTm, msg->numParts,
                             message, length,
                             msg->receipt);
     // return the receipt
@@ -388,46 +732,60 @@ static uint32_t MY(friend_send_message_long)(Tox *tox, uint32_t friend_number, T
 }
 
 static void msgSendNextParts(Tox *tox, msg_outbound *msg) {
-  // original pass through the fragments
-  for (unsigned i = msg->lastSent+1; i < msg->numParts; i++) {
-    if (msg->numTransit < params.fragmentsAtATime) {
-      if (msgSendPart(tox, msg, i))
-        msg->lastSent = i;
-    } else {
-      break;
-    }
-  }
-  // send fragments that failed before for some reason
-  for (unsigned i = 0; i < msg->numParts; i++) {
-    if (msg->numTransit < params.fragmentsAtATime &&
-        msg->numTransit + msg->numConfirmed < msg->numParts) {
-      if (!msg->fragments[i].receipt &&
-          !msg->fragments[i].confirmed)
-        msgSendPart(tox, msg, i);
-    } else {
-      break;
-    }
+  // idle parts in order, the lost ones and the ones never sent alike, while the window allows: the parts below
+  // idleFrom are skipped, so every call only looks at the parts in transit beyond that, 64 at a time
+  unsigned i = msg->idleFrom;
+  while (msg->numTransit < params.fragmentsAtATime && (i = bitsNext(msg->idle, i, msg->numParts)) < msg->numParts) {
+    msg->idleFrom = i;
+    if (!msgSendPart(tox, msg, i))
+      return; // toxcore doesn't take more now, the rest waits for the next call
+    i++;
   }
+  msg->idleFrom = i;
 }
 
 static void msgIsComplete(Tox *tox, msg_outbound *msg, void *user_data) {
   LOG("SEND", "msg=%p id="FID" msg.numParts=%u, sending receipt %x to the client",
     msg, msg->id, msg->numParts, msg->receipt)
-  CLIENT(friend_read_receipt_cb)(tox, msg->friend_number, msg->receipt, user_data);
+  TRACE(TRACE_LEVEL_MESSAGES, TRACE_MSG_COMPLETE, msg->friend_number, msg->id, msg->numParts, msg->numLoss)
+  latencyAdd(TOX_DEFRAGMENTER_LATENCY_OUTBOUND, msg->length, msg->sendTm, getCurrTimeMs());
+  // cleared and committed first, the message isn't loaded again after a crash, and its receipt isn't repeated
   dbClearOutboundPending(msg->friend_number, msg->id);
+  CLIENT(friend_read_receipt_cb)(tox, msg->friend_number, msg->receipt, user_data);
   msgsOutboundUnlink(msg);
   msgOutboundDelete(msg);
 }
 
 static int msgSendPart(Tox *tox, msg_outbound *msg, unsigned i) {
-  uint32_t receipt = TOX(friend_send_message)(tox, msg->friend_number, msg->type,
-                                              msg->fragments[i].data, msg->fragments[i].length, NULL);
-  if (!receipt)
-    return 0;
-  msg->fragments[i].receipt = receipt;
+  uint32_t caps = peerCaps(tox, msg->friend_number);
+  ToxDefragmenterStats *stats = statsOf(msg->friend_number);
+  if ((msg->type & CONTROL_TYPE_BINARY) && !(caps & CONTROL_CAP_BINARY))
+    return 0; // binary parts only go in the packets to the capable friend
+  // the text part that doesn't fit the packet with its header goes in the message with its marker instead
+  const fragment *f = &msg->fragments[i];
+  if ((msg->type & CONTROL_TYPE_BINARY) ||
+      ((caps & CONTROL_CAP_PACKETS) && controlFragmentSize(f->length - f->markerSize) <= CONTROL_MAX_SIZE)) {
+    if (!msgSendPartPacket(tox, msg, i))
+      return 0;
+    stats->bytesSent += controlFragmentSize(msg->fragments[i].length - msg->fragments[i].markerSize);
+  } else {
+    uint32_t receipt = TOX(friend_send_message)(tox, msg->friend_number, msg->type,
+                                                msg->fragments[i].data, msg->fragments[i].length, NULL);
+    if (!receipt)
+      return 0;
+    msg->fragments[i].receipt = receipt;
+    addReceipt(receipt, msg, i+1, NULL, getCurrTimeMs());
+    stats->bytesSent += msg->fragments[i].length;
+  }
+  stats->fragmentsSent++;
+  if (msg->fragments[i].timesSent)
+    stats->fragmentsResent++;
   msg->fragments[i].timesSent++;
-  addReceipt(receipt, msg, i+1, getCurrTimeMs());
+  msg->fragments[i].sentTm = getCurrTimeMs();
+  TRACE(TRACE_LEVEL_PARTS, TRACE_PART_SEND, msg->friend_number, msg->id, i+1, msg->fragments[i].timesSent)
+  msg->fragments[i].sentSeq = ++msg->sendSeq;
   msg->numTransit++;
+  BITS_CLR(msg->idle, i);
   LOG("SEND", "sent partNo=%u of msg=%p id="FID
              " length=%u of msg=%p part.timesSent=%u msg.numTransit=%u msg.numConfirmed=%u msg.numParts=%u",
     i, msg, msg->id,
@@ -435,41 +793,218 @@ static int msgSendPart(Tox *tox, msg_outbound *msg, unsigned i) {
   return 1;
 }
 
-static msg_outbound* splitMessage(const uint8_t *message, size_t length, size_t maxLength, uint64_t id) {
-  uint8_t maxMarker = markerMaxSizeBytes((length + maxLength-markerMaxSizeEver - 1)/(maxLength-markerMaxSizeEver), length); // conservative estimate
+static int msgSendPartPacket(Tox *tox, msg_outbound *msg, unsigned i) {
+  // the part goes without the marker, the receiver acks it instead of toxcore
+  fragment *f = &msg->fragments[i];
+  uint8_t buf[CONTROL_MAX_SIZE];
+  if (controlFragmentSize(f->length - f->markerSize) > sizeof(buf))
+    return 0;
+  if (!controlSend(tox, msg->friend_number, buf,
+                   controlPrintFragment(buf, msg->type, msg->id, i+1, msg->numParts, f->off, msg->length,
+                                        f->data + f->markerSize, f->length - f->markerSize)))
+    return 0;
+  f->packetTm = getCurrTimeMs();
+  return 1;
+}
+
+static void msgPartUntransit(msg_outbound *msg, unsigned i) {
+  // detach the receipt that the part waits for: it is kept until it arrives late or expires, and is then ignored
+  fragment *f = &msg->fragments[i];
+  int recIdx = f->receipt ? findReceipt(f->receipt) : -1;
+  if (recIdx != -1 && recIdx < receiptsHi && receipts[recIdx].receipt == f->receipt) {
+    receipts[recIdx].msg = NULL;
+    msg->numTransit--;
+  }
+  f->receipt = 0;
+  // a late ack finds the part by its number, and confirms it
+  if (f->packetTm) {
+    f->packetTm = 0;
+    msg->numTransit--;
+  }
+  if (!BITS_GET(msg->confirmed, i))
+    msgPartIdle(msg, i);
+}
+
+static void msgPartConfirmed(msg_outbound *msg, unsigned i) {
+  fragment *f = &msg->fragments[i];
+  if (f->timesSent == 1)
+    latencyAdd(TOX_DEFRAGMENTER_LATENCY_PART_RTT, msg->length, f->sentTm, getCurrTimeMs());
+  BITS_SET(msg->confirmed, i); // before the untransit, so that the part doesn't become idle
+  BITS_CLR(msg->idle, i);
+  msgPartUntransit(msg, i);
+  msg->numConfirmed++;
+  statsOf(msg->friend_number)->fragmentsConfirmed++;
+  TRACE(TRACE_LEVEL_PARTS, TRACE_PART_CONFIRM, msg->friend_number, msg->id, i+1, msg->numConfirmed)
+  if (!msg->crcSent) {
+    poolPut(f->data, f->length);
+    f->data = NULL;
+  }
+  dbOutboundPartConfirmed(msg->friend_number, msg->id, i+1, getCurrTimeMs());
+}
+
+static void msgPartIdle(msg_outbound *msg, unsigned i) {
+  BITS_SET(msg->idle, i);
+  if (i < msg->idleFrom)
+    msg->idleFrom = i;
+}
+
+static int msgAwaitsSack(Tox *tox, msg_outbound *msg) {
+  // parts of the message loaded from db are sent once the receiver tells which ones it already has,
+  // or when it doesn't in time
+  if (!msg->fromDb || msg->sackDone)
+    return 0;
+  uint64_t now = getCurrTimeMs();
+  if (!msg->sackWaitTm)
+    msg->sackWaitTm = now;
+  uint32_t caps = peerCaps(tox, msg->friend_number);
+  if ((caps & CONTROL_CAP_SACK) && !msg->sackQueried)
+    sackQuerySend(tox, msg);
+  if (!controlAvailable() ||
+      (peerFind(msg->friend_number)->known && !(caps & CONTROL_CAP_SACK)) ||
+      msg->sackWaitTm + params.receiptExpirationTimeMs <= now) {
+    msg->sackDone = 1;
+    return 0;
+  }
+  return 1;
+}
+
+static int msgAwaitsVerdict(Tox *tox, msg_outbound *msg) {
+  // all parts are confirmed, and the receiver didn't tell whether the message matches the checksum:
+  // the verdict could be lost when the receiver restarted, the query reminds it
+  if (!msg->crcSent || msg->verified || msg->numConfirmed < msg->numParts)
+    return 0;
+  uint64_t now = getCurrTimeMs();
+  if (msg->verdictTm + params.receiptExpirationTimeMs <= now) {
+    sackQuerySend(tox, msg);
+    msg->verdictTm = now;
+  }
+  return 1;
+}
+
+static void msgContinue(Tox *tox, msg_outbound *msg, void *user_data) {
+  // after some parts are confirmed
+  if (msg->numConfirmed < msg->numParts) {
+    if (isFriendOnline(tox, msg->friend_number)) {
+      msgSendNextParts(tox, msg);
+    } else {
+      LOG("SEND", "skipping msg=%p id="FID
+                 " numParts=%u for friend=%u because this friend isn't online",
+        msg, msg->id, msg->numParts, msg->friend_number)
+    }
+  } else if (msg->crcSent && !msg->verified) {
+    if (!msg->verdictTm)
+      msg->verdictTm = getCurrTimeMs();
+  } else {
+    msgIsComplete(tox, msg, user_data);
+  }
+}
+
+static void msgChecksumSend(Tox *tox, msg_outbound *msg) {
+  if (!(peerCaps(tox, msg->friend_number) & CONTROL_CAP_CHECKSUM))
+    return;
+  uint8_t buf[CONTROL_MAX_SIZE];
+  if (controlSend(tox, msg->friend_number, buf, controlPrintChecksum(buf, msg->id, msg->crc)))
+    msg->crcSent = 1;
+}
+
+static void msgResend(Tox *tox, msg_outbound *msg, void *user_data) {
+  // the receiver got the message corrupt, it is sent again under the new id, and the client's receipt stays
+  uint8_t *message = NEWA(uint8_t, msg->length);
+  for (unsigned i = 0; i < msg->numParts; i++) {
+    fragment *f = &msg->fragments[i];
+    if (!f->data) {
+      WARNING("can't resend the corrupt message for friend=%u msg=%p id="FID": its parts are gone\n",
+        msg->friend_number, msg, msg->id)
+      free(message);
+      msg->verified = 1;
+      for (unsigned j = 0; j < msg->numParts; j++)
+        if (!BITS_GET(msg->confirmed, j))
+          msgPartConfirmed(msg, j);
+      msgContinue(tox, msg, user_data);
+      return;
+    }
+    memcpy(message + f->off, f->data + f->markerSize, f->length - f->markerSize);
+  }
+  WARNING("friend=%u got the corrupt message msg=%p id="FID" length=%u, resending it\n",
+    msg->friend_number, msg, msg->id, (unsigned)msg->length)
+  TRACE(TRACE_LEVEL_MESSAGES, TRACE_PART_RESEND, msg->friend_number, msg->id, 0, TRACE_RESEND_CORRUPT)
+  for (unsigned i = 0; i < msg->numParts; i++)
+    msgPartUntransit(msg, i);
+  msg_outbound *split = splitMessage(message, msg->length, msg->type, generateMsgId());
+  dbClearOutboundPending(msg->friend_number, msg->id);
+  dbInsertOutboundMessage(msg->friend_number, msg->type, split->id, msg->sendTm, split->numParts,
+                          message, msg->length,
+                          msg->receipt);
+  free(message);
+  for (unsigned i = 0; i < msg->numParts; i++)
+    poolPut(msg->fragments[i].data, msg->fragments[i].length);
+  PDELA(msg->fragments, msg->numParts);
+  PDELA(msg->confirmed, 2*BITS_WORDS(msg->numParts));
+  msg->id = split->id;
+  msg->numParts = split->numParts;
+  msg->fragments = split->fragments;
+  msg->confirmed = split->confirmed;
+  msg->idle = split->idle;
+  msg->idleFrom = msg->numTransit = msg->numConfirmed = msg->sendSeq = 0;
+  msg->crcSent = msg->verified = 0;
+  msg->verdictTm = 0;
+  PDEL(split);
+  msgChecksumSend(tox, msg);
+  msgSendNextParts(tox, msg);
+}
+
+static msg_outbound* splitMessage(const uint8_t *message, size_t length, int type, uint64_t id) {
+  // binary parts only go in the packets, without their marker, so they are also sized for the packet
+  size_t maxLength = params.maxMessageLength;
+  size_t maxStep = (type & CONTROL_TYPE_BINARY) ? CONTROL_MAX_SIZE - controlFragmentSize(0) : maxLength;
+  size_t minStep = maxLength-markerMaxSizeEver < maxStep ? maxLength-markerMaxSizeEver : maxStep;
+  uint8_t maxMarker = markerMaxSizeBytes((length + minStep - 1)/minStep, length); // conservative estimate
   maxLength -= maxMarker;
+  if (maxLength > maxStep)
+    maxLength = maxStep;
   const uint8_t *m = message;
   unsigned numParts = (length + maxLength - 1)/maxLength;
-  fragment *fragments = NEWA(fragment, numParts);
+  fragment *fragments = PNEWA(fragment, numParts);
   fragment *f = fragments;
 
   unsigned off = 0;
   unsigned len = length;
+  uint32_t crc = 0;
   for (unsigned partNo = 1; len > 0; partNo++) {
     size_t step = len >= maxLength ? maxLength : len;
     uint8_t marker[maxMarker+1];
     uint8_t markerSize = markerPrint(id, partNo, numParts, off, length, marker);
-    *f = (fragment){.length = markerSize+step, .data = NEWA(uint8_t, markerSize+step), .receipt = 0};
+    *f = (fragment){.length = markerSize+step, .data = PNEWA(uint8_t, markerSize+step), .receipt = 0,
+                    .off = off, .markerSize = markerSize};
     memcpy(f->data, marker, markerSize);
     memcpy(f->data+markerSize, m, step);
+    crc = utilCrc32c(crc, m, step);
     //
     len -= step;
     m   += step;
     off += step;
     f++;
   }
-  msg_outbound *msg = NEW(msg_outbound);
-  *msg = (msg_outbound){.id = id, .numParts = numParts, .fragments = fragments};
+  // all parts are idle
+  unsigned words = BITS_WORDS(numParts);
+  uint64_t *bits = PNEWA(uint64_t, 2*words);
+  memset(bits, 0, words*sizeof(uint64_t));
+  memset(bits + words, 0xff, words*sizeof(uint64_t));
+  if (numParts%64)
+    bits[2*words-1] = ((uint64_t)1 << numParts%64) - 1;
+  msg_outbound *msg = PNEW(msg_outbound);
+  *msg = (msg_outbound){.id = id, .length = length, .crc = crc, .numParts = numParts, .fragments = fragments,
+                        .confirmed = bits, .idle = bits + words};
   return msg;
 }
 
-static void addReceipt(uint32_t receipt, msg_outbound *msg, unsigned partNo, uint64_t timestamp) {
+static void addReceipt(uint32_t receipt, msg_outbound *msg, unsigned partNo, batch *batch, uint64_t timestamp) {
   if (receiptsHi == 0 || receipts[receiptsHi-1].receipt < receipt) {
     if (receiptsHi == receiptsAlloc) {
       receipts = REALLOC(receipts, receipt_record, receiptsAlloc, 2*receiptsAlloc);
       receiptsAlloc *= 2;
     }
-    receipts[receiptsHi] = (receipt_record){.receipt = receipt, .msg = msg, .partNo = partNo, .timestamp = timestamp};
+    receipts[receiptsHi] = (receipt_record){.receipt = receipt, .msg = msg, .batch = batch, .partNo = partNo, .timestamp = timestamp};
     receiptsHi++;
   } else {
     int recIdx = findReceipt(receipt) + 1;
@@ -479,35 +1014,53 @@ static void addReceipt(uint32_t receipt, msg_outbound *msg, unsigned partNo, uin
         receiptsAlloc *= 2;
       }
       MVA(receipts, recIdx, receiptsHi, +16)
-      receipts[recIdx] = (receipt_record){.receipt = receipt, .msg = msg, .partNo = partNo, .timestamp = timestamp};
+      receiptsHi += 16;
+      receipts[recIdx] = (receipt_record){.receipt = receipt, .msg = msg, .batch = batch, .partNo = partNo, .timestamp = timestamp};
     } else {
-      receipts[recIdx] = (receipt_record){.receipt = receipt, .msg = msg, .partNo = partNo, .timestamp = timestamp};
+      receipts[recIdx] = (receipt_record){.receipt = receipt, .msg = msg, .batch = batch, .partNo = partNo, .timestamp = timestamp};
     }
   }
   receiptsNum++;
 }
 
 static int findReceipt(uint32_t receipt) {
+  // receipts are sorted, cleared ones are zero: returns the index of the receipt when it's there,
+  // otherwise the index of the last receipt below it, after which the receipt belongs
   if (receiptsLo == receiptsHi)
     return -1;
   int i1 = receiptsLo;
   int i2 = receiptsHi;
-  while (i1+1 < i2) {
+  while (i1 < i2) {
     int im = (i1 + i2)/2;
     int imu = im;
-    while (imu+1 < i2 && !receipts[imu].receipt)
+    while (imu < i2 && !receipts[imu].receipt)
       imu++;
-    if (imu+1 < i2)
-      if (receipts[imu].receipt < receipt)
-        i1 = imu;
-      else if (receipt < receipts[imu].receipt)
-        i2 = im;
-      else
-        return imu;
-    else
+    if (imu == i2)
+      i2 = im; // only cleared ones in [im,i2)
+    else if (receipts[imu].receipt < receipt)
+      i1 = imu+1;
+    else if (receipt < receipts[imu].receipt)
       i2 = im;
+    else
+      return imu;
   }
-  return receipts[i1].receipt < receipt ? i2 : i1;
+  return i1-1;
+}
+
+static void clearReceipt(int recIdx) {
+  receipts[recIdx].receipt = 0;
+  receiptsNum--;
+  if (recIdx == receiptsLo) {
+    do {
+      receiptsLo++;
+    } while (receiptsLo < receiptsHi && !receipts[receiptsLo].receipt);
+  } else if (recIdx+1 == receiptsHi) {
+    do {
+      receiptsHi--;
+    } while (receiptsLo < receiptsHi && !receipts[receiptsHi-1].receipt);
+  }
+  if (receiptsLo == receiptsHi)
+    receiptsLo = receiptsHi = 0;
 }
 
 static void compressReceipts() {
@@ -530,17 +1083,50 @@ static void resendExpiredReceipts(Tox *tox) {
   uint64_t now = getCurrTimeMs();
   for (int i = receiptsLo; i < receiptsHi; i++)
     if (receipts[i].receipt && receipts[i].timestamp + params.receiptExpirationTimeMs < now) {
-      // clear receipt
-      receipts[i].receipt = 0;
-      receiptsNum--;
+      msg_outbound *msg = receipts[i].msg;
+      batch *b = receipts[i].batch;
+      if (!msg && !b) {
+        // detached receipt never arrived
+        clearReceipt(i);
+        continue;
+      }
+      // detach receipt, it is still recognized when it arrives late
+      receipts[i].msg = NULL;
+      receipts[i].batch = NULL;
+      receipts[i].timestamp = now;
+      if (b) {
+        b->receipt = 0; // batchesFlush sends it again
+        continue;
+      }
+      msg->fragments[receipts[i].partNo-1].receipt = 0;
+      msgPartIdle(msg, receipts[i].partNo-1);
       // clear transit count
-      receipts[i].msg->numTransit--;
-      receipts[i].msg->numLoss++;
+      msg->numTransit--;
+      msg->numLoss++;
       // resend
-      msgSendPart(tox, receipts[i].msg, receipts[i].partNo-1);
+      TRACE(TRACE_LEVEL_MESSAGES, TRACE_PART_RESEND, msg->friend_number, msg->id, receipts[i].partNo, TRACE_RESEND_RECEIPT)
+      msgSendPart(tox, msg, receipts[i].partNo-1);
     }
 }
 
+static void resendExpiredPackets(Tox *tox) {
+  // lossless packets are only lost when the friend goes offline
+  if (!msgsOutbound)
+    return;
+  uint64_t now = getCurrTimeMs();
+  msg_outbound *msg = msgsOutbound;
+  do {
+    for (unsigned i = 0; i < msg->numParts && msg->numTransit; i++)
+      if (msg->fragments[i].packetTm && msg->fragments[i].packetTm + params.receiptExpirationTimeMs < now) {
+        msgPartUntransit(msg, i);
+        msg->numLoss++;
+        TRACE(TRACE_LEVEL_MESSAGES, TRACE_PART_RESEND, msg->friend_number, msg->id, i+1, TRACE_RESEND_PACKET)
+        msgSendPart(tox, msg, i);
+      }
+    msg = msg->next;
+  } while (msg != msgsOutbound);
+}
+
 static void sendMore(Tox *tox) {
   if (!msgsOutbound)
     return;
@@ -550,7 +1136,8 @@ static void sendMore(Tox *tox) {
                " numParts=%u numTransit=%u numConfirmed=%u",
       msg, msg->id, msg->numParts, msg->numTransit, msg->numConfirmed)
     if (isFriendOnline(tox, msg->friend_number)) {
-      msgSendNextParts(tox, msg);
+      if (!msgAwaitsSack(tox, msg) && !msgAwaitsVerdict(tox, msg))
+        msgSendNextParts(tox, msg);
     } else {
       LOG("SEND", "skipping msg=%p id="FID
                  " numParts=%u numConfirmed=%u for friend=%u because this friend isn't onlinen",
@@ -575,7 +1162,7 @@ static void loadPendingSentMessage(uint32_t friend_number, int type, uint64_t id
                                    unsigned lengthConfirmed, int receipt) {
   LOG("SEND", "friend=%u type=%d id="FID" length=%u numConfirmed=%u numParts=%u",
     friend_number, type, id, lengthMessage, numConfirmed, numParts)
-  msg_outbound *msg = splitMessage(message, lengthMessage, params.maxMessageLength, id);
+  msg_outbound *msg = splitMessage(message, lengthMessage, type, id);
   if (msg->numParts != numParts || msg->numParts != lengthConfirmed) {
     WARNING("mismatching number of parts of the pending outbound message for friend=%d msg=%p id="FID
             ": expected %u, got %u parts and %u confirmations, discarding the message\n",
@@ -584,23 +1171,22 @@ static void loadPendingSentMessage(uint32_t friend_number, int type, uint64_t id
     msgOutboundDelete(msg);
     return;
   }
-  for (unsigned i = 0; i < msg->numParts; i++) {
-    msg->fragments[i].confirmed = confirmed[i];
+  // parts are kept even when confirmed: the receiver can still find the message corrupt
+  for (unsigned i = 0; i < msg->numParts; i++)
     if (confirmed[i]) {
-      free(msg->fragments[i].data);
-      msg->fragments[i].data = NULL;
+      BITS_SET(msg->confirmed, i);
+      BITS_CLR(msg->idle, i);
       msg->numConfirmed++;
     }
-  }
-  if (numConfirmed != msg->numConfirmed || numConfirmed > numParts) {
-    WARNING("mismatched or invalid confirmed count for friend=%d msg=%p id="FID": %u vs. %u, discarding the message\n",
-      friend_number, msg, id, numConfirmed, msg->numConfirmed)
-    dbClearOutboundPending(friend_number, id);
-    msgOutboundDelete(msg);
-    return;
-  }
+  // confirmations are written with a delay, so the confirmed count can lag behind the bitmap,
+  // and the bitmap itself can miss the latest confirmations: such parts are just sent again
+  LOG("SEND", "confirmed count for friend=%u msg=%p id="FID": %u in meta vs. %u in bitmap",
+    friend_number, msg, id, numConfirmed, msg->numConfirmed)
   if (msg->numConfirmed < numParts) {
     msg->friend_number = friend_number;
+    msg->type = type;
+    msg->receipt = receipt;
+    msg->sendTm = tm1;
     msg->fromDb = 1;
     msgsOutboundLink(msg);
   } else {
@@ -616,7 +1202,9 @@ static void loadPendingSentMessage(uint32_t friend_number, int type, uint64_t id
 static void MY(friend_read_receipt_cb)(Tox *tox, uint32_t friend_number, uint32_t message_id, void *user_data) {
   LOG("SEND", "GOT receipt: friend_number=%d message_id=%u user_data=%p",
     friend_number, message_id, user_data)
-  if (!tryProcessReceipt(tox, message_id, user_data))
+  int found = tryProcessReceipt(tox, message_id, user_data);
+  TRACE(TRACE_LEVEL_PARTS, TRACE_RECEIPT, friend_number, 0, message_id, found)
+  if (!found)
     CLIENT(friend_read_receipt_cb)(tox, friend_number, message_id, user_data);
 }
 
@@ -624,43 +1212,24 @@ static int tryProcessReceipt(Tox *tox, uint32_t receipt, void *user_data) {
   int recIdx = findReceipt(receipt);
   if (recIdx == -1 || receipts[recIdx].receipt != receipt)
     return (params.receiptRangeLo <= receipt && receipt <= params.receiptRangeHi); // in range -> must be a duplicate receipt
-  receipt_record *r = &receipts[recIdx];
-  msg_outbound *msg = r->msg;
-  fragment *f = &msg->fragments[r->partNo-1];
-  f->receipt = 0;
-  f->confirmed = 1;
-  msg->numConfirmed++;
+  msg_outbound *msg = receipts[recIdx].msg;
+  batch *b = receipts[recIdx].batch;
+  unsigned partNo = receipts[recIdx].partNo;
+  clearReceipt(recIdx);
+  if (b) {
+    batchDelivered(tox, b, user_data);
+    return 1;
+  }
+  if (!msg)
+    return 1; // late receipt of the part that was resent or confirmed by the sack meanwhile
+  msg->fragments[partNo-1].receipt = 0;
   msg->numTransit--;
-  free(f->data);
-  f->data = NULL;
-  dbOutboundPartConfirmed(msg->friend_number, msg->id, r->partNo, getCurrTimeMs());
+  msgPartConfirmed(msg, partNo-1);
   LOG("SEND", "found receipt=%u: msg=%p id="FID" for friend_number=%d"
-             " partNo=%u timeout="FTM" msg.numTransit=%u msg.numConfirmed=%u msg.numParts=%u",
+             " partNo=%u msg.numTransit=%u msg.numConfirmed=%u msg.numParts=%u",
       receipt, msg, msg->id, msg->friend_number,
-      r->partNo, r->timestamp, msg->numTransit, msg->numConfirmed, msg->numParts)
-  if (msg->numConfirmed < msg->numParts)
-    if (isFriendOnline(tox, msg->friend_number)) {
-      msgSendNextParts(tox, msg);
-    } else {
-      LOG("SEND", "skipping msg=%p id="FID
-                 " numParts=%u for friend=%u because this friend isn't online",
-        msg, msg->id, msg->numParts, msg->friend_number)
-    }
-  else
-    msgIsComplete(tox, msg, user_data);
-  // clear the receipt
-  receipts[recIdx].receipt = 0;
-  if (recIdx == receiptsLo) {
-    do {
-      receiptsLo++;
-    } while (receiptsLo < receiptsHi && !receipts[receiptsLo].receipt);
-  } else if (recIdx+1 == receiptsHi) {
-    do {
-      receiptsHi--;
-    } while (receiptsLo < receiptsHi && !receipts[receiptsHi-1].receipt);
-  }
-  if (receiptsLo == receiptsHi)
-    receiptsLo = receiptsHi = 0;
+      partNo, msg->numTransit, msg->numConfirmed, msg->numParts)
+  msgContinue(tox, msg, user_data);
   return 1;
 }
 
@@ -674,8 +1243,12 @@ static int isFragment(const uint8_t *message, size_t length) {
 
 static void MY(friend_message_cb)(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                   size_t length, void *user_data) {
+  deliverUndelivered(tox, user_data);
+  statsOf(friend_number)->bytesReceived += length;
   if (isFragment(message, length))
     processInFragment(tox, friend_number, type, message, length, user_data);
+  else if (markerBatchExists(message, length))
+    processInBatch(tox, friend_number, type, message, length, user_data);
   else {
     LOG("RECV", "passing through the incoming message length=%d", (unsigned)length)
     CLIENT(friend_message_cb)(tox, friend_number, type, message, length, user_data);
@@ -685,6 +1258,26 @@ static void MY(friend_message_cb)(Tox *tox, uint32_t friend_number, TOX_MESSAGE_
 static void messageReady(void *tox_opaque,
                          uint64_t tm1, uint64_t tm2,
                          uint32_t friend_number, int type, const uint8_t *message, size_t length, void *user_data) {
+  checksum_record *ck = inboundChecksum;
+  if (ck && utilCrc32c(0, message, length) != ck->crc) {
+    WARNING("the message of length=%u from friend=%u id="FID" doesn't match its checksum, discarding it\n",
+      (unsigned)length, friend_number, ck->id)
+    ck->corrupt = 1;
+    inboundVerdict = CONTROL_SACK_CORRUPT;
+    return;
+  }
+  inboundVerdict = CONTROL_SACK_DONE;
+  statsOf(friend_number)->messagesCompleted++;
+  latencyAdd(TOX_DEFRAGMENTER_LATENCY_INBOUND, length, tm1, tm2);
+  if (type & CONTROL_TYPE_BINARY) {
+    LOG("RECV", "forwarding the binary payload of length=%u to the client", (unsigned)length)
+    if (CLIENT(friend_binary_cb))
+      CLIENT(friend_binary_cb)((Tox*)tox_opaque, friend_number, message, length, user_data);
+    else
+      WARNING("the binary payload of length=%u from friend=%u is dropped: the client has no binary callback\n",
+        (unsigned)length, friend_number)
+    return;
+  }
   LOG("RECV", "forwarding the message of length=%u to the client", (unsigned)length)
   CLIENT(friend_message_cb)((Tox*)tox_opaque, friend_number, (TOX_MESSAGE_TYPE)type, message, length, user_data);
 }
@@ -697,15 +1290,522 @@ static void processInFragment(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE
                                    &id,
                                    &partNo, &numParts, &off, &sz);
 
+  processInPart(tox, friend_number, type, id, partNo, numParts, off, sz,
+                message + markerSize, length - markerSize, user_data);
+}
+
+static void processInBatch(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                           size_t length, void *user_data) {
+  // the length comes from the peer, so the lengths go on the heap rather than the stack
+  size_t *lengths = NEWA(size_t, length/2 + 1);
+  size_t markerSize;
+  uint64_t id;
+  unsigned num = markerBatchParse(message, length, &id, lengths, &markerSize);
+  if (!num || batchSeen(friend_number, id)) {
+    LOG("RECV", "dropping the malformed or the repeated batch from friend=%u", friend_number)
+    DEL(lengths);
+    return;
+  }
+  LOG("RECV", "passing through %u messages of the batch length=%u", num, (unsigned)length)
+  const uint8_t *m = message + markerSize;
+  for (unsigned i = 0; i < num; m += lengths[i], i++)
+    CLIENT(friend_message_cb)(tox, friend_number, type, m, lengths[i], user_data);
+  DEL(lengths);
+}
+
+static void processInPart(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type,
+                          uint64_t id, unsigned partNo, unsigned numParts, unsigned off, unsigned sz,
+                          const uint8_t *data, size_t length, void *user_data) {
+  // part that came in the message or in the lossless packet
   LOG("RECV", "friend=%u id="FID" length=%u partNo=%u numParts=%u off=%u sz=%u",
     friend_number, id, (unsigned)length, partNo, numParts, off, sz)
+  if (!dbFragmentValid(partNo, numParts, off, sz, length)) {
+    WARNING("dropping the inconsistent part from friend=%u: id="FID" partNo=%u numParts=%u off=%u sz=%u length=%u\n",
+            friend_number, id, partNo, numParts, off, sz, (unsigned)length)
+    return;
+  }
+  uint32_t caps = peerCaps(tox, friend_number);
+  TRACE(TRACE_LEVEL_PARTS, TRACE_PART_RECV, friend_number, id, partNo, length)
+  // messageReady verifies the message against its checksum
+  inboundChecksum = checksumFind(friend_number, id);
+  inboundVerdict = 0;
   dbInsertInboundFragment((void*)tox,
                           friend_number, type,
                           id, partNo, numParts, off, sz,
-                          message + markerSize, length - markerSize,
+                          data, length,
                           getCurrTimeMs(),
                           messageReady,
                           user_data);
+  inboundChecksum = NULL;
+  if (inboundVerdict)
+    TRACE(TRACE_LEVEL_MESSAGES, TRACE_MSG_READY, friend_number, id, sz, inboundVerdict == CONTROL_SACK_CORRUPT)
+  if (inboundVerdict && (caps & CONTROL_CAP_CHECKSUM)) {
+    // the sender keeps the message until it knows the result
+    uint8_t buf[CONTROL_MAX_SIZE];
+    controlSend(tox, friend_number, buf, controlPrintSack(buf, id, inboundVerdict, 0, partNo, 0, 0, NULL));
+  } else if (partNo == numParts && !inboundVerdict && (caps & CONTROL_CAP_SACK)) {
+    // the last part came but the message isn't ready: parts before it are lost, the sender learns which ones right away
+    sackSend(tox, friend_number, id, partNo);
+  }
+}
+
+//
+// CONTROL
+//
+
+static int controlAvailable() {
+  // control packets need the lossless packets in the base API
+  return TOX(friend_send_lossless_packet) && TOX(callback_friend_lossless_packet);
+}
+
+static int controlSend(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length) {
+  // lost control packets only delay the transfer until the timeouts
+  LOG("CONTROL", "sending type=%u length=%u to friend=%u", data[1], (unsigned)length, friend_number)
+  return TOX(friend_send_lossless_packet)(tox, friend_number, data, length, NULL);
+}
+
+static bool MY(friend_send_lossless_packet)(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                            TOX_ERR_FRIEND_CUSTOM_PACKET *error) {
+  // prevent the client from sending the control packets
+  if (length && data[0] == CONTROL_PACKET_ID)
+    return false;
+  return TOX(friend_send_lossless_packet)(tox, friend_number, data, length, error);
+}
+
+static void MY(friend_lossless_packet_cb)(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data) {
+  control c;
+  deliverUndelivered(tox, user_data);
+  if (length && data[0] == CONTROL_PACKET_ID) {
+    if (controlParse(data, length, &c))
+      controlReceived(tox, friend_number, &c, user_data);
+  } else if (CLIENT(friend_lossless_packet_cb)) {
+    CLIENT(friend_lossless_packet_cb)(tox, friend_number, data, length, user_data);
+  }
+}
+
+static void controlReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data) {
+  LOG("CONTROL", "received type=%u from friend=%u", c->type, friend_number)
+  switch (c->type) {
+  case CONTROL_HELLO:
+    helloReceived(tox, friend_number, c);
+    break;
+  case CONTROL_SACK_QUERY:
+    sackSend(tox, friend_number, c->id, 0/*trigger*/);
+    break;
+  case CONTROL_SACK:
+    sackReceived(tox, friend_number, c, user_data);
+    break;
+  case CONTROL_FRAGMENT:
+    fragmentReceived(tox, friend_number, c, user_data);
+    break;
+  case CONTROL_ACK:
+    ackReceived(tox, friend_number, c, user_data);
+    break;
+  case CONTROL_CHECKSUM:
+    checksumReceived(friend_number, c);
+    break;
+  }
+}
+
+static peer* peerFind(uint32_t friend_number) {
+  // friend numbers are small indexes of the friend list, so they index the array
+  if (friend_number >= peersAlloc) {
+    unsigned alloc = peersAlloc ? peersAlloc : 16;
+    while (alloc <= friend_number)
+      alloc *= 2;
+    peers = REALLOC(peers, peer, peersAlloc, alloc);
+    peersAlloc = alloc;
+  }
+  return &peers[friend_number];
+}
+
+static uint32_t peerCaps(Tox *tox, uint32_t friend_number) {
+  // capabilities of the friend's defragmenter, the hello is sent while they aren't known
+  if (!controlAvailable())
+    return 0;
+  peer *p = peerFind(friend_number);
+  if (!p->known) {
+    uint64_t now = getCurrTimeMs();
+    if (p->helloTm + params.receiptExpirationTimeMs <= now) {
+      uint8_t buf[CONTROL_MAX_SIZE];
+      controlSend(tox, friend_number, buf, controlPrintHello(buf, 0/*reply*/, CONTROL_CAPS));
+      p->helloTm = now;
+      p->hellosSent++;
+    }
+  }
+  return p->caps;
+}
+
+static void peersForgetOffline(Tox *tox) {
+  // the friend can come back with another version
+  for (unsigned f = 0; f < peersAlloc; f++)
+    if ((peers[f].known || peers[f].helloTm) && !isFriendOnline(tox, f)) {
+      peers[f].known = 0;
+      peers[f].caps = 0;
+      peers[f].helloTm = 0;
+      peers[f].hellosSent = 0;
+    }
+}
+
+static int msgBinaryUnsendable(Tox *tox, msg_outbound *msg) {
+  // the binary payload can't go to the online friend that answers the hello without the binary capability,
+  // or doesn't answer it at all: the first hello could have been sent while the friend was offline,
+  // so the later one is given the time to be answered
+  if (!(msg->type & CONTROL_TYPE_BINARY) || !isFriendOnline(tox, msg->friend_number))
+    return 0;
+  peer *p = peerFind(msg->friend_number);
+  if (p->known)
+    return !(p->caps & CONTROL_CAP_BINARY);
+  return p->hellosSent >= 2 && p->helloTm + params.receiptExpirationTimeMs <= getCurrTimeMs();
+}
+
+static void msgsFailUnsendable(Tox *tox) {
+  // such payloads fail without the receipt, the scan starts over after each one since the list changes
+  int failed;
+  do {
+    failed = 0;
+    msg_outbound *msg = msgsOutbound;
+    if (msg)
+      do {
+        if (msgBinaryUnsendable(tox, msg)) {
+          WARNING("friend=%u doesn't accept binary payloads, dropping msg=%p id="FID" length=%u\n",
+            msg->friend_number, msg, msg->id, (unsigned)msg->length)
+          statsOf(msg->friend_number)->messagesFailed++;
+          for (unsigned i = 0; i < msg->numParts; i++)
+            msgPartUntransit(msg, i);
+          dbClearOutboundPending(msg->friend_number, msg->id);
+          msgsOutboundUnlink(msg);
+          msgOutboundDelete(msg);
+          failed = 1;
+          break;
+        }
+        msg = msg->next;
+      } while (msg != msgsOutbound);
+  } while (failed);
+}
+
+static ToxDefragmenterStats* statsOf(uint32_t friend_number) {
+  return &peerFind(friend_number)->stats;
+}
+
+static void statsPending(const uint32_t *friend_number, ToxDefragmenterStats *stats) {
+  // current values are collected when asked for, NULL friend_number means all friends
+  dbInboundStats(friend_number, &stats->pendingInboundBytes, &stats->duplicatesDropped);
+  msg_outbound *msg = msgsOutbound;
+  if (msg)
+    do {
+      if (!friend_number || msg->friend_number == *friend_number)
+        for (unsigned i = 0; i < msg->numParts; i++)
+          if (!BITS_GET(msg->confirmed, i))
+            stats->pendingOutboundBytes += msg->fragments[i].length - msg->fragments[i].markerSize;
+      msg = msg->next;
+    } while (msg != msgsOutbound);
+  for (batch *b = batches; b; b = b->next)
+    if (!friend_number || b->friend_number == *friend_number)
+      stats->pendingOutboundBytes += b->size;
+}
+
+static void helloReceived(Tox *tox, uint32_t friend_number, const control *c) {
+  peer *p = peerFind(friend_number);
+  p->known = 1;
+  p->caps = c->caps & CONTROL_CAPS;
+  if (!c->reply) {
+    uint8_t buf[CONTROL_MAX_SIZE];
+    controlSend(tox, friend_number, buf, controlPrintHello(buf, 1/*reply*/, CONTROL_CAPS));
+  }
+  // messages loaded from db wait for this, and so do the binary payloads that weren't sent yet
+  if (!msgsOutbound)
+    return;
+  msg_outbound *msg = msgsOutbound;
+  do {
+    if (msg->friend_number == friend_number) {
+      if ((p->caps & CONTROL_CAP_SACK) && msg->fromDb && !msg->sackDone && !msg->sackQueried) {
+        sackQuerySend(tox, msg);
+      } else if ((p->caps & CONTROL_CAP_BINARY) && (msg->type & CONTROL_TYPE_BINARY) && !msg->fromDb && !msg->sendSeq) {
+        msgChecksumSend(tox, msg);
+        msgSendNextParts(tox, msg);
+      }
+    }
+    msg = msg->next;
+  } while (msg != msgsOutbound);
+}
+
+static void sackQuerySend(Tox *tox, msg_outbound *msg) {
+  // the message loaded from db is announced again, the receiver could have forgotten its checksum
+  if (!msg->crcSent)
+    msgChecksumSend(tox, msg);
+  uint8_t buf[CONTROL_MAX_SIZE];
+  controlSend(tox, msg->friend_number, buf, controlPrintSackQuery(buf, msg->id));
+  msg->sackQueried = 1;
+  msg->sackQuerySeq = msg->sendSeq;
+  msg->sackWaitTm = getCurrTimeMs();
+}
+
+static void sackSend(Tox *tox, uint32_t friend_number, uint64_t id, unsigned trigger) {
+  unsigned numParts;
+  uint8_t *received;
+  uint8_t buf[CONTROL_MAX_SIZE];
+  DbInboundState state = dbInboundReceived(friend_number, id, &numParts, &received);
+  if (state != DB_INBOUND_PARTIAL) {
+    checksum_record *ck = checksumFind(friend_number, id);
+    uint8_t sackState = state != DB_INBOUND_DONE ? CONTROL_SACK_UNKNOWN : ck && ck->corrupt ? CONTROL_SACK_CORRUPT : CONTROL_SACK_DONE;
+    controlSend(tox, friend_number, buf, controlPrintSack(buf, id, sackState, 0, trigger, 0, 0, NULL));
+    return;
+  }
+  // the bitmap of the large message is split between several packets
+  unsigned maxParts = controlSackMaxParts(CONTROL_MAX_SIZE);
+  for (unsigned first = 0; first < numParts; first += maxParts)
+    controlSend(tox, friend_number, buf, controlPrintSack(buf, id, CONTROL_SACK_PARTIAL, numParts, trigger,
+                                                          first, numParts - first < maxParts ? numParts - first : maxParts,
+                                                          received));
+  free(received);
+}
+
+static void sackReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data) {
+  msg_outbound *msg = msgOutboundFind(friend_number, c->id);
+  if (!msg || c->trigger > msg->numParts || (c->state == CONTROL_SACK_PARTIAL && c->numParts != msg->numParts))
+    return;
+  LOG("SEND", "sack for msg=%p id="FID" state=%u trigger=%u first=%u count=%u",
+    msg, msg->id, c->state, c->trigger, c->first, c->count)
+  TRACE(TRACE_LEVEL_MESSAGES, TRACE_SACK, friend_number, msg->id, c->state, c->trigger)
+  msg->sackDone = 1;
+  if (c->state == CONTROL_SACK_CORRUPT) {
+    msgResend(tox, msg, user_data);
+    return;
+  }
+  // the receiver that has the message, or forgot it, verified it
+  if (c->state == CONTROL_SACK_DONE || (c->state == CONTROL_SACK_UNKNOWN && msg->numConfirmed == msg->numParts))
+    msg->verified = 1;
+  // toxcore delivers the messages and the lossless packets in order while connected, so parts
+  // that were sent before the query, or before the part that triggered the sack, and are missing, are lost
+  unsigned lostSeq = c->trigger ? msg->fragments[c->trigger-1].sentSeq : msg->sackQuerySeq+1;
+  // the receiver that restarted before it delivered the message reports the confirmed parts missing
+  int forgot = c->state == CONTROL_SACK_PARTIAL && !c->trigger && msg->crcSent && !msg->verified && msg->verdictTm;
+  for (unsigned i = 0; i < msg->numParts; i++) {
+    fragment *f = &msg->fragments[i];
+    int confirmed = BITS_GET(msg->confirmed, i);
+    if (forgot && confirmed && f->data && i >= c->first && i < c->first + c->count && !BIT_GET(c->bits, i - c->first)) {
+      BITS_CLR(msg->confirmed, i);
+      msgPartIdle(msg, i);
+      msg->numConfirmed--;
+      TRACE(TRACE_LEVEL_MESSAGES, TRACE_PART_RESEND, friend_number, msg->id, i+1, TRACE_RESEND_SACK)
+      continue;
+    }
+    if (confirmed || (c->state == CONTROL_SACK_PARTIAL && (i < c->first || i >= c->first + c->count)))
+      continue;
+    if (c->state == CONTROL_SACK_DONE || (c->state == CONTROL_SACK_PARTIAL && BIT_GET(c->bits, i - c->first))) {
+      msgPartConfirmed(msg, i);
+    } else if ((f->receipt || f->packetTm) && f->sentSeq < lostSeq) {
+      msgPartUntransit(msg, i);
+      msg->numLoss++;
+      TRACE(TRACE_LEVEL_MESSAGES, TRACE_PART_RESEND, friend_number, msg->id, i+1, TRACE_RESEND_SACK)
+    }
+  }
+  msgContinue(tox, msg, user_data);
+}
+
+static void fragmentReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data) {
+  statsOf(friend_number)->bytesReceived += controlFragmentSize(c->length);
+  processInPart(tox, friend_number, (TOX_MESSAGE_TYPE)c->msgType, c->id, c->partNo, c->numParts, c->off, c->size,
+                c->data, c->length, user_data);
+  // the ack stands for the toxcore receipt
+  uint8_t buf[CONTROL_MAX_SIZE];
+  controlSend(tox, friend_number, buf, controlPrintAck(buf, c->id, c->partNo));
+}
+
+static void ackReceived(Tox *tox, uint32_t friend_number, const control *c, void *user_data) {
+  msg_outbound *msg = msgOutboundFind(friend_number, c->id);
+  if (!msg || c->partNo < 1 || c->partNo > msg->numParts || BITS_GET(msg->confirmed, c->partNo-1))
+    return; // duplicate, or the message is complete
+  msgPartConfirmed(msg, c->partNo-1);
+  LOG("SEND", "ack for msg=%p id="FID" partNo=%u msg.numTransit=%u msg.numConfirmed=%u msg.numParts=%u",
+    msg, msg->id, c->partNo, msg->numTransit, msg->numConfirmed, msg->numParts)
+  msgContinue(tox, msg, user_data);
+}
+
+static checksum_record* checksumFind(uint32_t friend_number, uint64_t id) {
+  for (unsigned i = 0; i < CHECKSUMS_NUM; i++)
+    if (checksums[i].id == id && checksums[i].friend_number == friend_number)
+      return &checksums[i];
+  return NULL;
+}
+
+static void checksumReceived(uint32_t friend_number, const control *c) {
+  // the oldest checksum is replaced, messages without it are delivered unverified
+  checksum_record *ck = checksumFind(friend_number, c->id);
+  if (!ck) {
+    ck = &checksums[checksumsNext];
+    checksumsNext = (checksumsNext + 1) % CHECKSUMS_NUM;
+  }
+  *ck = (checksum_record){.friend_number = friend_number, .id = c->id, .crc = c->crc};
+}
+
+//
+// BATCH
+//
+
+static int batchAvailable() {
+  // batches are sent from tox_iterate
+  return controlAvailable() && TOX(iterate) && TOX(iteration_interval);
+}
+
+static batch* batchFind(uint32_t friend_number) {
+  // open batch of the friend
+  for (batch *b = batches; b; b = b->next)
+    if (b->friend_number == friend_number && !b->frame)
+      return b;
+  return NULL;
+}
+
+static int batchFits(batch *b, size_t length) {
+  if (b->num == batchParams.maxMessages)
+    return 0;
+  b->lengths[b->num] = length;
+  return markerBatchSizeBytes(b->lengths, b->num+1) + b->size + length <= params.maxMessageLength;
+}
+
+static uint32_t batchAdd(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length) {
+  // the short message joins the open batch of the friend, 0 means that it should be sent on its own
+  int batching = batchParams.delayMs && batchAvailable() && (peerCaps(tox, friend_number) & CONTROL_CAP_BATCH);
+  batch *b = batchFind(friend_number);
+  // messages stay in order
+  if (b && (!batching || b->type != type || !batchFits(b, length))) {
+    batchClose(tox, b);
+    b = NULL;
+  }
+  if (!batching || markerBatchSizeBytes(&length, 1) + length > params.maxMessageLength)
+    return 0;
+  if (!b) {
+    b = NEW(batch);
+    *b = (batch){.next = batches, .friend_number = friend_number, .type = type,
+                 .lengths = NEWA(size_t, batchParams.maxMessages),
+                 .clientReceipts = NEWA(uint32_t, batchParams.maxMessages),
+                 .data = NEWA(uint8_t, params.maxMessageLength),
+                 .openTm = getCurrTimeMs(), .id = generateMsgId()};
+    batches = b;
+  }
+  memcpy(b->data + b->size, message, length);
+  b->lengths[b->num] = length;
+  b->clientReceipts[b->num] = generateReceiptNo();
+  b->size += length;
+  uint32_t receipt = b->clientReceipts[b->num++];
+  LOG("SEND", "batch=%p for friend=%u got the message of length=%u, num=%u size=%u",
+    b, friend_number, (unsigned)length, b->num, (unsigned)b->size)
+  if (b->num == batchParams.maxMessages)
+    batchClose(tox, b);
+  return receipt;
+}
+
+static void batchClose(Tox *tox, batch *b) {
+  // the single message is framed too: its id lets the receiver drop it when it's sent again
+  size_t markerSize = markerBatchSizeBytes(b->lengths, b->num);
+  b->frame = NEWA(uint8_t, markerSize + b->size);
+  markerBatchPrint(b->id, b->lengths, b->num, b->frame);
+  memcpy(b->frame + markerSize, b->data, b->size);
+  b->frameLength = markerSize + b->size;
+  DEL(b->data);
+  b->data = NULL;
+  batchSend(tox, b);
+}
+
+static void batchSend(Tox *tox, batch *b) {
+  // batches are linked the newest first, the older one of the friend that didn't go is sent before this one
+  for (batch *o = b->next; o; o = o->next)
+    if (o->friend_number == b->friend_number && o->frame && !o->receipt)
+      return;
+  uint32_t receipt = TOX(friend_send_message)(tox, b->friend_number, b->type, b->frame, b->frameLength, NULL);
+  LOG("SEND", "sent batch=%p of num=%u length=%u to friend=%u: receipt=%u",
+    b, b->num, (unsigned)b->frameLength, b->friend_number, receipt)
+  if (!receipt)
+    return; // batchesFlush sends it again
+  statsOf(b->friend_number)->bytesSent += b->frameLength;
+  b->receipt = receipt;
+  addReceipt(receipt, NULL, 0, b, getCurrTimeMs());
+}
+
+static int batchesSendRefused(Tox *tox, uint32_t friend_number) {
+  // closed batches of the friend without the receipt are sent the oldest first, 0 when one still doesn't go
+  for (;;) {
+    batch *oldest = NULL;
+    for (batch *b = batches; b; b = b->next)
+      if (b->friend_number == friend_number && b->frame && !b->receipt)
+        oldest = b;
+    if (!oldest)
+      return 1;
+    batchSend(tox, oldest);
+    if (!oldest->receipt)
+      return 0;
+  }
+}
+
+static void batchDelivered(Tox *tox, batch *b, void *user_data) {
+  for (unsigned i = 0; i < b->num; i++)
+    CLIENT(friend_read_receipt_cb)(tox, b->friend_number, b->clientReceipts[i], user_data);
+  batch **pb = &batches;
+  while (*pb != b)
+    pb = &(*pb)->next;
+  *pb = b->next;
+  batchDelete(b);
+}
+
+static void batchDelete(batch *b) {
+  DEL(b->lengths);
+  DEL(b->clientReceipts);
+  DEL(b->data);
+  DEL(b->frame);
+  DEL(b);
+}
+
+static void batchesDeleteAll() {
+  while (batches) {
+    batch *b = batches;
+    batches = b->next;
+    batchDelete(b);
+  }
+}
+
+static void batchesFlush(Tox *tox) {
+  // close the batches that are due, and send again the ones that didn't go
+  uint64_t now = getCurrTimeMs();
+  for (batch *b = batches; b; b = b->next)
+    if (!b->frame) {
+      if (b->openTm + batchParams.delayMs <= now)
+        batchClose(tox, b);
+    } else if (!b->receipt && isFriendOnline(tox, b->friend_number)) {
+      batchSend(tox, b);
+    }
+}
+
+static int batchSeen(uint32_t friend_number, uint64_t id) {
+  // the batch is sent again when its receipt is late, the oldest id of the friend is replaced
+  peer *p = peerFind(friend_number);
+  for (unsigned i = 0; i < BATCHES_SEEN_NUM; i++)
+    if (p->batchesSeen[i] == id)
+      return 1;
+  p->batchesSeen[p->batchesSeenNext] = id;
+  p->batchesSeenNext = (p->batchesSeenNext + 1) % BATCHES_SEEN_NUM;
+  return 0;
+}
+
+//
+// latency
+//
+
+static void latencyAdd(TOX_DEFRAGMENTER_LATENCY kind, size_t length, uint64_t tm1, uint64_t tm2) {
+  // size classes grow 16 times, buckets 2 times
+  unsigned c = 0;
+  while (c+1 < TOX_DEFRAGMENTER_SIZE_CLASSES && length > (1024u << (4*c)))
+    c++;
+  uint64_t ms = tm2 > tm1 ? tm2 - tm1 : 0;
+  unsigned b = 0;
+  while (b+1 < TOX_DEFRAGMENTER_HIST_BUCKETS && ms >= (1ull << b))
+    b++;
+  ToxDefragmenterHistogram *h = &latency[kind][c];
+  h->counts[b]++;
+  h->num++;
+  h->sumMs += ms;
+  if (h->maxMs < ms)
+    h->maxMs = ms;
 }
 
 //
@@ -719,7 +1819,10 @@ void doPeriodic(Tox *tox) {
   // send
   //compressReceipts();
   resendExpiredReceipts(tox);
+  resendExpiredPackets(tox);
+  msgsFailUnsendable(tox);
   sendMore(tox);
+  peersForgetOffline(tox);
   // db
   dbPeriodic();
 }
@@ -739,9 +1842,17 @@ ToxcoreApi MY(initialize_api)(const ToxcoreApi *api) {
   MY(toxcore_api) = *api;
   MY(toxcore_api).tox_new = MY(new);
   MY(toxcore_api).tox_kill = MY(kill);
+  if (api->tox_iterate)
+    MY(toxcore_api).tox_iterate = MY(iterate);
+  if (batchAvailable())
+    MY(toxcore_api).tox_iteration_interval = MY(iteration_interval);
   MY(toxcore_api).tox_friend_send_message = MY(friend_send_message);
   MY(toxcore_api).tox_callback_friend_read_receipt = MY(callback_friend_read_receipt);
   MY(toxcore_api).tox_callback_friend_message = MY(callback_friend_message);
+  if (controlAvailable()) {
+    MY(toxcore_api).tox_friend_send_lossless_packet = MY(friend_send_lossless_packet);
+    MY(toxcore_api).tox_callback_friend_lossless_packet = MY(callback_friend_lossless_packet);
+  }
   initializedApi = 1;
   if (initializedApi && initializedDb)
     initialize();
@@ -766,6 +1877,15 @@ void MY(initialize_db_inmemory)() {
     initialize();
 }
 
+void MY(initialize_db_journal)(const char *path) {
+  utilInitialize();
+  LOG("INIT", "initialize")
+  dbInitializeJournal(path);
+  initializedDb = 1;
+  if (initializedApi && initializedDb)
+    initialize();
+}
+
 void MY(uninitialize)() {
   LOG("INIT", "finalize")
   uninitialize();
@@ -784,9 +1904,70 @@ int MY(is_receipt_pending)(uint32_t receipt) {
         return 1;
       msg = msg->next;
     } while (msg != msgsOutbound);
+  for (batch *b = batches; b; b = b->next)
+    for (unsigned i = 0; i < b->num; i++)
+      if (b->clientReceipts[i] == receipt)
+        return 1;
   return 0;
 }
 
+uint32_t MY(friend_send_binary)(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                TOX_ERR_FRIEND_SEND_MESSAGE *error) {
+  // binary payloads are sent as the long messages of any length, with the binary flag in their type
+  if (!length || !controlAvailable())
+    return 0;
+  peer *p = peerFind(friend_number);
+  if (p->known && !(p->caps & CONTROL_CAP_BINARY))
+    return 0;
+  LOG("SEND", "GOT BINARY PAYLOAD with length=%u for friend_number=%d", (unsigned)length, friend_number)
+  return MY(friend_send_message_long)(tox, friend_number, (TOX_MESSAGE_TYPE)(TOX_MESSAGE_TYPE_NORMAL | CONTROL_TYPE_BINARY),
+                                      data, length, error);
+}
+
+void MY(callback_friend_binary)(tox_defragmenter_friend_binary_cb *callback) {
+  CLIENT(friend_binary_cb) = callback;
+}
+
+void MY(get_stats)(ToxDefragmenterStats *stats) {
+  *stats = (ToxDefragmenterStats){0};
+  for (unsigned f = 0; f < peersAlloc; f++) {
+    const ToxDefragmenterStats *s = &peers[f].stats;
+    stats->fragmentsSent += s->fragmentsSent;
+    stats->fragmentsResent += s->fragmentsResent;
+    stats->fragmentsConfirmed += s->fragmentsConfirmed;
+    stats->bytesSent += s->bytesSent;
+    stats->bytesReceived += s->bytesReceived;
+    stats->messagesCompleted += s->messagesCompleted;
+    stats->messagesFailed += s->messagesFailed;
+  }
+  stats->receiptsNum = receiptsNum;
+  statsPending(NULL, stats);
+}
+
+void MY(get_friend_stats)(uint32_t friend_number, ToxDefragmenterStats *stats) {
+  *stats = friend_number < peersAlloc ? peers[friend_number].stats : (ToxDefragmenterStats){0};
+  statsPending(&friend_number, stats);
+}
+
+void MY(get_latency)(TOX_DEFRAGMENTER_LATENCY kind, unsigned sizeClass, ToxDefragmenterHistogram *hist) {
+  if (kind > TOX_DEFRAGMENTER_LATENCY_PART_RTT || sizeClass >= TOX_DEFRAGMENTER_SIZE_CLASSES)
+    *hist = (ToxDefragmenterHistogram){{0}};
+  else
+    *hist = latency[kind][sizeClass];
+}
+
+void MY(set_trace_level)(unsigned level) {
+  traceSetLevel(level);
+}
+
+int MY(trace_dump)(const char *path) {
+  return traceDump(path);
+}
+
+void MY(set_clock)(tox_defragmenter_clock_cb *now_ms, void *user_data) {
+  clockSet(now_ms, user_data);
+}
+
 void MY(set_parameters)(unsigned maxMessageLength,
                         unsigned fragmentsAtATime,
                         unsigned receiptExpirationTimeMs,
@@ -798,3 +1979,26 @@ void MY(set_parameters)(unsigned maxMessageLength,
   params = (struct params){maxMessageLength, fragmentsAtATime, receiptExpirationTimeMs, receiptRangeLo, receiptRangeHi};
 }
 
+
+void MY(set_durability)(TOX_DEFRAGMENTER_DURABILITY durability,
+                        unsigned groupCommitTimeMs, unsigned groupCommitOps) {
+  dbSetDurability(durability == TOX_DEFRAGMENTER_DURABILITY_GROUPED ? DB_DURABILITY_GROUPED :
+                  durability == TOX_DEFRAGMENTER_DURABILITY_ASYNC ? DB_DURABILITY_ASYNC : DB_DURABILITY_FULL,
+                  groupCommitTimeMs, groupCommitOps);
+}
+
+void MY(set_batching)(unsigned delayMs, unsigned maxMessages) {
+  if (initializedApi || initializedDb)
+    WARNING("batching should be set in uninitialized state\n")
+  batchParams = (struct batchParams){delayMs, maxMessages ? maxMessages : 32};
+}
+
+void MY(set_gc_parameters)(unsigned inboundHistoryTimeSec, unsigned duplicateFilterCapacity) {
+  dbSetGcParameters(inboundHistoryTimeSec, duplicateFilterCapacity);
+}
+
+void MY(set_inbound_limits)(unsigned maxBytesPerFriend, unsigned maxMessagesPerFriend,
+                            uint64_t maxBytes, unsigned maxMessages,
+                            unsigned idleTimeSec) {
+  dbSetInboundLimits(maxBytesPerFriend, maxMessagesPerFriend, maxBytes, maxMessages, idleTimeSec);
+}
@@ -12,18 +12,123 @@ typedef struct sqlite3 sqlite3;
 extern "C" {
 #endif
 
+typedef enum TOX_DEFRAGMENTER_DURABILITY {
+  TOX_DEFRAGMENTER_DURABILITY_FULL,    // every database operation is committed on its own (default)
+  TOX_DEFRAGMENTER_DURABILITY_GROUPED, // operations are committed together every groupCommitTimeMs or groupCommitOps,
+                                       // whichever comes first, up to that much can be lost on crash
+  TOX_DEFRAGMENTER_DURABILITY_ASYNC    // operations are committed by the writer thread, fragments and sends mostly
+                                       // don't wait for the disk, operations not yet committed are lost on crash
+} TOX_DEFRAGMENTER_DURABILITY;
+
+// counters since the initialization, cumulative unless noted
+typedef struct ToxDefragmenterStats {
+  uint64_t fragmentsSent;        // parts sent, resends included
+  uint64_t fragmentsResent;
+  uint64_t fragmentsConfirmed;   // by the receipts, the acks or the sacks
+  uint64_t bytesSent;            // messages, batches and parts sent for the client, markers and headers included
+  uint64_t bytesReceived;        // same for the received ones
+  uint64_t messagesCompleted;    // reassembled inbound messages passed to the client
+  uint64_t messagesFailed;       // binary payloads dropped without the receipt, see friend_send_binary
+  uint64_t duplicatesDropped;    // inbound parts that were already received
+  uint64_t receiptsNum;          // current: receipts from toxcore that are waited for, only in the totals
+  uint64_t pendingOutboundBytes; // current: parts of the outbound messages and batches not yet confirmed
+  uint64_t pendingInboundBytes;  // current: announced sizes of the incomplete inbound messages
+} ToxDefragmenterStats;
+
+// latency histograms, by the size class of the message: up to 1KB, 16KB, 256KB, 4MB, and larger
+#define TOX_DEFRAGMENTER_SIZE_CLASSES 5
+#define TOX_DEFRAGMENTER_HIST_BUCKETS 24
+typedef enum TOX_DEFRAGMENTER_LATENCY {
+  TOX_DEFRAGMENTER_LATENCY_INBOUND,  // first part received to the message passed to the client
+  TOX_DEFRAGMENTER_LATENCY_OUTBOUND, // send call to the receipt passed to the client
+  TOX_DEFRAGMENTER_LATENCY_PART_RTT  // part sent to confirmed, parts sent more than once aren't counted
+} TOX_DEFRAGMENTER_LATENCY;
+typedef struct ToxDefragmenterHistogram {
+  uint64_t counts[TOX_DEFRAGMENTER_HIST_BUCKETS]; // bucket 0 counts 0 ms, bucket i counts [2^(i-1), 2^i) ms,
+                                                  // and the last one everything above
+  uint64_t num;
+  uint64_t sumMs;
+  uint64_t maxMs;
+} ToxDefragmenterHistogram;
+
 typedef void* (*ToxDefragmenterDbLockCb)(void *user_data);
 typedef void (*ToxDefragmenterDbUnlockCb)(void*, void *user_data);
 
+// Lossless custom packets with the id 0xb4 are reserved for the defragmenters to exchange capabilities and
+// selective acknowledgements, client packets with this id are rejected.
 ToxcoreApi tox_defragmenter_initialize_api(const ToxcoreApi *api);
 void tox_defragmenter_initialize_db(sqlite3 *db, ToxDefragmenterDbLockCb lockCb, ToxDefragmenterDbUnlockCb unlockCb, void *user_data);
-void tox_defragmenter_initialize_db_inmemory(); // in-memory DB, only to be used by clients that can't or don't want to use on-disk DB
+void tox_defragmenter_initialize_db_inmemory(); // in-memory storage without SQLite, only to be used by clients that can't or don't want to use on-disk DB
+void tox_defragmenter_initialize_db_journal(const char *path); // append-only journal file of its own instead of the client's SQLite DB
 void tox_defragmenter_uninitialize();
 int  tox_defragmenter_is_receipt_pending(uint32_t receipt);
 void tox_defragmenter_set_parameters(unsigned maxMessageLength,
                                      unsigned fragmentsAtATime,
                                      unsigned receiptExpirationTimeMs,
                                      uint32_t receiptRangeLo, uint32_t receiptRangeHi);
+// Records of the received messages are kept for inboundHistoryTimeSec (7 days by default) in order to ignore
+// duplicates, after that only their ids are kept in the compact filter sized for duplicateFilterCapacity ids.
+void tox_defragmenter_set_gc_parameters(unsigned inboundHistoryTimeSec, unsigned duplicateFilterCapacity);
+// Limits of the incomplete inbound messages, 0 means no limit: bytes and messages per friend (32MB and 256 by default),
+// bytes and messages of all friends together (256MB and 4096 by default). The bytes include the bitmap of the received
+// parts. New messages over the limits are dropped before anything is stored, and so are incomplete messages without new fragments for idleTimeSec (7 days by default).
+void tox_defragmenter_set_inbound_limits(unsigned maxBytesPerFriend, unsigned maxMessagesPerFriend,
+                                         uint64_t maxBytes, unsigned maxMessages,
+                                         unsigned idleTimeSec);
+// Short messages to the friends that run tox-defragmenter too can be sent in batches: messages sent within delayMs
+// go together in one Tox message, up to maxMessages (32 when 0) and maxMessageLength bytes, and the receiving end
+// passes them to its client one by one. Each message still gets its own receipt. Batches are sent from tox_iterate,
+// and tox_iteration_interval is shortened while the batch waits. Short messages that go on their own keep the order
+// too: 0 is returned for them while the earlier batch of the friend can't be sent. 0 delayMs disables batching (default).
+void tox_defragmenter_set_batching(unsigned delayMs, unsigned maxMessages);
+// Binary payloads, zero bytes included, can be sent to the friends that run tox-defragmenter too. They go in the
+// lossless packets without any text encoding, whatever their length, and the receiving end passes them to its binary
+// callback instead of the message callback. The receipt comes to the read receipt callback like for the messages.
+// 0 is returned when the friend is known not to support them, while its capabilities aren't known yet the payload
+// waits for them. When the online friend doesn't answer the hello within receiptExpirationTimeMs, or turns out not
+// to support them, the payload is dropped with a warning, it gets no receipt and is counted in messagesFailed.
+typedef void tox_defragmenter_friend_binary_cb(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                               void *user_data);
+uint32_t tox_defragmenter_friend_send_binary(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                             TOX_ERR_FRIEND_SEND_MESSAGE *error);
+void tox_defragmenter_callback_friend_binary(tox_defragmenter_friend_binary_cb *callback);
+// Statistics of all friends together, and of one friend. Counters are kept while the friend is offline,
+// and are reset by tox_defragmenter_uninitialize. They should be read on the thread that iterates Tox.
+void tox_defragmenter_get_stats(ToxDefragmenterStats *stats);
+void tox_defragmenter_get_friend_stats(uint32_t friend_number, ToxDefragmenterStats *stats);
+// Latency of the fragmented messages since the initialization, sizeClass is below TOX_DEFRAGMENTER_SIZE_CLASSES.
+void tox_defragmenter_get_latency(TOX_DEFRAGMENTER_LATENCY kind, unsigned sizeClass, ToxDefragmenterHistogram *hist);
+// Tracing records binary events (messages, parts, receipts, resends, db operations with their duration) into
+// the in-memory ring of each thread, which keeps the last 4096 events. Level 0 turns it off (default), 1 traces
+// the messages, the resends, the sacks and the db operations, 2 every part and receipt too. The dump writes
+// the rings into the file that the trace-decode tool prints, it returns 0 on failure.
+void tox_defragmenter_set_trace_level(unsigned level);
+int  tox_defragmenter_trace_dump(const char *path);
+// The clock of the library, in milliseconds, can be replaced with the virtual clock of a simulation, which then
+// runs as fast as the simulation iterates Tox: expirations, resends and the periodic work follow now_ms, and the
+// periodic thread leaves the periodic work to tox_iterate. now_ms should never go back. It should be set before
+// the initialization, NULL restores the default clock: the wall clock advanced by the monotonic clock.
+// Message ids are always taken from the default clock, the peers and the stored ids expect the wall clock times.
+typedef uint64_t tox_defragmenter_clock_cb(void *user_data);
+void tox_defragmenter_set_clock(tox_defragmenter_clock_cb *now_ms, void *user_data);
+// Grouped and async durability keep a transaction open on the database connection between the calls,
+// so they should only be used when the connection isn't shared, or when the client doesn't use
+// transactions of its own on it. Durability should be set before the DB is initialized.
+// Async durability: operations still take effect in order on the calling thread, and the writer thread
+// commits them in the same order, so a crash only loses the operations after the last commit, never
+// the earlier ones. The client can get the receipt of the message that isn't yet committed.
+// The calling thread still waits for the disk: the writer's commit holds the database, so the operation
+// that comes during it waits for it, and the delivery of the message and of the read receipt (see below)
+// commits on the calling thread.
+// The SQLite database and the journal mark the inbound message as delivered, and commit this, before the client
+// gets it, so it is never delivered twice, also after a crash, but the crash during the callback loses the message,
+// unless the client stores it within the callback in its own transaction on the same SQLite connection.
+// The message that was complete in the SQLite database, but not yet marked when the crash came, is delivered
+// from its stored parts with the first tox_iterate or callback after the restart.
+// Likewise the sent message is cleared, and this is committed, before the client gets its read receipt,
+// so the receipt is never repeated, and the crash during the receipt callback loses the receipt.
+void tox_defragmenter_set_durability(TOX_DEFRAGMENTER_DURABILITY durability,
+                                     unsigned groupCommitTimeMs, unsigned groupCommitOps);
 
 #ifdef __cplusplus
 }
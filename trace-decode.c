@@ -0,0 +1,93 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+// trace-decode: prints the trace written by tox_defragmenter_trace_dump, events of all threads in time order
+
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char *typeNames[] = {
+  [TRACE_MSG_SEND]     = "msg-send",
+  [TRACE_MSG_COMPLETE] = "msg-complete",
+  [TRACE_MSG_READY]    = "msg-ready",
+  [TRACE_PART_SEND]    = "part-send",
+  [TRACE_PART_RESEND]  = "part-resend",
+  [TRACE_PART_CONFIRM] = "part-confirm",
+  [TRACE_PART_RECV]    = "part-recv",
+  [TRACE_RECEIPT]      = "receipt",
+  [TRACE_SACK]         = "sack",
+  [TRACE_DB_OP]        = "db"
+};
+static const char *argNames[][2] = {
+  [TRACE_MSG_SEND]     = {"length", "numParts"},
+  [TRACE_MSG_COMPLETE] = {"numParts", "numLoss"},
+  [TRACE_MSG_READY]    = {"length", "corrupt"},
+  [TRACE_PART_SEND]    = {"partNo", "timesSent"},
+  [TRACE_PART_RESEND]  = {"partNo", "reason"},
+  [TRACE_PART_CONFIRM] = {"partNo", "numConfirmed"},
+  [TRACE_PART_RECV]    = {"partNo", "length"},
+  [TRACE_RECEIPT]      = {"receipt", "found"},
+  [TRACE_SACK]         = {"state", "trigger"},
+  [TRACE_DB_OP]        = {"op", "us"}
+};
+static const char *resendReasons[] = {"?", "receipt", "packet", "sack", "corrupt"};
+static const char *dbOps[] = {"?", "insert-inbound", "insert-outbound", "part-confirmed", "clear-outbound",
+                              "inbound-received", "periodic"};
+#define NUM(arr) (sizeof(arr)/sizeof(arr[0]))
+
+static int cmpEvents(const void *e1, const void *e2) {
+  uint64_t tm1 = ((const trace_event*)e1)->tm, tm2 = ((const trace_event*)e2)->tm;
+  return tm1 < tm2 ? -1 : tm1 > tm2 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: trace-decode {trace-file}\n");
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (!file) {
+    fprintf(stderr, "can't open %s\n", argv[1]);
+    return 1;
+  }
+  char magic[8];
+  uint32_t hdr[2];
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) ||
+      fread(hdr, sizeof(hdr), 1, file) != 1 || hdr[0] != TRACE_VERSION || hdr[1] != sizeof(trace_event)) {
+    fprintf(stderr, "%s isn't the trace of this version\n", argv[1]);
+    return 1;
+  }
+  // read all events
+  size_t num = 0, alloc = 4096;
+  trace_event *events = malloc(alloc*sizeof(trace_event));
+  while (fread(&events[num], sizeof(trace_event), 1, file) == 1)
+    if (++num == alloc)
+      events = realloc(events, (alloc *= 2)*sizeof(trace_event));
+  fclose(file);
+  qsort(events, num, sizeof(trace_event), cmpEvents);
+  // print
+  for (size_t i = 0; i < num; i++) {
+    const trace_event *e = &events[i];
+    uint64_t tm = e->tm - events[0].tm;
+    printf("%"PRIu64".%06u T%u ", tm/1000000, (unsigned)(tm%1000000), e->thread);
+    if (e->type >= NUM(typeNames) || !typeNames[e->type]) {
+      printf("type=%u friend=%u id=%"PRIu64" a=%u b=%u\n", e->type, e->friend_number, e->id, e->a, e->b);
+      continue;
+    }
+    printf("%s friend=%u", typeNames[e->type], e->friend_number);
+    if (e->id)
+      printf(" id=%"PRIu64, e->id);
+    if (e->type == TRACE_PART_RESEND)
+      printf(" partNo=%u reason=%s\n", e->a, resendReasons[e->b < NUM(resendReasons) ? e->b : 0]);
+    else if (e->type == TRACE_DB_OP)
+      printf(" op=%s us=%u\n", dbOps[e->a < NUM(dbOps) ? e->a : 0], e->b);
+    else
+      printf(" %s=%u %s=%u\n", argNames[e->type][0], e->a, argNames[e->type][1], e->b);
+  }
+  free(events);
+  return 0;
+}
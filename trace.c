@@ -0,0 +1,90 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include "common.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_EVENTS 4096 // per thread, a power of 2
+#define RINGS_MAX   32   // threads beyond that aren't traced
+
+typedef struct trace_ring {
+  uint64_t    pos;       // events written so far, only the owner thread writes
+  trace_event events[RING_EVENTS];
+} trace_ring;
+
+FUNC_LOCAL int traceLevel = TRACE_LEVEL_OFF;
+static trace_ring *rings[RINGS_MAX];
+static unsigned ringsNum = 0;
+static __thread trace_ring *ring = NULL;
+static __thread uint8_t ringFailed = 0;
+
+// internal declarations
+
+static trace_ring* ringCreate();
+
+// functions
+
+FUNC_LOCAL void traceSetLevel(int level) {
+  traceLevel = level;
+}
+
+FUNC_LOCAL uint64_t traceTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+FUNC_LOCAL void traceEvent(TraceType type, uint32_t friend_number, uint64_t id, uint32_t a, uint32_t b) {
+  if (!ring && (ringFailed || !(ring = ringCreate())))
+    return;
+  uint64_t pos = ring->pos;
+  ring->events[pos % RING_EVENTS] = (trace_event){.tm = traceTime(), .id = id, .friend_number = friend_number,
+                                                  .type = type, .a = a, .b = b};
+  // the event is complete before the dump can see it
+  __atomic_store_n(&ring->pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+FUNC_LOCAL int traceDump(const char *path) {
+  // events that their thread overwrites during the dump can be torn, the ring number is set here
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return 0;
+  uint32_t hdr[2] = {TRACE_VERSION, sizeof(trace_event)};
+  int ok = fwrite(TRACE_MAGIC, 8, 1, file) == 1 && fwrite(hdr, sizeof(hdr), 1, file) == 1;
+  unsigned num = __atomic_load_n(&ringsNum, __ATOMIC_ACQUIRE);
+  for (unsigned r = 0; r < num && r < RINGS_MAX && ok; r++) {
+    trace_ring *rg = __atomic_load_n(&rings[r], __ATOMIC_ACQUIRE);
+    if (!rg)
+      continue;
+    uint64_t end = __atomic_load_n(&rg->pos, __ATOMIC_ACQUIRE);
+    for (uint64_t p = end > RING_EVENTS ? end - RING_EVENTS : 0; p < end && ok; p++) {
+      trace_event e = rg->events[p % RING_EVENTS];
+      e.thread = r;
+      ok = fwrite(&e, sizeof(e), 1, file) == 1;
+    }
+  }
+  return fclose(file) == 0 && ok;
+}
+
+// internal definitions
+
+static trace_ring* ringCreate() {
+  unsigned r = __atomic_fetch_add(&ringsNum, 1, __ATOMIC_ACQ_REL);
+  if (r >= RINGS_MAX) {
+    ringFailed = 1;
+    return NULL;
+  }
+  trace_ring *rg = calloc(1, sizeof(trace_ring));
+  if (!rg) {
+    ringFailed = 1;
+    return NULL;
+  }
+  // rings stay for the life of the process, the events of the finished threads are still dumped
+  __atomic_store_n(&rings[r], rg, __ATOMIC_RELEASE);
+  return rg;
+}
@@ -0,0 +1,69 @@
+//
+// Copyright © 2017 by Yuri Victorovich. All rights reserved.
+//
+
+#include <stdint.h>
+
+// Trace: fixed-size binary events are recorded into the ring of the thread that produces them, the rings
+// are only written by their threads, so recording takes no locks. The file written by traceDump is decoded
+// with trace-decode.
+
+#define TRACE_MAGIC   "TXDTRACE"
+#define TRACE_VERSION 1
+
+// levels
+#define TRACE_LEVEL_OFF      0
+#define TRACE_LEVEL_MESSAGES 1 // messages, resends, sacks, db operations
+#define TRACE_LEVEL_PARTS    2 // every part and receipt too
+
+// event types, the meaning of a and b follows the name
+typedef enum TraceType {
+  TRACE_MSG_SEND = 1,  // outbound message accepted: length numParts
+  TRACE_MSG_COMPLETE,  // outbound message delivered: numParts numLoss
+  TRACE_MSG_READY,     // inbound message reassembled: length corrupt
+  TRACE_PART_SEND,     // part sent: partNo timesSent
+  TRACE_PART_RESEND,   // part is sent again: partNo reason (TRACE_RESEND_*)
+  TRACE_PART_CONFIRM,  // part confirmed: partNo numConfirmed
+  TRACE_PART_RECV,     // inbound part: partNo length
+  TRACE_RECEIPT,       // receipt from toxcore: receipt found
+  TRACE_SACK,          // sack received: state trigger
+  TRACE_DB_OP          // db operation: op (TRACE_DB_*) duration in microseconds
+} TraceType;
+
+// reasons of the resend
+#define TRACE_RESEND_RECEIPT 1 // toxcore receipt expired
+#define TRACE_RESEND_PACKET  2 // ack of the lossless packet expired
+#define TRACE_RESEND_SACK    3 // sack reported the part missing
+#define TRACE_RESEND_CORRUPT 4 // receiver found the message corrupt, the message is sent again
+
+// db operations
+#define TRACE_DB_INSERT_INBOUND   1
+#define TRACE_DB_INSERT_OUTBOUND  2
+#define TRACE_DB_PART_CONFIRMED   3
+#define TRACE_DB_CLEAR_OUTBOUND   4
+#define TRACE_DB_INBOUND_RECEIVED 5
+#define TRACE_DB_PERIODIC         6
+
+typedef struct trace_event {
+  uint64_t tm;            // microseconds of the monotonic clock
+  uint64_t id;            // message id, 0 when there's none
+  uint32_t friend_number;
+  uint16_t type;
+  uint16_t thread;        // ring number
+  uint32_t a;
+  uint32_t b;
+} trace_event;
+
+extern int traceLevel;
+
+#define TRACE(level, type, friend_number, id, a, b) \
+  { if (traceLevel >= (level)) traceEvent(type, friend_number, id, a, b); }
+// start and end of the timed operation, the start is 0 when tracing is off
+#define TRACE_START() (traceLevel >= TRACE_LEVEL_MESSAGES ? traceTime() : 0)
+#define TRACE_DB(op, friend_number, id, start) \
+  { if ((start) && traceLevel >= TRACE_LEVEL_MESSAGES) traceEvent(TRACE_DB_OP, friend_number, id, op, traceTime() - (start)); }
+
+void traceSetLevel(int level);
+uint64_t traceTime();
+void traceEvent(TraceType type, uint32_t friend_number, uint64_t id, uint32_t a, uint32_t b);
+int traceDump(const char *path);
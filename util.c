@@ -8,7 +8,40 @@
 #include <sys/time.h>
 #include <stdarg.h>
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_HW
+#define CRC_HW_TARGET         __attribute__((target("sse4.2")))
+#define CRC_HW_U8(crc, b)     _mm_crc32_u8(crc, b)
+#define CRC_HW_U64(crc, w)    (uint32_t)_mm_crc32_u64(crc, w)
+#define CRC_HW_AVAILABLE()    (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"))
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_HW
+#define CRC_HW_TARGET
+#define CRC_HW_U8(crc, b)     __crc32cb(crc, b)
+#define CRC_HW_U64(crc, w)    __crc32cd(crc, w)
+#define CRC_HW_AVAILABLE()    1
+#endif
+#define CRC_LANE 4096
+
 static struct timeval tmInitialized = {0};
+static uint32_t crcTable[8][256];
+#if defined(CRC_HW)
+static uint32_t crcLaneShift[32];
+static int crcHw = 0;
+#endif
+
+// internal declarations
+
+static __attribute__((constructor)) void crcInit();
+static uint32_t crc32cSw(uint32_t crc, const uint8_t *data, size_t length);
+#if defined(CRC_HW)
+static uint32_t crcShift(uint32_t crc);
+static uint32_t crc32cHw(uint32_t crc, const uint8_t *data, size_t length);
+#endif
+
+// functions
 
 FUNC_LOCAL void utilInitialize() {
   gettimeofday(&tmInitialized, NULL);
@@ -41,3 +74,80 @@ FUNC_LOCAL void utilLog(const char *function, const char *section, const char *f
   printf("%s\n", msg);
 }
 
+
+FUNC_LOCAL uint32_t utilCrc32c(uint32_t crc, const uint8_t *data, size_t length) {
+  // CRC-32C (Castagnoli) with the CPU instructions when they are available
+  crc = ~crc;
+#if defined(CRC_HW)
+  if (crcHw)
+    return ~crc32cHw(crc, data, length);
+#endif
+  return ~crc32cSw(crc, data, length);
+}
+
+// internal definitions
+
+static void crcInit() {
+  // tables over the reflected polynomial: crcTable[k][b] is the register after the byte b followed by k zero bytes
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+    crcTable[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int k = 1; k < 8; k++)
+      crcTable[k][i] = crcTable[0][crcTable[k-1][i] & 0xff] ^ (crcTable[k-1][i] >> 8);
+#if defined(CRC_HW)
+  for (int i = 0; i < 32; i++) {
+    uint32_t c = 1u << i;
+    for (int n = 0; n < CRC_LANE; n++)
+      c = crcTable[0][c & 0xff] ^ (c >> 8);
+    crcLaneShift[i] = c;
+  }
+  crcHw = CRC_HW_AVAILABLE();
+#endif
+}
+
+static uint32_t crc32cSw(uint32_t crc, const uint8_t *data, size_t length) {
+  // slicing by 8 bytes
+  for (; length >= 8; length -= 8, data += 8) {
+    uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+    crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^ crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+          crcTable[3][data[4]] ^ crcTable[2][data[5]] ^ crcTable[1][data[6]] ^ crcTable[0][data[7]];
+  }
+  while (length--)
+    crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(CRC_HW)
+static uint32_t crcShift(uint32_t crc) {
+  // register after CRC_LANE zero bytes, the register is linear in its initial value
+  uint32_t r = 0;
+  for (int i = 0; crc; i++, crc >>= 1)
+    if (crc & 1)
+      r ^= crcLaneShift[i];
+  return r;
+}
+
+CRC_HW_TARGET static uint32_t crc32cHw(uint32_t crc, const uint8_t *data, size_t length) {
+  for (; length && ((uintptr_t)data & 7); length--)
+    crc = CRC_HW_U8(crc, *data++);
+  // three lanes at a time hide the latency of the instruction, they are combined with crcShift
+  for (; length >= 3*CRC_LANE; length -= 3*CRC_LANE, data += 3*CRC_LANE) {
+    uint32_t crc1 = 0, crc2 = 0;
+    for (const uint8_t *p = data, *e = data + CRC_LANE; p < e; p += 8) {
+      crc  = CRC_HW_U64(crc,  *(const uint64_t*)p);
+      crc1 = CRC_HW_U64(crc1, *(const uint64_t*)(p + CRC_LANE));
+      crc2 = CRC_HW_U64(crc2, *(const uint64_t*)(p + 2*CRC_LANE));
+    }
+    crc = crcShift(crcShift(crc) ^ crc1) ^ crc2;
+  }
+  for (; length >= 8; length -= 8, data += 8)
+    crc = CRC_HW_U64(crc, *(const uint64_t*)data);
+  while (length--)
+    crc = CRC_HW_U8(crc, *data++);
+  return crc;
+}
+#endif
@@ -2,6 +2,10 @@
 // Copyright © 2017 by Yuri Victorovich. All rights reserved.
 //
 
+#include <stdint.h>
+#include <stddef.h>
+
 void utilInitialize();
 void utilUninitialize();
 void utilLog(const char *function, const char *section, const char *fmt, ...);
+uint32_t utilCrc32c(uint32_t crc, const uint8_t *data, size_t length);